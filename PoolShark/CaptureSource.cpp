@@ -0,0 +1,170 @@
+#include "stdafx.h"
+#include "CaptureSource.h"
+#include <Exception.h>
+#include <opencv2/videoio/videoio.hpp>     // cv::VideoCapture
+
+
+
+DECLARE_LOG_SRC("CaptureSource", LOGCAT_Common);
+
+
+CaptureSource::CaptureSource(QObject* parent)
+	: QObject(parent)
+{
+	m_pTask = new LambdaTask("CaptureSource", Task::NoAutoRethrow, this);
+
+	// Errors end the capture, RunCapture() reports them through Ended()
+	m_pTask->DisableExceptionHandlingAssert();
+}
+
+CaptureSource::~CaptureSource()
+{
+	Close();
+}
+
+void CaptureSource::SetCapacity(int iFrames)
+{
+	m_iCapacity = qMax(1, iFrames);
+}
+
+int CaptureSource::Capacity() const
+{
+	return m_iCapacity;
+}
+
+void CaptureSource::Open(const QString& sSource)
+{
+	Close();
+
+	{
+		QMutexLocker lock(&m_mutex);
+		m_vectRing = QVector<Frame>(m_iCapacity);
+		m_iHead = 0;
+		m_iCount = 0;
+		m_stats = Stats();
+	}
+
+	// Opening a stream can take a while, so that happens on the task too
+	m_pTask->Start([this, sSource]() { RunCapture(sSource); });
+}
+
+void CaptureSource::Close()
+{
+	// A read in progress can't be interrupted, this waits for it
+	m_pTask->StopAsync();
+	m_pTask->StopSync();
+
+	QMutexLocker lock(&m_mutex);
+	m_vectRing.clear();
+	m_iHead = 0;
+	m_iCount = 0;
+}
+
+bool CaptureSource::IsOpen()
+{
+	return m_pTask->IsRunning();
+}
+
+bool CaptureSource::Take(Frame& frame)
+{
+	QMutexLocker lock(&m_mutex);
+	if (0 == m_iCount)
+		return false;
+
+	frame = m_vectRing.at(m_iHead);
+	m_vectRing[m_iHead] = Frame();
+	m_iHead = (m_iHead + 1) % m_vectRing.count();
+	--m_iCount;
+	return true;
+}
+
+CaptureSource::Stats CaptureSource::GetStats() const
+{
+	QMutexLocker lock(&m_mutex);
+	Stats stats = m_stats;
+	stats.iQueued = m_iCount;
+	return stats;
+}
+
+void CaptureSource::Push(const Frame& frame)
+{
+	bool bWasEmpty = false;
+	{
+		QMutexLocker lock(&m_mutex);
+
+		// Full, make room by letting the oldest go
+		int iCapacity = m_vectRing.count();
+		if (m_iCount == iCapacity)
+		{
+			m_iHead = (m_iHead + 1) % iCapacity;
+			--m_iCount;
+			++m_stats.iDropped;
+		}
+		m_vectRing[(m_iHead + m_iCount) % iCapacity] = frame;
+		bWasEmpty = 0 == m_iCount++;
+		++m_stats.iGrabbed;
+	}
+
+	// The consumer takes what's there once it's free, one signal is enough
+	if (bWasEmpty)
+		emit FrameAvailable();
+}
+
+void CaptureSource::RunCapture(const QString& sSource)
+{
+	QString sReason;
+	try
+	{
+		// A bare number is a camera index
+		cv::VideoCapture cap;
+		bool bIndex = false;
+		int iIndex = sSource.toInt(&bIndex);
+		if (bIndex)
+			cap.open(iIndex);
+		else
+			cap.open(sSource.toStdString());
+		if (!cap.isOpened())
+			EXERR("CAP1", "Could not open '%s'", qPrintable(sSource));
+
+		// A file would otherwise be read as fast as it decodes
+		double dFrameMs = 0.0;
+		double dFps = cap.get(cv::CAP_PROP_FPS);
+		if (QFileInfo(sSource).isFile() && dFps > 0.0)
+			dFrameMs = 1000.0 / dFps;
+		LOGINFO("Capturing from '%s', %.1f fps", qPrintable(sSource), dFps);
+
+		QElapsedTimer timer;
+		timer.start();
+		for (qint64 iFrame = 1; ; ++iFrame)
+		{
+			m_pTask->CheckAbort();
+
+			Frame frame;
+			if (!cap.read(frame.img) || frame.img.empty())
+			{
+				sReason = "End of stream";
+				break;
+			}
+			frame.iTimestampMs = QDateTime::currentMSecsSinceEpoch();
+			Push(frame);
+
+			if (dFrameMs > 0.0)
+			{
+				int iWaitMs = qRound(iFrame * dFrameMs - timer.elapsed());
+				if (iWaitMs > 0)
+					m_pTask->SleepMs(iWaitMs);
+			}
+		}
+	}
+	catch (const Task::ExceptionStopReq&)
+	{
+		throw;	// Close(), nothing to report
+	}
+	catch (const std::exception& e)
+	{
+		sReason = e.what();
+	}
+
+	LOGINFO("Capture from '%s' ended: %s", qPrintable(sSource), qPrintable(sReason));
+	emit Ended(sReason);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <LambdaTask.h>
+#include <QMutex>
+#include <QVector>
+#include <opencv2/core/core.hpp>
+
+
+/**
+@brief Grabs frames from a camera, a stream or a video file in the background
+
+Frames go into a ring with a fixed number of slots. When the consumer
+falls behind and the ring is full, the oldest frame is dropped to make
+room. That keeps memory bounded and keeps what gets run close to what the
+camera sees now. Drops are counted, see GetStats().
+
+The source is anything cv::VideoCapture opens, like an MJPEG or RTSP URL
+or a camera index. A video file is played at its own frame rate, so it can
+stand in for a camera.
+*/
+class CaptureSource : public QObject
+{
+	Q_OBJECT
+public:
+	CaptureSource(QObject* parent = nullptr);
+	~CaptureSource();
+
+	void SetCapacity(int iFrames);	///< Slots in the ring, takes effect on the next Open()
+	int Capacity() const;
+
+	void Open(const QString& sSource);	///< Starts grabbing, closes the one before first
+	void Close();
+	bool IsOpen();
+
+	struct Frame {
+		cv::Mat img;
+		qint64 iTimestampMs = 0;	///< When it was grabbed, ms since epoch
+	};
+	bool Take(Frame& frame);	///< The oldest one in the ring, false if it's empty
+
+	struct Stats {
+		qint64 iGrabbed = 0;
+		qint64 iDropped = 0;	///< Pushed out of a full ring
+		int iQueued = 0;
+	};
+	Stats GetStats() const;
+
+signals:
+	void FrameAvailable();		///< The ring isn't empty anymore
+	void Ended(QString sReason);	///< The source ran out or failed, not sent for Close()
+
+private:
+	LambdaTask* m_pTask = nullptr;
+	int m_iCapacity = 4;
+
+	mutable QMutex m_mutex;		///< Protects everything below
+	QVector<Frame> m_vectRing;
+	int m_iHead = 0;	///< Oldest frame
+	int m_iCount = 0;
+	Stats m_stats;
+
+	void RunCapture(const QString& sSource);
+	void Push(const Frame& frame);
+};
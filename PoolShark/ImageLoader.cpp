@@ -0,0 +1,200 @@
+#include "stdafx.h"
+#include "ImageLoader.h"
+#include <QImageReader>
+#include <opencv2/imgcodecs/imgcodecs.hpp>     // cv::imread()
+
+
+
+DECLARE_LOG_SRC("ImageLoader", LOGCAT_Common);
+
+
+ImageLoader::ImageLoader(QObject* parent)
+	: QObject(parent)
+{
+	// Decoding is mostly entropy decoding, one file per core
+	int iWorkers = qMax(1, QThread::idealThreadCount());
+	for (int w = 0; w < iWorkers; ++w)
+	{
+		LambdaTask* pTask = new LambdaTask(QString("ImageLoader%1").arg(w), Task::NoAutoRethrow, this);
+
+		// Errors are logged per file in RunWorker()
+		pTask->DisableExceptionHandlingAssert();
+		m_vectWorkers += pTask;
+	}
+	m_vectBusy.fill(false, iWorkers);
+}
+
+ImageLoader::~ImageLoader()
+{
+	Stop();
+}
+
+void ImageLoader::Load(const QStringList& slFiles, int iStandInMaxSide)
+{
+	Stop();
+
+	m_slFiles = slFiles;
+	m_iStandInMaxSide = iStandInMaxSide;
+	m_vectFullQueued.fill(0 == iStandInMaxSide, slFiles.count());
+	if (slFiles.isEmpty())
+	{
+		emit Finished();
+		return;
+	}
+
+	for (int i = 0; i < slFiles.count(); ++i)
+	{
+		Job job;
+		job.iImage = i;
+		job.bFull = 0 == iStandInMaxSide;
+		Queue(job);
+	}
+}
+
+void ImageLoader::LoadFull(int iImage)
+{
+	if (iImage < 0 || iImage >= m_vectFullQueued.count() || m_vectFullQueued.at(iImage))
+		return;
+	m_vectFullQueued[iImage] = true;
+
+	Job job;
+	job.iImage = iImage;
+	job.bFull = true;
+	Queue(job);
+}
+
+void ImageLoader::Queue(const Job& job)
+{
+	++m_iOutstanding;
+
+	// Wake up a worker for it unless enough are going already
+	int iWorker = -1;
+	{
+		QMutexLocker lock(&m_mutex);
+		m_listQueue += job;
+		int iBusy = m_vectBusy.count(true);
+		if (iBusy < m_listQueue.count())
+		{
+			iWorker = m_vectBusy.indexOf(false);
+			if (iWorker >= 0)
+				m_vectBusy[iWorker] = true;
+		}
+	}
+	if (iWorker < 0)
+		return;
+
+	// It may still be on its way out from running out of jobs before
+	LambdaTask* pTask = m_vectWorkers.at(iWorker);
+	pTask->WaitForFinished();
+	int iGeneration = m_iGeneration;
+	pTask->Start([this, iWorker, iGeneration]() { RunWorker(iWorker, iGeneration); });
+}
+
+void ImageLoader::Stop()
+{
+	{
+		QMutexLocker lock(&m_mutex);
+		m_listQueue.clear();
+	}
+	for (LambdaTask* pTask : m_vectWorkers)
+		pTask->StopAsync();
+	for (LambdaTask* pTask : m_vectWorkers)
+		pTask->StopSync();
+	m_vectBusy.fill(false);
+
+	// Whatever they finished is still queued up for us, ignore it
+	++m_iGeneration;
+	m_iOutstanding = 0;
+}
+
+bool ImageLoader::IsLoading() const
+{
+	return m_iOutstanding > 0;
+}
+
+int ImageLoader::ReducedFactor(const QString& sFile, int iMaxSide)
+{
+	// Only reads the header
+	QSize size = QImageReader(sFile).size();
+	if (!size.isValid())
+		return 1;
+
+	// Halved until it fits, like the executor's previews
+	int iSide = qMax(size.width(), size.height());
+	int iFactor = 1;
+	while (iFactor < 8 && iSide / iFactor > iMaxSide)
+		iFactor *= 2;
+	return iFactor;
+}
+
+void ImageLoader::RunWorker(int iWorker, int iGeneration)
+{
+	LambdaTask* pTask = m_vectWorkers.at(iWorker);
+	for (;;)
+	{
+		Job job;
+		{
+			QMutexLocker lock(&m_mutex);
+			if (m_listQueue.isEmpty())
+			{
+				m_vectBusy[iWorker] = false;
+				return;
+			}
+			job = m_listQueue.takeFirst();
+		}
+		pTask->CheckAbort();
+
+		const QString& sFile = m_slFiles.at(job.iImage);
+		int iFactor = job.bFull ? 1 : ReducedFactor(sFile, m_iStandInMaxSide);
+		int iFlags = cv::IMREAD_COLOR;
+		if (8 == iFactor)
+			iFlags = cv::IMREAD_REDUCED_COLOR_8;
+		else if (4 == iFactor)
+			iFlags = cv::IMREAD_REDUCED_COLOR_4;
+		else if (2 == iFactor)
+			iFlags = cv::IMREAD_REDUCED_COLOR_2;
+
+		// Too small to bother, the stand-in is the real thing
+		job.bFull = 1 == iFactor;
+
+		cv::UMat img;
+		try
+		{
+			cv::Mat mat = cv::imread(qPrintable(sFile), iFlags);
+			if (mat.empty())
+				LOGWRN("Could not read image '%s'", qPrintable(sFile));
+			else
+				img = mat.getUMat(cv::ACCESS_READ);
+		}
+		catch (const cv::Exception& e)
+		{
+			LOGWRN("Could not read image '%s': %s", qPrintable(sFile), e.what());
+		}
+
+		// Back to the thread we belong to
+		double dScale = 1.0 / iFactor;
+		QMetaObject::invokeMethod(this, [this, iGeneration, job, img, dScale]() {
+			OnDecoded(iGeneration, job, img, dScale);
+		}, Qt::QueuedConnection);
+	}
+}
+
+void ImageLoader::OnDecoded(int iGeneration, const Job& job, const cv::UMat& img, double dScale)
+{
+	// Finished by workers of an earlier Load()
+	if (iGeneration != m_iGeneration)
+		return;
+
+	// Delivered, a later LoadFull() decodes it again
+	if (job.bFull)
+		m_vectFullQueued[job.iImage] = false;
+	if (!img.empty())
+	{
+		if (job.bFull)
+			emit ImageLoaded(job.iImage, img);
+		else
+			emit StandInLoaded(job.iImage, img, dScale);
+	}
+	if (0 == --m_iOutstanding)
+		emit Finished();
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <LambdaTask.h>
+#include <QObject>
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
+#include "Pipeline.h"
+
+/**
+@brief Decodes image files on a pool of worker tasks
+
+Load() starts on all the files at once and hands each image out as soon
+as it is decoded, in whatever order they finish, so the first ones can be
+worked on while the rest are still loading. Signals come on the thread
+that called Load().
+
+Given a size to fit, Load() only decodes a stand-in of each file at first.
+JPEG decoders can skip most of the work for 1/2, 1/4 or 1/8 size, so it
+asks for the file halved until it fits, 1/8 at most. The full size decode
+waits for LoadFull(), for when something needs the real thing. It can be
+asked for again once delivered, as whoever needed it may have let it go.
+
+A new Load() stops the one in progress first. A decode can't be
+interrupted, so that waits for at most one file per worker, and anything
+they finish after is thrown away.
+*/
+class ImageLoader : public QObject
+{
+	Q_OBJECT
+public:
+	ImageLoader(QObject* parent = nullptr);
+	~ImageLoader();
+
+	/// Decode stand-ins halved to fit in iStandInMaxSide, or the full
+	/// images if that's 0
+	void Load(const QStringList& slFiles, int iStandInMaxSide = 0);
+	void Stop();
+	bool IsLoading() const;
+
+public slots:
+	void LoadFull(int iImage);	///< Queue the full size decode of a file, unless queued already
+
+signals:
+	void StandInLoaded(int iImage, cv::UMat img, double dScale);
+	void ImageLoaded(int iImage, cv::UMat img);		///< Full size
+	void Finished();	///< Nothing left queued or decoding
+
+private:
+	struct Job {
+		int iImage = 0;
+		bool bFull = false;
+	};
+
+	mutable QMutex m_mutex;		///< Protects m_listQueue and m_vectBusy
+	QList<Job> m_listQueue;
+	QVector<LambdaTask*> m_vectWorkers;
+	QVector<bool> m_vectBusy;	///< Per worker, it has been started and hasn't run out of jobs
+
+	// Only changed while no workers run
+	QStringList m_slFiles;
+	int m_iStandInMaxSide = 0;
+
+	QVector<bool> m_vectFullQueued;		///< Until the full size decode is delivered
+	int m_iGeneration = 0;		///< Bumped by every Stop(), to spot late arrivals
+	int m_iOutstanding = 0;		///< Jobs of this generation not reported yet
+
+	void Queue(const Job& job);
+	void RunWorker(int iWorker, int iGeneration);
+	static int ReducedFactor(const QString& sFile, int iMaxSide);	///< 1, 2, 4 or 8
+	void OnDecoded(int iGeneration, const Job& job, const cv::UMat& img, double dScale);
+};
@@ -40,11 +40,27 @@ void ImagePane::resizeEvent(QResizeEvent* event)
 }
 
 
+void ImagePane::showEvent(QShowEvent* event)
+{
+    QWidget::showEvent(event);
+    if (m_bStale)
+        Refresh();
+}
+
+
 void ImagePane::Refresh()
 {
     if (0 == m_originalImage.rows || 0 == m_originalImage.cols)
         return;
 
+    // Nobody would see it
+    if (!isVisible())
+    {
+        m_bStale = true;
+        return;
+    }
+    m_bStale = false;
+
     // Scale the image to fit. Consider the aspect ratios.
     int iPaneWidth = this->size().width();
     int iPaneHeight = this->size().height();
@@ -81,6 +97,16 @@ void ImagePane::Refresh()
     cv::Mat imgTarget;
     cv::resize(imgCropped, imgTarget, dsize, dScale, dScale);
 
+    // Draw the overlay in color at the size it is shown
+    if (!m_overlay.IsEmpty())
+    {
+        if (imgTarget.depth() != CV_8U)
+            cv::convertScaleAbs(imgTarget, imgTarget);
+        if (1 == imgTarget.channels())
+            cv::cvtColor(imgTarget, imgTarget, cv::COLOR_GRAY2BGR);
+        m_overlay.Draw(imgTarget, dScale, cv::Point2d(m_ptRoi.x + iMarginLeft, m_ptRoi.y + iMarginTop));
+    }
+
     // Convert to a QImage and display it
     QImage qimg = Mat2QImage(imgTarget);
     ui.wImage->setPixmap(QPixmap::fromImage(qimg));
@@ -94,9 +120,11 @@ void ImagePane::Init(const QString& sLabel)
 }
 
 
-void ImagePane::SetImage(const cv::UMat& matImg)
+void ImagePane::SetImage(const PipelineData& data)
 {
-    m_originalImage = matImg;
+    m_originalImage = data.img;
+    m_overlay = data.overlay;
+    m_ptRoi = data.FrameRect().tl();
     Refresh();
 }
 
@@ -3,11 +3,16 @@
 #include <QWidget>
 #include "ui_ImagePane.h"
 #include <opencv2/core/core.hpp>
+#include "Pipeline.h"
 
 /**
 @brief Show a single image in a region
 
 This also shows an image number or whatever we want.
+
+The step's overlay is drawn on top after scaling to the pane, so it costs
+pane pixels rather than image pixels. Nothing is drawn while the pane is
+hidden, it catches up when shown.
 */
 class ImagePane : public QWidget
 {
@@ -17,15 +22,19 @@ public:
 	ImagePane(QWidget *parent = Q_NULLPTR);
 
 	void Init(const QString& sLabel);
-	void SetImage(const cv::UMat& img);
+	void SetImage(const PipelineData& data);
 
 protected:
 	virtual void resizeEvent(QResizeEvent* event) override;
+	virtual void showEvent(QShowEvent* event) override;
 
 private:
 	Ui::ImagePane ui;
 
 	cv::UMat m_originalImage;
+	PipelineOverlay m_overlay;
+	cv::Point m_ptRoi;		///< Where the image is in the frame, the overlay is in frame pixels
+	bool m_bStale = false;	///< Changed while hidden
 	void Refresh();	///< Redraw the image
 	QImage Mat2QImage(const cv::Mat& mat);
 };
@@ -71,11 +71,11 @@ void ImagesWindow::RebuildPanes(int iCount)
 	}
 }
 
-void ImagesWindow::SetImages(const QList<cv::UMat>& listImages)
+void ImagesWindow::SetImages(const QList<PipelineData>& listOutputs)
 {
-	if (listImages.count() != m_listPanes.count())
-		RebuildPanes(listImages.count());
+	if (listOutputs.count() != m_listPanes.count())
+		RebuildPanes(listOutputs.count());
 
-	for (int i = 0; i < listImages.count(); ++i)
-		m_listPanes[i]->SetImage(listImages.at(i));
+	for (int i = 0; i < listOutputs.count(); ++i)
+		m_listPanes[i]->SetImage(listOutputs.at(i));
 }
@@ -2,6 +2,7 @@
 
 #include <QWidget>
 #include <opencv2/core/core.hpp>
+#include "Pipeline.h"
 #include "ui_ImagesWindow.h"
 #include <QImage>
 
@@ -13,7 +14,7 @@ public:
 	ImagesWindow(const QString& sTitle, QWidget *parent = Q_NULLPTR);
 	~ImagesWindow();
 
-	void SetImages(const QList<cv::UMat>& listImages);
+	void SetImages(const QList<PipelineData>& listOutputs);
 
 signals:
 	void Closing();
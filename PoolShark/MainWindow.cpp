@@ -3,13 +3,13 @@
 #include "PipelineFactory.h"
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QInputDialog>
 #include "ParamWidgetFloat.h"
 #include "ParamWidgetInt.h"
 #include "ParamWidgetEnum.h"
 #include <QStandardPaths>
 #include "Cursor.h"
 
-#include <opencv2/imgcodecs/imgcodecs.hpp>     // cv::imread()
 #include <opencv2/core/cuda.hpp>
 
 
@@ -25,6 +25,7 @@ MainWindow::MainWindow(QWidget *parent)
 
 	m_pPipelineModel = new PipelineTableModel(this);
 	ui.viewSteps->setModel(m_pPipelineModel);
+	ui.viewSteps->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeToContents);
 
 	m_pInputsModel = new QStringListModel(this);
 	ui.viewInputs->setModel(m_pInputsModel);
@@ -47,6 +48,27 @@ MainWindow::MainWindow(QWidget *parent)
 	ui.pbAddStep->setMenu(pAddStepMenu);
 	VERIFY(connect(ui.viewSteps->selectionModel(), &QItemSelectionModel::currentRowChanged, this, &MainWindow::OnViewSteps_currentRowChanged));
 
+	// The pipeline runs in the background, results come back one image at a time
+	m_pExecutor = new PipelineExecutor(this);
+	VERIFY(connect(m_pExecutor, &PipelineExecutor::ImageProcessed, this, &MainWindow::OnImageProcessed));
+	VERIFY(connect(m_pExecutor, &PipelineExecutor::ImageDropped, this, &MainWindow::OnImageDropped));
+	VERIFY(connect(m_pExecutor, &PipelineExecutor::Idle, this, &MainWindow::OnPipelineIdle));
+	ui.sbThreads->setMaximum(m_pExecutor->MaxThreads());
+	ui.sbThreads->setValue(m_pExecutor->MaxThreads());
+
+	// Inputs are decoded in the background and run as they come in. A
+	// reduced size decode comes first, the full size one when a full size
+	// run asks for it.
+	m_pLoader = new ImageLoader(this);
+	VERIFY(connect(m_pLoader, &ImageLoader::StandInLoaded, this, &MainWindow::OnStandInLoaded));
+	VERIFY(connect(m_pLoader, &ImageLoader::ImageLoaded, this, &MainWindow::OnImageLoaded));
+	VERIFY(connect(m_pExecutor, &PipelineExecutor::InputNeeded, m_pLoader, &ImageLoader::LoadFull));
+
+	// Live frames wait in the capture's ring until the executor is free
+	m_pCapture = new CaptureSource(this);
+	VERIFY(connect(m_pCapture, &CaptureSource::FrameAvailable, this, &MainWindow::OnCaptureFrameAvailable));
+	VERIFY(connect(m_pCapture, &CaptureSource::Ended, this, &MainWindow::OnCaptureEnded));
+
 	LoadConfig();
 
 	UpdateControls();
@@ -118,6 +140,11 @@ void MainWindow::LoadConfig()
 
 void MainWindow::closeEvent(QCloseEvent* event)
 {
+	// Don't let results show up for windows we are about to delete
+	m_pLoader->Stop();
+	m_pCapture->Close();
+	m_pExecutor->StopSync();
+
 	// Must save before we delete image windows
 	SaveConfig();
 
@@ -146,7 +173,7 @@ void MainWindow::OnViewSteps_currentRowChanged(const QModelIndex& current, const
 
 void MainWindow::UpdateControls()
 {
-	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedIndexes();
+	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedRows();
 	int iStepSelectionCount = mil.count();
 	int iSelRow = ui.viewSteps->selectionModel()->currentIndex().row();
 	//LOGINFO("iSelCount=%d iSelRow=%d", iStepSelectionCount, iSelRow);
@@ -184,6 +211,8 @@ void MainWindow::SetPipeline(const Pipeline& pipeline)
 
 void MainWindow::PipelineChanged()
 {
+	// New steps need an id before anything can be wired to them
+	m_doc.pipeline.AssignIds();
 	m_pPipelineModel->SetPipeline(&m_doc.pipeline);
 	BuildParamWidgets();
 
@@ -212,6 +241,27 @@ void MainWindow::BuildParamWidgets()
 	{
 		const PipelineStep& ps = m_doc.pipeline.at(iStep);
 
+		// Where each input comes from, as an enum of the other steps
+		for (const QString& sPort : ps.InputPorts())
+		{
+			QStringList slSources;
+			slSources << QString("Previous step=%1").arg(PipelineStep::SRC_Previous);
+			slSources << QString("Input image=%1").arg(PipelineStep::SRC_Input);
+			for (int iOther = 0; iOther < m_doc.pipeline.count(); ++iOther)
+			{
+				const PipelineStep& psOther = m_doc.pipeline.at(iOther);
+				if (iOther != iStep)
+					slSources << QString("%1 %2=%3").arg(iOther).arg(psOther.Name()).arg(psOther.Id());
+			}
+
+			PipelineStepParam psParam(sPort, slSources);
+			psParam.SetValue(ps.Source(sPort));
+			QString sCookie = QString("%1:port:%2").arg(iStep).arg(sPort);
+			QWidget* pW = CreateParamWidget(ps.Name(), psParam, sCookie);
+			ui.paramsLayout->addWidget(pW);
+			m_listSliders += pW;
+		}
+
 		for (int iParam = 0; iParam < ps.Params().count(); ++iParam)
 		{
 			QString sCookie = QString("%1:%2").arg(iStep).arg(iParam);
@@ -237,6 +287,8 @@ QWidget* MainWindow::CreateParamWidget(const QString& sStepName, const PipelineS
 	{
 		ParamWidgetInt* pW = new ParamWidgetInt(sParamFullName, psParam, vCookie, this);
 		VERIFY(connect(pW, &ParamWidgetInt::ParamChanged, this, &MainWindow::OnParamChanged));
+		VERIFY(connect(pW, &ParamWidgetInt::DragStarted, this, &MainWindow::OnParamDragStarted));
+		VERIFY(connect(pW, &ParamWidgetInt::DragFinished, this, &MainWindow::OnParamDragFinished));
 		return pW;
 	}
 
@@ -244,6 +296,8 @@ QWidget* MainWindow::CreateParamWidget(const QString& sStepName, const PipelineS
 	{
 		ParamWidgetFloat* pW = new ParamWidgetFloat(sParamFullName, psParam, vCookie, this);
 		VERIFY(connect(pW, &ParamWidgetFloat::ParamChanged, this, &MainWindow::OnParamChanged));
+		VERIFY(connect(pW, &ParamWidgetFloat::DragStarted, this, &MainWindow::OnParamDragStarted));
+		VERIFY(connect(pW, &ParamWidgetFloat::DragFinished, this, &MainWindow::OnParamDragFinished));
 		return pW;
 	}
 
@@ -280,32 +334,90 @@ void MainWindow::OnParamChanged(QVariant vCookie, QVariant vNewValue)
 
 	// Decode the cookie, it contains two indexes into the tree
 	QStringList sl = vCookie.toString().split(':');
-	Q_ASSERT(sl.count() == 2);
 	int iStep  = sl.at(0).toInt();
+
+	// Or a step index and input port. Rewiring bumps the revision too.
+	if (sl.count() == 3 && sl.at(1) == "port")
+	{
+		m_doc.pipeline[iStep].SetSource(sl.at(2), vNewValue.toInt());
+		SetPipelineDirty();
+		return;
+	}
+
+	Q_ASSERT(sl.count() == 2);
 	int iParam = sl.at(1).toInt();
 
-	// Go set the value
-	m_doc.pipeline[iStep].Params()[iParam].SetValue(vNewValue);
+	// Go set the value. This bumps the step revision so only
+	// this step and the ones after it get recomputed.
+	m_doc.pipeline[iStep].SetParamVal(iParam, vNewValue);
 	SetPipelineDirty();
 }
 
+void MainWindow::OnParamDragStarted()
+{
+	m_bDragging = true;
+}
+
+void MainWindow::OnParamDragFinished()
+{
+	m_bDragging = false;
+
+	// What's showing is a preview, redo it at full size
+	if (ui.cbAutoApply->isChecked())
+		ProcessPipeline();
+}
+
 void MainWindow::ProcessPipeline()
 {
-	WaitCursor wc;
 	CreateImageWindows();
 
-	// Rerun the entire pipeline for each input image
-	for (int i = 0; i < m_listInputImages.count(); ++i)
-	{
-		// Run the pipeline
-		QList<cv::UMat> listImages = m_doc.pipeline.Process(m_listInputImages.at(i));
-		m_listImageWindows[i]->SetImages(listImages);
-	}
+	// Hand a snapshot to the executor. If it is still working on an older
+	// one, that run gets cancelled. Each image reruns from its first dirty step.
+	// While a slider is being dragged only a reduced resolution preview is run.
+	ui.statusBar->showMessage(m_bDragging ? "Preview..." : "Processing...");
+	m_pExecutor->Submit(m_doc.pipeline, m_bDragging);
 
 	m_bParamsDirty = false;
 	UpdateControls();
 }
 
+void MainWindow::OnImageProcessed(int iImage, QList<PipelineData> listOutputs)
+{
+	// The window may have been closed by the user
+	if (iImage >= m_listImageWindows.count() || nullptr == m_listImageWindows.at(iImage))
+		return;
+
+	m_listImageWindows[iImage]->SetImages(listOutputs);
+	m_pPipelineModel->RefreshStats();
+
+	if (m_live.bOn)
+	{
+		++m_live.iRun;
+		m_live.bBusy = false;
+		FeedLiveFrame();
+	}
+}
+
+void MainWindow::OnImageDropped(int iImage)
+{
+	Q_UNUSED(iImage);
+	if (!m_live.bOn)
+		return;
+
+	++m_live.iOverBudget;
+	m_live.bBusy = false;
+	FeedLiveFrame();
+}
+
+void MainWindow::OnPipelineIdle()
+{
+	if (m_live.bOn)
+		ShowLiveStatus();
+	else
+		ui.statusBar->clearMessage();
+	m_pPipelineModel->RefreshStats();
+}
+
 void MainWindow::on_pbApply_clicked()
 {
 	ProcessPipeline();
@@ -316,6 +428,11 @@ void MainWindow::on_cbAutoApply_clicked()
 	UpdateControls();
 }
 
+void MainWindow::on_sbThreads_valueChanged(int iThreads)
+{
+	m_pExecutor->SetMaxThreads(iThreads);
+}
+
 
 void MainWindow::on_pbSelectInputs_clicked()
 {
@@ -330,24 +447,111 @@ void MainWindow::on_pbSelectInputs_clicked()
 
 void MainWindow::SetInputFiles(QStringList slFiles)
 {
+	StopLive();
 	m_slInputFiles = slFiles;
 	m_pInputsModel->setStringList(m_slInputFiles);
 
-	// Load all the images
-	m_listInputImages.clear();
-	for (int i = 0; i < m_slInputFiles.count(); ++i)
-	{
-		cv::Mat img = cv::imread(qPrintable(m_slInputFiles.at(i)));
-		m_listInputImages += img.getUMat(cv::ACCESS_READ);
-	}
+	// Empty slots for now, the windows open right away and each image is
+	// run as soon as it has been decoded, see OnImageLoaded(). The decoded
+	// images are kept by the executor only, within its input budget.
+	// New inputs mean nothing the executor has cached is any good.
+	m_pExecutor->SetInputs(QList<cv::UMat>(m_slInputFiles.count()));
+	m_pLoader->Load(m_slInputFiles, PipelineExecutor::ms_iPreviewMaxSide);
 
 	ProcessPipeline();
 }
 
+void MainWindow::OnStandInLoaded(int iImage, cv::UMat img, double dScale)
+{
+	m_pExecutor->SetStandIn(iImage, img, dScale);
+}
+
+void MainWindow::OnImageLoaded(int iImage, cv::UMat img)
+{
+	m_pExecutor->SetInput(iImage, img);
+}
+
+void MainWindow::on_actionOpenStream_triggered()
+{
+	bool bOk = false;
+	QString sSource = QInputDialog::getText(this, "Open Stream", "Camera URL (MJPEG, RTSP), video file or camera index:",
+		QLineEdit::Normal, m_live.sSource, &bOk).trimmed();
+	if (!bOk || sSource.isEmpty())
+		return;
+	StartLive(sSource);
+}
+
+void MainWindow::StartLive(const QString& sSource)
+{
+	// Nothing of the files loaded before may come in over the frames
+	m_pLoader->Load(QStringList());
+	m_slInputFiles = QStringList() << sSource;
+	m_pInputsModel->setStringList(m_slInputFiles);
+
+	m_live.bOn = true;
+	m_live.bBusy = false;
+	m_live.sSource = sSource;
+	m_live.iRun = 0;
+	m_live.iOverBudget = 0;
+	m_live.sEnded.clear();
+
+	// One input, every frame replaces the one before
+	m_pExecutor->SetInputs(QList<cv::UMat>(1), true);
+	m_pCapture->Open(sSource);
+
+	ProcessPipeline();
+}
+
+void MainWindow::StopLive()
+{
+	if (!m_live.bOn)
+		return;
+	m_pCapture->Close();
+	m_live.bOn = false;
+}
+
+void MainWindow::OnCaptureFrameAvailable()
+{
+	FeedLiveFrame();
+}
+
+void MainWindow::FeedLiveFrame()
+{
+	// One at a time, so the executor never falls behind. While it works
+	// the ring fills up and drops the oldest frames.
+	if (!m_live.bOn || m_live.bBusy)
+		return;
+
+	CaptureSource::Frame frame;
+	if (!m_pCapture->Take(frame))
+		return;
+	m_live.bBusy = true;
+	m_pExecutor->SetInput(0, frame.img.getUMat(cv::ACCESS_READ));
+	ShowLiveStatus();
+}
+
+void MainWindow::OnCaptureEnded(QString sReason)
+{
+	LOGWRN("Live capture from '%s' ended: %s", qPrintable(m_live.sSource), qPrintable(sReason));
+	m_live.sEnded = sReason;
+	ShowLiveStatus();
+}
+
+void MainWindow::ShowLiveStatus()
+{
+	CaptureSource::Stats stats = m_pCapture->GetStats();
+	QString sMsg = QString("Live: %1 frames, %2 run, %3 dropped behind").arg(stats.iGrabbed).arg(m_live.iRun).arg(stats.iDropped);
+	if (m_live.iOverBudget > 0)
+		sMsg += QString(", %1 over the frame budget").arg(m_live.iOverBudget);
+	if (!m_live.sEnded.isEmpty())
+		sMsg += QString(" (%1)").arg(m_live.sEnded);
+	ui.statusBar->showMessage(sMsg);
+}
+
 void MainWindow::CreateImageWindows()
 {
 	// We might need to grow or shrink the number of windows
-	int iImageCount = m_listInputImages.count();
+	int iImageCount = m_slInputFiles.count();
 
 	m_listImageWindows.resize(iImageCount);
 	
@@ -393,7 +597,7 @@ void MainWindow::on_actionNew_triggered()
 
 void MainWindow::on_pbRemoveStep_clicked()
 {
-	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedIndexes();
+	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedRows();
 	Q_ASSERT(!mil.isEmpty());
 
 	// Get row list
@@ -406,7 +610,7 @@ void MainWindow::on_pbRemoveStep_clicked()
 	while (!listIndexes.isEmpty())
 	{
 		int iIdx = listIndexes.last();
-		m_doc.pipeline.removeAt(iIdx);
+		m_doc.pipeline.RemoveStep(iIdx);
 		listIndexes.removeLast();
 	}
 
@@ -414,12 +618,12 @@ void MainWindow::on_pbRemoveStep_clicked()
 
 	// Restore the selection
 	if (mil.count() == 1)
-		ui.viewSteps->selectionModel()->select(mil.first(), QItemSelectionModel::SelectCurrent);
+		ui.viewSteps->selectionModel()->select(mil.first(), QItemSelectionModel::SelectCurrent | QItemSelectionModel::Rows);
 }
 
 void MainWindow::on_pbMoveStepUp_clicked()
 {
-	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedIndexes();
+	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedRows();
 	Q_ASSERT(1 == mil.count());
 	int iRow = mil.first().row();
 	int iNewRow = iRow - 1;
@@ -430,12 +634,12 @@ void MainWindow::on_pbMoveStepUp_clicked()
 
 	// Keep the same item selected
 	QModelIndex miNewSel = m_pPipelineModel->index(iNewRow, mil.first().column());
-	ui.viewSteps->selectionModel()->select(miNewSel, QItemSelectionModel::SelectCurrent);
+	ui.viewSteps->selectionModel()->select(miNewSel, QItemSelectionModel::SelectCurrent | QItemSelectionModel::Rows);
 }
 
 void MainWindow::on_pbMoveStepDown_clicked()
 {
-	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedIndexes();
+	QModelIndexList mil = ui.viewSteps->selectionModel()->selectedRows();
 	Q_ASSERT(!mil.isEmpty());
 	int iRow = mil.first().row();
 	int iNewRow = iRow + 1;
@@ -446,7 +650,7 @@ void MainWindow::on_pbMoveStepDown_clicked()
 
 	// Keep the same item selected
 	QModelIndex miNewSel = m_pPipelineModel->index(iNewRow, mil.first().column());
-	ui.viewSteps->selectionModel()->select(miNewSel, QItemSelectionModel::SelectCurrent);
+	ui.viewSteps->selectionModel()->select(miNewSel, QItemSelectionModel::SelectCurrent | QItemSelectionModel::Rows);
 }
 
 void MainWindow::on_actionOpen_triggered()
@@ -508,7 +712,8 @@ void MainWindow::on_actionSaveAs_triggered()
 
 
 
-BEGIN_SERMIG_MAP(MainWindow, 1, "MainWindow")
+BEGIN_SERMIG_MAP(MainWindow, 2, "MainWindow")
+	SERMIG_MAP_ENTRY(2)
 	SERMIG_MAP_ENTRY(1)
 END_SERMIG_MAP
 
@@ -546,15 +751,19 @@ void MainWindow::SerializeGeometry(Archive& ar, QWidget* pW)
 }
 
 
-void MainWindow::SerializeV1(Archive& ar)
+void MainWindow::SerializeV2(Archive& ar)
 {
 	if (ar.isStoring())
 	{
 		SerializeGeometry(ar, this);
+		ar.label("threads") << ui.sbThreads->value();
 
-		ar << m_slInputFiles;
-		for (ImagesWindow* pWnd : m_listImageWindows)
+		// A live source isn't reopened on the next start
+		QStringList slInputFiles = m_live.bOn ? QStringList() : m_slInputFiles;
+		ar << slInputFiles;
+		for (int i = 0; i < slInputFiles.count(); ++i)
 		{
+			ImagesWindow* pWnd = m_listImageWindows.value(i);
 			bool bHasWnd = (bool)(pWnd != nullptr);
 			ar << bHasWnd;
 			if (pWnd)
@@ -570,6 +779,41 @@ void MainWindow::SerializeV1(Archive& ar)
 	Q_ASSERT(ar.isLoading());
 	SerializeGeometry(ar, this);
 
+	// Before the inputs, they kick off the first run
+	int iThreads;
+	ar.label("threads") >> iThreads;
+	ui.sbThreads->setValue(iThreads);
+
+	ar >> m_slInputFiles;
+	SetInputFiles(m_slInputFiles);
+
+	// The image window list should match the input files now
+	for(int i = 0; i < m_listImageWindows.count(); ++i)
+	{
+		ImagesWindow* pWnd = m_listImageWindows[i];
+		Q_ASSERT(pWnd);
+		bool bHasWnd = ar.ReadBool();
+		if (bHasWnd)
+			SerializeGeometry(ar, pWnd);
+		else
+		{
+			delete pWnd;
+			m_listImageWindows[i] = nullptr;
+		}
+	}
+
+	ar >> m_slRecentFiles;
+	BuildRecentFilesMenu();
+
+	ui.cbAutoApply->setChecked(ar.ReadBool());
+}
+
+
+void MainWindow::SerializeV1(Archive& ar)
+{
+	Q_ASSERT(ar.isLoading());
+	SerializeGeometry(ar, this);
+
 	ar >> m_slInputFiles;
 	SetInputFiles(m_slInputFiles);
 
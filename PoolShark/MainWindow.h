@@ -6,6 +6,9 @@
 #include "Pipeline.h"
 #include "PipelineTableModel.h"
 #include "ImagesWindow.h"
+#include "PipelineExecutor.h"
+#include "ImageLoader.h"
+#include "CaptureSource.h"
 #include <SerMig.h>
 
 
@@ -24,10 +27,13 @@ public slots:
 
 private slots:
     void OnParamChanged(QVariant vCookie, QVariant vNewValue);
+    void OnParamDragStarted();
+    void OnParamDragFinished();
     void on_actionNew_triggered();
     void on_actionOpen_triggered();
     void on_actionSave_triggered();
     void on_actionSaveAs_triggered();
+    void on_actionOpenStream_triggered();
     void on_pbSelectInputs_clicked();
     void OnImagesWindowClosing();
     void on_pbRemoveStep_clicked();
@@ -37,7 +43,15 @@ private slots:
     void OnViewSteps_currentRowChanged(const QModelIndex& current, const QModelIndex& previous);
     void on_pbApply_clicked();
     void on_cbAutoApply_clicked();
+    void on_sbThreads_valueChanged(int iThreads);
     void OnOpenRecentFile();
+    void OnStandInLoaded(int iImage, cv::UMat img, double dScale);
+    void OnImageLoaded(int iImage, cv::UMat img);
+    void OnImageProcessed(int iImage, QList<PipelineData> listOutputs);
+    void OnImageDropped(int iImage);
+    void OnCaptureFrameAvailable();
+    void OnCaptureEnded(QString sReason);
+    void OnPipelineIdle();
 
 protected:
     virtual void closeEvent(QCloseEvent* event) override;
@@ -50,6 +64,7 @@ private:
     QString m_sWindowTitle;
     PipelineTableModel* m_pPipelineModel = nullptr;
     bool m_bParamsDirty = false;
+    bool m_bDragging = false;  ///< A slider is held down, process a preview
     QStringList m_slRecentFiles;
 
     void SetPipeline(const Pipeline& pipeline);
@@ -68,7 +83,23 @@ private:
     QStringListModel* m_pInputsModel;
     QStringList m_slInputFiles;
     void SetInputFiles(QStringList slFiles);
-    QList<cv::UMat> m_listInputImages;
+    ImageLoader* m_pLoader = nullptr;
+
+    /// A camera or stream as the only input, each frame replacing the last
+    CaptureSource* m_pCapture = nullptr;
+    struct {
+        bool bOn = false;
+        bool bBusy = false;     ///< The executor has a frame, the next waits in the ring
+        QString sSource;
+        qint64 iRun = 0;
+        qint64 iOverBudget = 0;
+        QString sEnded;         ///< Why the capture stopped, the last frame stays up
+    } m_live;
+    void StartLive(const QString& sSource);
+    void StopLive();
+    void FeedLiveFrame();
+    void ShowLiveStatus();
+    PipelineExecutor* m_pExecutor = nullptr;
 
     QList<ImagesWindow*> m_listImageWindows;
     void CreateImageWindows();
@@ -79,5 +110,6 @@ private:
     QString ConfigFilename();
 
     void SerializeGeometry(Archive& ar, QWidget* pW);
+    void SerializeV2(Archive& ar);
     void SerializeV1(Archive& ar);
 };
@@ -78,3 +78,13 @@ void ParamWidgetFloat::on_dsb_valueChanged(double value)
 	emit ParamChanged(m_vCookie, QVariant(value));
 	ui.slider->setValue(iSlider);
 }
+
+void ParamWidgetFloat::on_slider_sliderPressed()
+{
+	emit DragStarted();
+}
+
+void ParamWidgetFloat::on_slider_sliderReleased()
+{
+	emit DragFinished();
+}
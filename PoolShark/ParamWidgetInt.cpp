@@ -49,3 +49,13 @@ void ParamWidgetInt::on_spinBox_valueChanged(int value)
 	ui.slider->setValue(value);
 	emit ParamChanged(m_vCookie, value);
 }
+
+void ParamWidgetInt::on_slider_sliderPressed()
+{
+	emit DragStarted();
+}
+
+void ParamWidgetInt::on_slider_sliderReleased()
+{
+	emit DragFinished();
+}
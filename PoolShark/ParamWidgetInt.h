@@ -14,9 +14,13 @@ public:
 
 signals:
 	void ParamChanged(QVariant vCookie, QVariant vNewValue);
+	void DragStarted();		///< The user grabbed the slider
+	void DragFinished();	///< ...and let go of it
 
 private slots:
 	void on_slider_valueChanged(int value);
+	void on_slider_sliderPressed();
+	void on_slider_sliderReleased();
 	void on_spinBox_valueChanged(int value);
 
 private:
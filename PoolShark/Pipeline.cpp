@@ -1,11 +1,18 @@
 #include "stdafx.h"
 #include "Pipeline.h"
 #include "PipelineFactory.h"
+#include "PipelineDiskCache.h"
+#include "PipelinePolicy.h"
+#include <QCryptographicHash>
+#include <cmath>
+#include <opencv2/imgproc/imgproc.hpp>     // cv::cvtColor()
 
 
 
 DECLARE_LOG_SRC("Pipeline", LOGCAT_Common);
 
+#define RECIPE_VERSION		3	///< Bump when a step changes what it outputs, so old disk cache entries don't match
+
 /*************************************************************/
 PipelineStepParam::PipelineStepParam()
 {
@@ -109,16 +116,28 @@ void PipelineStepParam::SerializeV1(Archive& ar)
 
 /*************************************************************/
 
+const char* const PipelineStep::ms_szMainPort = "in";
+
 PipelineStep::PipelineStep()
 {
-
+	m_uRevision = NextRevision();
+	m_pStats = std::make_shared<PipelineStepStats>();
+	m_pBuffers = std::make_shared<PipelineBufferPool>();
 }
 
-PipelineStep::PipelineStep(const QString& sName, const QList<PipelineStepParam>& listParams, FuncOp funcOp)
+PipelineStep::PipelineStep(const QString& sName, const QList<PipelineStepParam>& listParams, const PipelineStepTypes& types, FuncDecode funcDecode, FuncOp funcOp,
+	FuncHalo funcHalo)
 {
 	m_sName = sName;
 	m_listParams = listParams;
+	m_types = types;
+	m_funcDecode = funcDecode;
 	m_funcOp = funcOp;
+	m_funcHalo = funcHalo;
+	DecodeParams();
+	m_uRevision = NextRevision();
+	m_pStats = std::make_shared<PipelineStepStats>();
+	m_pBuffers = std::make_shared<PipelineBufferPool>();
 
 	for(int i = 0; i< m_listParams.count(); ++i)
 		m_mapParamPositions[m_listParams.at(i).Name()] = i;
@@ -134,14 +153,132 @@ const QList<PipelineStepParam>& PipelineStep::Params() const
 	return m_listParams;
 }
 
-QList<PipelineStepParam>& PipelineStep::Params()
+const PipelineStepTypes& PipelineStep::Types() const
 {
-	return m_listParams;
+	return m_types;
 }
 
-PipelineData PipelineStep::Process(const PipelineData& input)
+int PipelineStep::Halo(double dScale) const
 {
-	return m_funcOp(input, m_listParams);
+	if (!m_funcHalo || !m_pDecodedParams || m_types.bPassImage)
+		return -1;
+	return m_funcHalo(m_pDecodedParams.get(), dScale);
+}
+
+QStringList PipelineStep::InputPorts() const
+{
+	QStringList slPorts;
+	slPorts += ms_szMainPort;
+	for (const PipelineStepPort& port : m_types.listAuxInputs)
+		slPorts += port.sName;
+	return slPorts;
+}
+
+int PipelineStep::Source(const QString& sPort) const
+{
+	return m_mapSources.value(sPort, SRC_Previous);
+}
+
+void PipelineStep::SetSource(const QString& sPort, int iSource)
+{
+	Q_ASSERT(InputPorts().contains(sPort));
+	if (SRC_Previous == iSource)
+		m_mapSources.remove(sPort);
+	else
+		m_mapSources[sPort] = iSource;
+
+	// The output changes just like for a param change
+	m_uRevision = NextRevision();
+}
+
+int PipelineStep::Id() const
+{
+	return m_iId;
+}
+
+int PipelineStep::Device() const
+{
+	return m_iDevice;
+}
+
+void PipelineStep::SetDevice(int iDevice)
+{
+	m_iDevice = iDevice;
+}
+
+quint64 PipelineStep::Revision() const
+{
+	return m_uRevision;
+}
+
+const PipelineStepStats& PipelineStep::Stats() const
+{
+	return *m_pStats;
+}
+
+void PipelineStep::ResetStats()
+{
+	m_pStats = std::make_shared<PipelineStepStats>();
+}
+
+void PipelineStep::ResetBuffers()
+{
+	m_pBuffers = std::make_shared<PipelineBufferPool>();
+}
+
+quint64 PipelineStep::NextRevision()
+{
+	static QAtomicInteger<quint64> s_uNext(1);
+	return s_uNext.fetchAndAddRelaxed(1);
+}
+
+PipelineData PipelineStep::Process(const PipelineData& input, const QList<PipelineData>& listAux, int iOutType, const PipelineContext& context) const
+{
+	PipelineData out;
+	if (m_types.bCrop)
+	{
+		// A view of part of the input, nothing to allocate or pool
+		out = input;
+		RunOp(input, listAux, out, context);
+		cv::Rect rcIn = input.FrameRect();
+		cv::Rect rcOut = out.roi & rcIn;
+		if (rcOut.empty())
+			EXERR("PLR1", "%s leaves nothing of the %dx%d image", qPrintable(m_sName), rcIn.width, rcIn.height);
+		out.img = input.img(rcOut - rcIn.tl());
+		out.roi = rcOut;
+		return out;
+	}
+
+	// Same part of the frame as the input
+	out.roi = input.roi;
+	if (m_types.bPassImage)
+	{
+		// Shares the input's buffer, nothing to allocate or pool
+		out.img = input.img;
+		RunOp(input, listAux, out, context);
+		return out;
+	}
+
+	out.img = m_pBuffers->Take(input.img);
+	if (out.img.empty())
+		out.img.create(input.img.size(), iOutType);
+	RunOp(input, listAux, out, context);
+	m_pBuffers->Keep(input.img, out.img);
+	return out;
+}
+
+void PipelineStep::RunOp(const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const PipelineContext& context) const
+{
+	// A cv::Exception can't travel through an ExceptionContainer to the
+	// thread that waits for the run, and it wouldn't say which step failed
+	try
+	{
+		m_funcOp(input, listAux, out, m_pDecodedParams.get(), context);
+	}
+	catch (const cv::Exception& e)
+	{
+		EXERR("PLR3", "%s failed: %s", qPrintable(m_sName), e.what());
+	}
 }
 
 
@@ -155,7 +292,22 @@ void PipelineStep::SetParamVal(const QString& sName, const QVariant& vVal)
 {
 	Q_ASSERT(m_mapParamPositions.contains(sName));
 	int iIdx = m_mapParamPositions.value(sName);
-	m_listParams[iIdx].SetValue(vVal);
+	SetParamVal(iIdx, vVal);
+}
+
+void PipelineStep::SetParamVal(int iParam, const QVariant& vVal)
+{
+	m_listParams[iParam].SetValue(vVal);
+	DecodeParams();
+	m_uRevision = NextRevision();
+}
+
+void PipelineStep::DecodeParams()
+{
+	// A new one each time. Copies of this step (a plan running on
+	// another thread) keep the one they have.
+	if (m_funcDecode)
+		m_pDecodedParams = m_funcDecode(m_listParams);
 }
 
 void PipelineStep::Dump() const
@@ -170,7 +322,9 @@ void PipelineStep::Dump() const
 }
 
 
-BEGIN_SERMIG_MAP(PipelineStep, 2, "PipelineStep")
+BEGIN_SERMIG_MAP(PipelineStep, 4, "PipelineStep")
+	SERMIG_MAP_ENTRY(4)
+	SERMIG_MAP_ENTRY(3)
 	SERMIG_MAP_ENTRY(2)
 	SERMIG_MAP_ENTRY(1)
 END_SERMIG_MAP
@@ -221,8 +375,467 @@ void PipelineStep::SerializeV2(Archive& ar)
 	// Copy it
 	*this = ps;
 }
+
+void PipelineStep::SerializeV4(Archive& ar)
+{
+	// Same as V3 plus where it is pinned to run
+	SerializeV3(ar);
+
+	if (ar.isStoring())
+	{
+		ar.label("Device") << m_iDevice;
+		return;
+	}
+
+	// Read
+	ar.label("Device") >> m_iDevice;
+}
+
+void PipelineStep::SerializeV3(Archive& ar)
+{
+	// Same as V2 plus the id and where the inputs come from
+	SerializeV2(ar);
+
+	if (ar.isStoring())
+	{
+		ar.label("Id") << m_iId;
+		ar.label("SourceCount") << (int)m_mapSources.count();
+		QMapIterator<QString, int> iter(m_mapSources);
+		while (iter.hasNext())
+		{
+			iter.next();
+			ar.label("Port") << iter.key();
+			ar.label("Source") << iter.value();
+		}
+		return;
+	}
+
+	// Read
+	ar.label("Id") >> m_iId;
+	int iCount;
+	ar.label("SourceCount") >> iCount;
+	QStringList slPorts = InputPorts();
+	while (iCount--)
+	{
+		QString sPort;
+		int iSource;
+		ar.label("Port") >> sPort;
+		ar.label("Source") >> iSource;
+
+		// The step may have lost the port since
+		if (slPorts.contains(sPort))
+			m_mapSources[sPort] = iSource;
+	}
+}
  
 
+/*************************************************************/
+
+cv::UMat PipelineBufferPool::Take(const cv::UMat& input)
+{
+	return Take(input.size(), input.type());
+}
+
+void PipelineBufferPool::Keep(const cv::UMat& input, const cv::UMat& output)
+{
+	Keep(input.size(), input.type(), output);
+}
+
+cv::UMat PipelineBufferPool::Take(const cv::Size& size, int iInType)
+{
+	Key key(size, iInType);
+	QMutexLocker lock(&m_mutex);
+	for (const Entry& entry : m_listEntries)
+	{
+		// Handing out a copy takes a reference, so no other worker
+		// sees it as free until the caller is done with it
+		if (entry.key == key && IsFree(entry.img))
+			return entry.img;
+	}
+	return cv::UMat();
+}
+
+void PipelineBufferPool::Keep(const cv::Size& size, int iInType, const cv::UMat& output)
+{
+	if (output.empty())
+		return;
+
+	QMutexLocker lock(&m_mutex);
+
+	// Already ours? Move it to the back so it is the last to go
+	for (int i = 0; i < m_listEntries.count(); ++i)
+	{
+		if (m_listEntries.at(i).img.u == output.u)
+		{
+			m_listEntries.move(i, m_listEntries.count() - 1);
+			return;
+		}
+	}
+
+	Entry entry{ Key(size, iInType), output };
+	m_listEntries += entry;
+
+	// Drop the oldest to keep the pool from growing forever with shapes
+	// that are no longer used. If one is still busy it is simply
+	// forgotten, and freed by whoever holds it.
+	while (m_listEntries.count() > ms_iMaxBuffers)
+		m_listEntries.removeFirst();
+}
+
+void PipelineBufferPool::Clear()
+{
+	QMutexLocker lock(&m_mutex);
+	m_listEntries.clear();
+}
+
+bool PipelineBufferPool::IsFree(const cv::UMat& img)
+{
+	// Only our own header refers to it, and nobody has it mapped as a Mat
+	return img.u && 1 == img.u->urefcount && 0 == img.u->refcount;
+}
+
+
+/*************************************************************/
+
+bool PipelineOverlay::IsEmpty() const
+{
+	return contours.empty() && lines.empty() && segments.empty() && circles.empty();
+}
+
+int PipelineOverlay::Count() const
+{
+	return (int)(contours.size() + lines.size() + segments.size() + circles.size());
+}
+
+void PipelineOverlay::Offset(const cv::Point& pt, const PipelineContext* pContext)
+{
+	if (cv::Point() == pt)
+		return;
+
+	for (size_t c = 0; c < contours.size(); ++c)
+	{
+		if (pContext)
+			pContext->CheckEvery(c);
+		for (cv::Point& ptContour : contours[c])
+			ptContour += pt;
+	}
+
+	// Same angle, the distance from the origin changes by how far the
+	// origin moved along the normal
+	for (cv::Vec2f& line : lines)
+		line[0] += (float)(pt.x * cos(line[1]) + pt.y * sin(line[1]));
+
+	for (cv::Vec4i& segment : segments)
+		segment += cv::Vec4i(pt.x, pt.y, pt.x, pt.y);
+
+	for (cv::Vec3f& circle : circles)
+	{
+		circle[0] += pt.x;
+		circle[1] += pt.y;
+	}
+}
+
+void PipelineOverlay::Draw(cv::Mat& mat, double dScale, const cv::Point2d& ptOrigin, const PipelineContext* pContext) const
+{
+	Q_ASSERT(CV_8UC3 == mat.type());
+	cv::Scalar color(0, 0, 255);	// red
+	auto funcMap = [dScale, &ptOrigin](double x, double y) {
+		return cv::Point(cvRound((x - ptOrigin.x) * dScale), cvRound((y - ptOrigin.y) * dScale));
+	};
+
+	// One count over all the shapes, so lots of small kinds still get checked
+	qint64 iShape = 0;
+	auto funcCheck = [pContext, &iShape]() {
+		if (pContext)
+			pContext->CheckEvery(iShape);
+		++iShape;
+	};
+
+	std::vector<std::vector<cv::Point>> contoursMapped(contours.size());
+	for (size_t c = 0; c < contours.size(); ++c)
+	{
+		funcCheck();
+		contoursMapped[c].reserve(contours[c].size());
+		for (const cv::Point& pt : contours[c])
+			contoursMapped[c].push_back(funcMap(pt.x, pt.y));
+	}
+	cv::polylines(mat, contoursMapped, true, color, 1, cv::LINE_AA);
+
+	// Lines have no ends. Long enough to cross whatever part is showing,
+	// line() clips the rest.
+	double dExtent = qAbs(ptOrigin.x) + qAbs(ptOrigin.y) + (mat.cols + mat.rows) / dScale;
+	for (const cv::Vec2f& line : lines)
+	{
+		funcCheck();
+		double a = cos(line[1]), b = sin(line[1]);
+		double dExtentLine = dExtent + qAbs(line[0]);
+		double x0 = a * line[0], y0 = b * line[0];
+		cv::line(mat, funcMap(x0 - dExtentLine * b, y0 + dExtentLine * a), funcMap(x0 + dExtentLine * b, y0 - dExtentLine * a), color, 1, cv::LINE_AA);
+	}
+
+	for (const cv::Vec4i& segment : segments)
+	{
+		funcCheck();
+		cv::line(mat, funcMap(segment[0], segment[1]), funcMap(segment[2], segment[3]), color, 1, cv::LINE_AA);
+	}
+
+	for (const cv::Vec3f& circle : circles)
+	{
+		funcCheck();
+		cv::circle(mat, funcMap(circle[0], circle[1]), qMax(1, cvRound(circle[2] * dScale)), color, 1, cv::LINE_AA);
+	}
+}
+
+QDataStream& operator<<(QDataStream& ds, const PipelineOverlay& overlay)
+{
+	ds << (quint32)overlay.contours.size();
+	for (const std::vector<cv::Point>& contour : overlay.contours)
+	{
+		ds << (quint32)contour.size();
+		for (const cv::Point& pt : contour)
+			ds << (qint32)pt.x << (qint32)pt.y;
+	}
+	ds << (quint32)overlay.lines.size();
+	for (const cv::Vec2f& line : overlay.lines)
+		ds << line[0] << line[1];
+	ds << (quint32)overlay.segments.size();
+	for (const cv::Vec4i& segment : overlay.segments)
+		ds << (qint32)segment[0] << (qint32)segment[1] << (qint32)segment[2] << (qint32)segment[3];
+	ds << (quint32)overlay.circles.size();
+	for (const cv::Vec3f& circle : overlay.circles)
+		ds << circle[0] << circle[1] << circle[2];
+	return ds;
+}
+
+QDataStream& operator>>(QDataStream& ds, PipelineOverlay& overlay)
+{
+	overlay = PipelineOverlay();
+
+	// 0 once the stream has failed, so the loops below stop
+	auto funcCount = [&ds](qint64 iItemBytes) -> quint32 {
+		quint32 uCount = 0;
+		ds >> uCount;
+		if (QDataStream::Ok == ds.status() && ds.device() && uCount > ds.device()->bytesAvailable() / iItemBytes)
+			ds.setStatus(QDataStream::ReadCorruptData);
+		return QDataStream::Ok == ds.status() ? uCount : 0;
+	};
+	qint64 iFloatBytes = QDataStream::SinglePrecision == ds.floatingPointPrecision() ? 4 : 8;
+
+	quint32 uContours = funcCount(4);
+	for (quint32 c = 0; c < uContours; ++c)
+	{
+		std::vector<cv::Point> contour(funcCount(8));
+		for (cv::Point& pt : contour)
+			ds >> pt.x >> pt.y;
+		overlay.contours.push_back(contour);
+		if (QDataStream::Ok != ds.status())
+			break;
+	}
+	quint32 uCount = funcCount(2 * iFloatBytes);
+	for (quint32 i = 0; i < uCount; ++i)
+	{
+		cv::Vec2f line;
+		ds >> line[0] >> line[1];
+		overlay.lines.push_back(line);
+	}
+	uCount = funcCount(16);
+	for (quint32 i = 0; i < uCount; ++i)
+	{
+		cv::Vec4i segment;
+		ds >> segment[0] >> segment[1] >> segment[2] >> segment[3];
+		overlay.segments.push_back(segment);
+	}
+	uCount = funcCount(3 * iFloatBytes);
+	for (quint32 i = 0; i < uCount; ++i)
+	{
+		cv::Vec3f circle;
+		ds >> circle[0] >> circle[1] >> circle[2];
+		overlay.circles.push_back(circle);
+	}
+	return ds;
+}
+
+void ForEachPixelRow(const cv::Mat& mat, const std::function<void(const char* pBytes, qint64 iBytes)>& func)
+{
+	qint64 iRowBytes = mat.cols * (qint64)mat.elemSize();
+	if (mat.isContinuous())
+	{
+		if (mat.rows > 0)
+			func((const char*)mat.data, iRowBytes * mat.rows);
+		return;
+	}
+	for (int r = 0; r < mat.rows; ++r)
+		func((const char*)mat.ptr(r), iRowBytes);
+}
+
+
+/*************************************************************/
+
+cv::Rect PipelineData::FrameRect() const
+{
+	return roi.empty() ? cv::Rect(0, 0, img.cols, img.rows) : roi;
+}
+
+
+/*************************************************************/
+
+PipelineContext::PipelineContext()
+{
+	m_pShared = std::make_shared<Shared>();
+}
+
+PipelineContext::PipelineContext(const Checkpoint& funcCheckpoint)
+	: PipelineContext()
+{
+	m_funcCheckpoint = funcCheckpoint;
+}
+
+void PipelineContext::SetBudgetMs(double dMs)
+{
+	if (dMs <= 0.0)
+	{
+		m_pShared->deadline = QDeadlineTimer(QDeadlineTimer::Forever);
+		return;
+	}
+	qint64 iNs = qRound64(dMs * 1e6);
+	m_pShared->deadline.setPreciseRemainingTime(iNs / 1000000000, iNs % 1000000000, Qt::PreciseTimer);
+}
+
+bool PipelineContext::IsLate() const
+{
+	return m_pShared->deadline.hasExpired();
+}
+
+void PipelineContext::Cancel()
+{
+	m_pShared->bCancelled.storeRelaxed(1);
+}
+
+bool PipelineContext::IsCancelled() const
+{
+	return 0 != m_pShared->bCancelled.loadRelaxed();
+}
+
+void PipelineContext::Check() const
+{
+	if (m_funcCheckpoint)
+		m_funcCheckpoint();
+
+	// Info only, whoever set these up expects it
+	if (IsCancelled())
+		EXINFO_T(_LgMsgException(PipelineAbandoned(), "PLX1", "Run cancelled"));
+	if (IsLate())
+		EXINFO_T(_LgMsgException(PipelineAbandoned(), "PLX2", "Run over its time budget"));
+}
+
+void PipelineContext::CheckEvery(qint64 iItem) const
+{
+	if (0 == iItem % ms_iCheckEvery)
+		Check();
+}
+
+
+/*************************************************************/
+
+void PipelineStepStats::Record(qint64 iElapsedNs, const PipelineData& out)
+{
+	QMutexLocker lock(&m_mutex);
+	if (m_vectNs.count() < ms_iWindow)
+		m_vectNs += iElapsedNs;
+	else
+		m_vectNs[m_iNext] = iElapsedNs;
+	m_iNext = (m_iNext + 1) % ms_iWindow;
+
+	m_iOutBytes = (qint64)out.img.total() * (qint64)out.img.elemSize();
+	m_iShapes = out.overlay.Count();
+}
+
+PipelineStepStats::Summary PipelineStepStats::Summarize() const
+{
+	QMutexLocker lock(&m_mutex);
+	QVector<qint64> vectNs = m_vectNs;
+	Summary summary;
+	summary.iOutBytes = m_iOutBytes;
+	summary.iShapes = m_iShapes;
+	lock.unlock();
+
+	if (vectNs.isEmpty())
+		return summary;
+
+	std::sort(vectNs.begin(), vectNs.end());
+	qint64 iTotalNs = 0;
+	for (qint64 iNs : vectNs)
+		iTotalNs += iNs;
+
+	// Nearest rank
+	int iP95 = qMin(vectNs.count() - 1, (int)std::ceil(0.95 * vectNs.count()) - 1);
+
+	summary.iRuns = vectNs.count();
+	summary.dMinMs = vectNs.first() / 1.0e6;
+	summary.dMeanMs = iTotalNs / 1.0e6 / vectNs.count();
+	summary.dP95Ms = vectNs.at(iP95) / 1.0e6;
+	return summary;
+}
+
+void PipelineStepStats::Clear()
+{
+	QMutexLocker lock(&m_mutex);
+	m_vectNs.clear();
+	m_iNext = 0;
+	m_iOutBytes = 0;
+	m_iShapes = 0;
+}
+
+
+/*************************************************************/
+
+void PipelineCache::Clear()
+{
+	m_listEntries.clear();
+	m_pHashedInput = nullptr;
+	m_baInputHash.clear();
+}
+
+void PipelineCache::SetDiskCache(PipelineDiskCache* pDiskCache)
+{
+	m_pDiskCache = pDiskCache;
+}
+
+const QByteArray& PipelineCache::InputHash(const PipelineData& input)
+{
+	// Hashing a big image isn't free, do it once
+	if (m_baInputHash.isEmpty() || m_pHashedInput != input.img.u)
+	{
+		m_baInputHash = PipelineDiskCache::HashInput(input.img);
+		m_pHashedInput = input.img.u;
+	}
+	return m_baInputHash;
+}
+
+int PipelineCache::Count() const
+{
+	return m_listEntries.count();
+}
+
+qint64 PipelineCache::StepNs(int iStep) const
+{
+	return m_listEntries.at(iStep).iElapsedNs;
+}
+
+const PipelineData& PipelineCache::Output(int iStep) const
+{
+	return m_listEntries.at(iStep).out;
+}
+
+QList<PipelineData> PipelineCache::Outputs() const
+{
+	QList<PipelineData> listOutputs;
+	for (const Entry& entry : m_listEntries)
+		listOutputs += entry.out;
+	return listOutputs;
+}
+
+
 /*************************************************************/
 
 Pipeline::Pipeline()
@@ -240,28 +853,230 @@ void Pipeline::SetName(const QString& sName)
 	m_sName = sName;
 }
 
+void Pipeline::AssignIds()
+{
+	// Fresh steps from the factory have no id yet. Copies of a step have
+	// the same one, the later copy gets a new one.
+	int iMaxId = 0;
+	for (const PipelineStep& ps : *this)
+		iMaxId = qMax(iMaxId, ps.m_iId);
+
+	QSet<int> setIds;
+	for (PipelineStep& ps : *this)
+	{
+		if (ps.m_iId <= 0 || setIds.contains(ps.m_iId))
+			ps.m_iId = ++iMaxId;
+		setIds.insert(ps.m_iId);
+	}
+}
 
-QList<cv::UMat> Pipeline::Process(const cv::UMat& inputImg)
+int Pipeline::IndexOf(int iId) const
+{
+	for (int i = 0; i < count(); ++i)
+	{
+		if (at(i).m_iId == iId)
+			return i;
+	}
+	return -1;
+}
+
+void Pipeline::RemoveStep(int iStep)
+{
+	int iId = at(iStep).m_iId;
+	removeAt(iStep);
+	if (iId <= 0)
+		return;
+
+	for (PipelineStep& ps : *this)
+	{
+		for (const QString& sPort : ps.InputPorts())
+		{
+			if (ps.Source(sPort) == iId)
+				ps.SetSource(sPort, PipelineStep::SRC_Previous);
+		}
+	}
+}
+
+
+QList<cv::UMat> Pipeline::Process(const cv::UMat& inputImg, PipelineCache* pCache, const PipelineContext& context) const
 {
 	PipelineData input;
 	input.img = inputImg;
-	return Process(input);
+	return Process(input, pCache, context);
 }
 
-QList<cv::UMat> Pipeline::Process(const PipelineData& input)
+QList<cv::UMat> Pipeline::Process(const PipelineData& input, PipelineCache* pCache, const PipelineContext& context) const
 {
-	// Collect all results in an array
-	QList<cv::UMat> listOuts;
+	return Compile(input.img.type()).Process(input, pCache, context);
+}
 
-	// Process each step
-	PipelineData inputCpy = input;
-	for (int i = 0; i < count(); ++i)
+PipelinePlan Pipeline::Compile(int iInputType) const
+{
+	PipelinePlan plan;
+	plan.m_pipeline = *this;
+	plan.m_pipeline.AssignIds();
+	plan.m_iInputType = iInputType;
+	const Pipeline& pipeline = plan.m_pipeline;
+	int iCount = pipeline.count();
+
+	// Find the step feeding each input, -1 for the pipeline input
+	QVector<QVector<int>> vectSources(iCount);
+	for (int i = 0; i < iCount; ++i)
 	{
-		inputCpy = (*this)[i].Process(inputCpy);
-		listOuts += inputCpy.img;
+		const PipelineStep& ps = pipeline.at(i);
+		for (const QString& sPort : ps.InputPorts())
+		{
+			int iSource = ps.Source(sPort);
+			if (PipelineStep::SRC_Previous == iSource)
+				iSource = i - 1;
+			else if (PipelineStep::SRC_Input == iSource)
+				iSource = -1;
+			else
+			{
+				iSource = pipeline.IndexOf(iSource);
+				if (iSource < 0)
+					EXERR("PLC3", "Input '%s' of %s is connected to a step that isn't there", qPrintable(sPort), qPrintable(ps.Name()));
+			}
+			vectSources[i] += iSource;
+		}
 	}
 
-	return listOuts;
+	// Put the steps in levels. A step goes in the level after the last of
+	// its sources. Keep sweeping until everything is placed, a sweep that
+	// places nothing means there is a loop.
+	QVector<int> vectLevel(iCount, -1);
+	int iPlaced = 0;
+	while (iPlaced < iCount)
+	{
+		int iPlacedBefore = iPlaced;
+		for (int i = 0; i < iCount; ++i)
+		{
+			if (vectLevel.at(i) >= 0)
+				continue;
+
+			int iLevel = 0;
+			for (int iSource : vectSources.at(i))
+			{
+				if (iSource < 0)
+					continue;
+				if (vectLevel.at(iSource) < 0)
+				{
+					iLevel = -1;
+					break;
+				}
+				iLevel = qMax(iLevel, vectLevel.at(iSource) + 1);
+			}
+
+			if (iLevel >= 0)
+			{
+				vectLevel[i] = iLevel;
+				++iPlaced;
+			}
+		}
+
+		if (iPlaced == iPlacedBefore)
+			EXERR("PLC4", "Pipeline '%s' has steps that feed each other in a loop", qPrintable(m_sName));
+	}
+
+	int iLevels = 0;
+	for (int iLevel : vectLevel)
+		iLevels = qMax(iLevels, iLevel + 1);
+	plan.m_vectLevels.resize(iLevels);
+	for (int i = 0; i < iCount; ++i)
+		plan.m_vectLevels[vectLevel.at(i)] += i;
+
+	// Now the types, level by level so every source is done first
+	plan.m_vectStages.resize(iCount);
+	for (const QVector<int>& vectStepsInLevel : plan.m_vectLevels)
+	{
+		for (int i : vectStepsInLevel)
+		{
+			const PipelineStep& ps = pipeline.at(i);
+			const PipelineStepTypes& types = ps.Types();
+			QStringList slPorts = ps.InputPorts();
+			PipelinePlan::Stage& stage = plan.m_vectStages[i];
+
+			// Changes to the step or to anything upstream change the key.
+			// The recipe is the same by content, so it also matches in the
+			// next session.
+			stage.uKey = ps.Revision();
+			QCryptographicHash hashRecipe(QCryptographicHash::Md5);
+			hashRecipe.addData(QString("%1:%2(").arg(RECIPE_VERSION).arg(ps.Name()).toUtf8());
+			for (const PipelineStepParam& psp : ps.Params())
+				hashRecipe.addData(QString("%1=%2;").arg(psp.Name(), psp.Value().toString()).toUtf8());
+			for (int p = 0; p < slPorts.count(); ++p)
+			{
+				int iSource = vectSources.at(i).at(p);
+				int iType = iSource < 0 ? iInputType : plan.m_vectStages.at(iSource).iOutType;
+				quint64 uSourceKey = iSource < 0 ? 0 : plan.m_vectStages.at(iSource).uKey;
+				stage.uKey = stage.uKey * 1000003 ^ (uSourceKey + p + 1);
+				hashRecipe.addData(QString("%1<").arg(slPorts.at(p)).toUtf8());
+				hashRecipe.addData(iSource < 0 ? QByteArray("input") : plan.m_vectStages.at(iSource).baRecipe);
+
+				QString sWhat = QString("%1 '%2'").arg(ps.Name(), slPorts.at(p));
+				PipelinePlan::Input in;
+				if (0 == p)
+					in = PipelinePlan::PlanInput(sWhat, iType, types.iInDepth, types.iInChannels);
+				else
+				{
+					const PipelineStepPort& port = types.listAuxInputs.at(p - 1);
+					in = PipelinePlan::PlanInput(sWhat, iType, port.iDepth, port.iChannels);
+				}
+				in.iSource = iSource;
+				stage.vectInputs += in;
+			}
+			stage.baRecipe = hashRecipe.result();
+
+			// The output follows the main input
+			int iDepth = CV_MAT_DEPTH(stage.vectInputs.first().iType);
+			int iChannels = CV_MAT_CN(stage.vectInputs.first().iType);
+			if (types.iOutDepth >= 0)
+				iDepth = types.iOutDepth;
+			if (types.iOutChannels > 0)
+				iChannels = types.iOutChannels;
+			stage.iOutType = CV_MAKETYPE(iDepth, iChannels);
+		}
+	}
+
+	// How long each output is needed, so runs can let go of the ones
+	// nobody asked for early
+	for (int i = 0; i < iCount; ++i)
+	{
+		plan.m_vectStages[i].iLevel = vectLevel.at(i);
+		for (int iSource : vectSources.at(i))
+		{
+			if (iSource >= 0)
+				plan.m_vectStages[iSource].iLastUseLevel = qMax(plan.m_vectStages.at(iSource).iLastUseLevel, vectLevel.at(i));
+		}
+	}
+
+	// Filters feeding only the filter below them, as is, can run fused
+	// with it. Whether they do depends on what a run wants, see Process().
+	QVector<int> vectReaders(iCount, 0);
+	for (int i = 0; i < iCount; ++i)
+	{
+		for (int iSource : vectSources.at(i))
+		{
+			if (iSource >= 0)
+				++vectReaders[iSource];
+		}
+	}
+	for (int i = 0; i < iCount; ++i)
+	{
+		const PipelinePlan::Input& in = plan.m_vectStages.at(i).vectInputs.first();
+		int iSource = in.iSource;
+		if (iSource < 0 || in.pConvBuffers || 1 != vectReaders.at(iSource))
+			continue;
+		if (1 != plan.m_vectStages.at(i).vectInputs.count() || 1 != plan.m_vectStages.at(iSource).vectInputs.count())
+			continue;
+		if (pipeline.at(i).Halo(1.0) < 0 || pipeline.at(iSource).Halo(1.0) < 0)
+			continue;
+
+		plan.m_vectStages[iSource].iFuseNext = i;
+		plan.m_vectStages[iSource].pFuseChecks = std::make_shared<PipelinePlan::FuseChecks>();
+	}
+
+	return plan;
 }
 
 
@@ -293,8 +1108,606 @@ void Pipeline::SerializeV1(Archive& ar)
 		ar >> ps;
 		this->append(ps);
 	}
+
+	// Files from before steps had ids
+	AssignIds();
 }
 
 
+/*************************************************************/
+
+PipelineOutputs PipelineOutputs::All()
+{
+	return PipelineOutputs();
+}
+
+PipelineOutputs PipelineOutputs::Final()
+{
+	PipelineOutputs outputs;
+	outputs.m_mode = MODE_Final;
+	return outputs;
+}
 
+PipelineOutputs PipelineOutputs::Steps(const QList<int>& listSteps)
+{
+	PipelineOutputs outputs;
+	outputs.m_mode = MODE_Steps;
+	outputs.m_listSteps = listSteps;
+	return outputs;
+}
 
+bool PipelineOutputs::Wants(int iStep, int iCount) const
+{
+	switch (m_mode)
+	{
+	case MODE_Final:
+		return iStep == iCount - 1;
+	case MODE_Steps:
+		return m_listSteps.contains(iStep);
+	default:
+		return true;
+	}
+}
+
+
+/*************************************************************/
+
+PipelinePlan::PipelinePlan()
+{
+}
+
+int PipelinePlan::InputType() const
+{
+	return m_iInputType;
+}
+
+int PipelinePlan::OutputType(int iStep) const
+{
+	return m_vectStages.at(iStep).iOutType;
+}
+
+int PipelinePlan::count() const
+{
+	return m_vectStages.count();
+}
+
+int PipelinePlan::ColorCode(int iFromChannels, int iToChannels)
+{
+	if (1 == iToChannels)
+	{
+		if (3 == iFromChannels)
+			return cv::COLOR_BGR2GRAY;
+		if (4 == iFromChannels)
+			return cv::COLOR_BGRA2GRAY;
+	}
+	else if (3 == iToChannels)
+	{
+		if (1 == iFromChannels)
+			return cv::COLOR_GRAY2BGR;
+		if (4 == iFromChannels)
+			return cv::COLOR_BGRA2BGR;
+	}
+	return -1;
+}
+
+PipelinePlan::Input PipelinePlan::PlanInput(const QString& sWhat, int iType, int iDepth, int iChannels)
+{
+	Input in;
+	int iCurDepth = CV_MAT_DEPTH(iType);
+	int iCurChannels = CV_MAT_CN(iType);
+
+	// Bit depth first, cvtColor() only does 8U, 16U and 32F
+	bool bColor = iChannels > 0 && iChannels != iCurChannels;
+	bool bColorDepthOk = CV_8U == iCurDepth || CV_16U == iCurDepth || CV_32F == iCurDepth;
+	if ((iDepth >= 0 && iDepth != iCurDepth) || (bColor && !bColorDepthOk))
+	{
+		// All we know how to convert to is 8 bit, which is what all the steps want so far
+		if (iDepth >= 0 && CV_8U != iDepth)
+			EXERR("PLC1", "%s needs a bit depth we can't convert to", qPrintable(sWhat));
+		in.bTo8U = true;
+		iCurDepth = CV_8U;
+	}
+
+	if (bColor)
+	{
+		in.iColorCode = ColorCode(iCurChannels, iChannels);
+		if (in.iColorCode < 0)
+			EXERR("PLC2", "%s needs %d channels, can't convert from %d", qPrintable(sWhat), iChannels, iCurChannels);
+		iCurChannels = iChannels;
+	}
+
+	if (in.bTo8U || bColor)
+	{
+		LOGINFO("Compile: converting %s to depth %d, %d channels", qPrintable(sWhat), iCurDepth, iCurChannels);
+		in.pConvBuffers = std::make_shared<PipelineBufferPool>();
+	}
+
+	in.iType = CV_MAKETYPE(iCurDepth, iCurChannels);
+	return in;
+}
+
+cv::UMat PipelinePlan::Convert(const Input& in, const cv::UMat& img)
+{
+	cv::UMat imgCur = img;
+	if (in.bTo8U)
+	{
+		cv::UMat imgOut = in.pConvBuffers->Take(imgCur);
+		cv::convertScaleAbs(imgCur, imgOut);
+		in.pConvBuffers->Keep(imgCur, imgOut);
+		imgCur = imgOut;
+	}
+
+	if (in.iColorCode >= 0)
+	{
+		cv::UMat imgOut = in.pConvBuffers->Take(imgCur);
+		cv::cvtColor(imgCur, imgOut, in.iColorCode);
+		in.pConvBuffers->Keep(imgCur, imgOut);
+		imgCur = imgOut;
+	}
+
+	return imgCur;
+}
+
+void PipelinePlan::RunStage(int iStage, const PipelineData& input, PipelineData* pOuts, qint64* pNs, const PipelineContext& context) const
+{
+	context.Check();
+
+	const Stage& stage = m_vectStages.at(iStage);
+	const PipelineStep& ps = m_pipeline.at(iStage);
+
+	// OpenCV's switch is per thread, and pool threads run all sorts
+	PipelinePolicy& policy = PipelinePolicy::Instance();
+	const cv::UMat& imgMain = stage.vectInputs.first().iSource < 0 ? input.img : pOuts[stage.vectInputs.first().iSource].img;
+	int iMainType = stage.vectInputs.first().iType;
+	PipelinePolicy::Device device = policy.Pick(ps, imgMain.size(), iMainType);
+	ScopedOpenCL ocl(PipelinePolicy::DEV_OpenCL == device);
+
+	QElapsedTimer timer;
+	timer.start();
+
+	// Sources are all in earlier levels, so their outputs are done
+	PipelineData dataMain;
+	QList<PipelineData> listAux;
+	for (int p = 0; p < stage.vectInputs.count(); ++p)
+	{
+		const Input& in = stage.vectInputs.at(p);
+		PipelineData data = in.iSource < 0 ? input : pOuts[in.iSource];
+		if (in.pConvBuffers)
+			data.img = Convert(in, data.img);
+		if (0 == p)
+			dataMain = data;
+		else
+			listAux += AlignRoi(data, dataMain);
+	}
+
+	QElapsedTimer timerOp;
+	timerOp.start();
+	PipelineData out = ps.Process(dataMain, listAux, stage.iOutType, context);
+	qint64 iElapsedNs = timer.nsecsElapsed();
+	policy.Record(ps, dataMain.img.size(), iMainType, device, timerOp.nsecsElapsed());
+
+	// Steps build their output from scratch, carry the scale along
+	out.dScale = input.dScale;
+	if (1.0 == input.dScale)
+		ps.m_pStats->Record(iElapsedNs, out);
+
+	pOuts[iStage] = out;
+	pNs[iStage] = iElapsedNs;
+}
+
+PipelineData PipelinePlan::AlignRoi(const PipelineData& aux, const PipelineData& main)
+{
+	// An aux input from above a ROI step gets cut down to the main input's
+	// part, so the step sees the two line up
+	cv::Rect rcAux = aux.FrameRect();
+	cv::Rect rcMain = main.FrameRect();
+	if (rcAux == rcMain)
+		return aux;
+	if ((rcAux & rcMain) != rcMain)
+		EXERR("PLR2", "An input covers %dx%d at %d,%d of the frame, the main input needs %dx%d at %d,%d",
+			rcAux.width, rcAux.height, rcAux.x, rcAux.y, rcMain.width, rcMain.height, rcMain.x, rcMain.y);
+
+	PipelineData cut = aux;
+	cut.img = aux.img(rcMain - rcAux.tl());
+	cut.roi = rcMain;
+	return cut;
+}
+
+QVector<int> PipelinePlan::FusableChain(int iHead, const QVector<bool>& vectWanted, const PipelineCache* pCache) const
+{
+	// Down the filters as long as nobody wants what the one above gives
+	QVector<int> vectChain{ iHead };
+	int i = iHead;
+	while (!vectWanted.at(i) && m_vectStages.at(i).iFuseNext >= 0)
+	{
+		int iNext = m_vectStages.at(i).iFuseNext;
+
+		// Good in the cache, it doesn't have to run
+		if (pCache && pCache->m_listEntries.at(iNext).uKey == m_vectStages.at(iNext).uKey)
+			break;
+		vectChain += iNext;
+		i = iNext;
+	}
+	return vectChain;
+}
+
+void PipelinePlan::RunStrip(const QVector<int>& vectChain, const QVector<int>& vectHalo, const PipelineData& dataIn, const cv::UMat& imgOut, const cv::Range& rows,
+	const PipelineContext& context) const
+{
+	context.Check();
+
+	// Rows each step has to give: the last one the strip, the ones above
+	// that plus the halo of the one below, as far as the frame goes
+	int iSteps = vectChain.count();
+	int iFrameRows = dataIn.img.rows;
+	QVector<cv::Range> vectRows(iSteps);
+	vectRows[iSteps - 1] = rows;
+	for (int k = iSteps - 2; k >= 0; --k)
+	{
+		const cv::Range& below = vectRows.at(k + 1);
+		vectRows[k] = cv::Range(qMax(0, below.start - vectHalo.at(k + 1)), qMin(iFrameRows, below.end + vectHalo.at(k + 1)));
+	}
+
+	// Each step gets a ROI of the rows above's output, whose extra rows are
+	// its halo. Where those stop at the edge of the frame, so does the ROI's
+	// parent, and the filter extrapolates the border just like on the
+	// whole frame.
+	cv::UMat imgAbove = dataIn.img;
+	int iAboveTop = 0;
+	for (int k = 0; k < iSteps; ++k)
+	{
+		int iStage = vectChain.at(k);
+		const PipelineStep& ps = m_pipeline.at(iStage);
+		const cv::Range& rowsStep = vectRows.at(k);
+
+		PipelineData src;
+		src.img = imgAbove.rowRange(rowsStep.start - iAboveTop, rowsStep.end - iAboveTop);
+		src.dScale = dataIn.dScale;
+
+		cv::UMat imgDest;
+		if (iSteps - 1 == k)
+			imgDest = imgOut.rowRange(rowsStep);
+		else
+			imgDest.create(rowsStep.size(), imgOut.cols, m_vectStages.at(iStage).iOutType);
+
+		PipelineData dest;
+		dest.img = imgDest;
+		dest.dScale = dataIn.dScale;
+		ps.RunOp(src, QList<PipelineData>(), dest, context);
+
+		// Steps are asked to write in place, but make sure
+		if (dest.img.u != imgDest.u || dest.img.offset != imgDest.offset)
+			dest.img.copyTo(imgDest);
+
+		imgAbove = imgDest;
+		iAboveTop = rowsStep.start;
+	}
+}
+
+void PipelinePlan::RunFused(const QVector<int>& vectChain, const PipelineData& input, PipelineData* pOuts, qint64* pNs, const PipelineContext& context) const
+{
+	// Every strip checks too, see RunStrip()
+	context.Check();
+
+	int iHead = vectChain.first();
+	int iTail = vectChain.last();
+	const PipelineStep& psTail = m_pipeline.at(iTail);
+	const Stage& stageTail = m_vectStages.at(iTail);
+
+	QElapsedTimer timer;
+	timer.start();
+
+	PipelineData dataIn;
+	const Input& in = m_vectStages.at(iHead).vectInputs.first();
+	dataIn = in.iSource < 0 ? input : pOuts[in.iSource];
+	if (in.pConvBuffers)
+		dataIn.img = Convert(in, dataIn.img);
+	dataIn.dScale = input.dScale;
+	cv::Size size = dataIn.img.size();
+
+	// Strips of whole rows, as many as fit in L2 with all the steps'
+	// outputs, but not so thin that they are mostly halo
+	QVector<int> vectHalo;
+	int iHaloRows = 0;
+	qint64 iRowBytes = 0;
+	for (int i : vectChain)
+	{
+		vectHalo += m_pipeline.at(i).Halo(input.dScale);
+		iHaloRows += vectHalo.last();
+		iRowBytes += (qint64)size.width * CV_ELEM_SIZE(m_vectStages.at(i).iOutType);
+	}
+	int iStripRows = (int)qMin<qint64>(size.height, ms_iFuseStripBytes / qMax<qint64>(1, iRowBytes));
+	iStripRows = qMax(iStripRows, qMax(ms_iFuseMinRows, 4 * iHaloRows));
+	int iStrips = (size.height + iStripRows - 1) / iStripRows;
+
+	ScopedOpenCL ocl(false);
+	auto funcStepByStep = [this, &vectChain, &dataIn, &context]() {
+		PipelineData data = dataIn;
+		for (int i : vectChain)
+		{
+			context.Check();
+			data = m_pipeline.at(i).Process(data, QList<PipelineData>(), m_vectStages.at(i).iOutType, context);
+			data.dScale = dataIn.dScale;
+		}
+		return data.img;
+	};
+
+	// Each frame size is checked against running the steps one by one
+	// the first time. -1 not yet, 0 not the same, 1 the same.
+	FuseChecks& checks = *m_vectStages.at(iHead).pFuseChecks;
+	QVector<int> vectCheckKey{ size.height, size.width, vectChain.count() };
+	int iIdentical;
+	{
+		QMutexLocker lock(&checks.mutex);
+		iIdentical = checks.mapIdentical.contains(vectCheckKey) ? (int)checks.mapIdentical.value(vectCheckKey) : -1;
+	}
+
+	// The last step's output is the only full size one, from its pool as usual
+	int iTailInType = m_vectStages.at(vectChain.at(vectChain.count() - 2)).iOutType;
+	PipelineData out;
+	out.dScale = input.dScale;
+	out.roi = dataIn.roi;
+	if (0 == iIdentical)
+	{
+		out.img = funcStepByStep();
+		FinishFused(vectChain, out, timer.nsecsElapsed(), pOuts, pNs);
+		return;
+	}
+	out.img = psTail.m_pBuffers->Take(size, iTailInType);
+	if (out.img.empty())
+		out.img.create(size, stageTail.iOutType);
+
+	// Same scheme as the branches, except only idle pool threads help out.
+	// A strip queued behind busy ones would only keep us waiting.
+	QAtomicInt iNext(0);
+	auto funcStrips = [this, &iNext, iStrips, iStripRows, &size, &vectChain, &vectHalo, &dataIn, &out, &context]() {
+		ScopedOpenCL ocl(false);
+		int iStrip;
+		while ((iStrip = iNext.fetchAndAddRelaxed(1)) < iStrips)
+			RunStrip(vectChain, vectHalo, dataIn, out.img, cv::Range(iStrip * iStripRows, qMin(size.height, (iStrip + 1) * iStripRows)), context);
+	};
+	int iHelpers = qMin(iStrips, QThread::idealThreadCount()) - 1;
+	QVector<ExceptionContainer> vectErrors(qMax(0, iHelpers) + 1);
+	ExceptionContainer* pErrors = vectErrors.data();
+	QSemaphore semDone;
+	int iStarted = 0;
+	for (int h = 1; h <= iHelpers; ++h)
+	{
+		bool bStarted = QThreadPool::globalInstance()->tryStart([&funcStrips, &iNext, iStrips, pErrors, h, &semDone]() {
+			try
+			{
+				funcStrips();
+			}
+			catch (...)
+			{
+				iNext.storeRelaxed(iStrips);
+				pErrors[h] = ExceptionContainer::CurrentException();
+			}
+			semDone.release();
+		});
+		if (bStarted)
+			++iStarted;
+	}
+
+	try
+	{
+		funcStrips();
+	}
+	catch (...)
+	{
+		iNext.storeRelaxed(iStrips);
+		pErrors[0] = ExceptionContainer::CurrentException();
+	}
+
+	semDone.acquire(iStarted);
+	for (const ExceptionContainer& exc : vectErrors)
+	{
+		if (exc.GetException())
+			exc.Rethrow();
+	}
+
+	psTail.m_pBuffers->Keep(size, iTailInType, out.img);
+
+	if (iIdentical < 0)
+	{
+		// Whatever the reason, the fused output must never differ
+		cv::UMat imgSteps = funcStepByStep();
+		bool bIdentical = 0.0 == cv::norm(out.img, imgSteps, cv::NORM_INF);
+		{
+			QMutexLocker lock(&checks.mutex);
+			checks.mapIdentical.insert(vectCheckKey, bIdentical);
+		}
+		if (!bIdentical)
+		{
+			LOGWRN("%s to %s fused isn't the same as step by step for %dx%d, not fusing it",
+				qPrintable(m_pipeline.at(iHead).Name()), qPrintable(psTail.Name()), size.width, size.height);
+			out.img = imgSteps;
+		}
+	}
+
+	FinishFused(vectChain, out, timer.nsecsElapsed(), pOuts, pNs);
+}
+
+void PipelinePlan::FinishFused(const QVector<int>& vectChain, const PipelineData& out, qint64 iElapsedNs, PipelineData* pOuts, qint64* pNs) const
+{
+	int iTail = vectChain.last();
+	if (1.0 == out.dScale)
+		m_pipeline.at(iTail).m_pStats->Record(iElapsedNs, out);
+
+	// The time all goes to the last step, the others have no output of their own
+	for (int i : vectChain)
+		pNs[i] = 0;
+	pOuts[iTail] = out;
+	pNs[iTail] = iElapsedNs;
+}
+
+QList<cv::UMat> PipelinePlan::Process(const PipelineData& input, PipelineCache* pCache, const PipelineContext& context,
+	const PipelineOutputs& outputs) const
+{
+	Q_ASSERT(input.img.type() == m_iInputType);
+
+	int iCount = m_vectStages.count();
+	QVector<bool> vectWanted(iCount);
+	for (int i = 0; i < iCount; ++i)
+		vectWanted[i] = outputs.Wants(i, iCount);
+	QVector<PipelineData> vectOuts(iCount);
+	QVector<qint64> vectNs(iCount, 0);
+
+	// Branches write straight into these, so don't let the vectors detach
+	PipelineData* pOuts = vectOuts.data();
+	qint64* pNs = vectNs.data();
+
+	// A cache from a pipeline with a different number of steps is no use.
+	// Otherwise entries with the wrong key simply don't match.
+	if (pCache && pCache->m_listEntries.count() != iCount)
+	{
+		pCache->m_listEntries.clear();
+		for (int i = 0; i < iCount; ++i)
+			pCache->m_listEntries += PipelineCache::Entry();
+	}
+
+	// The disk cache only keeps full size outputs
+	PipelineDiskCache* pDiskCache = nullptr;
+	QByteArray baInputHash;
+	if (pCache && pCache->m_pDiskCache && 1.0 == input.dScale)
+	{
+		pDiskCache = pCache->m_pDiskCache;
+		baInputHash = pCache->InputHash(input);
+	}
+
+	// Fused chains skip outputs the disk cache would store, and tiling
+	// only pays off on the CPU
+	bool bFuse = !pDiskCache && !PipelinePolicy::Instance().OpenCL();
+	QVector<bool> vectDone(iCount, false);		///< Already run as part of a fused chain
+
+	for (int iLevel = 0; iLevel < m_vectLevels.count(); ++iLevel)
+	{
+		const QVector<int>& vectStepsInLevel = m_vectLevels.at(iLevel);
+
+		// Pick up the cached outputs that are still valid, from memory or disk
+		QVector<int> vectFresh;
+		QVector<int> vectRun;
+		QVector<QByteArray> vectDiskKeys(iCount);
+		for (int i : vectStepsInLevel)
+		{
+			if (vectDone.at(i))
+			{
+				vectFresh += i;
+				continue;
+			}
+			if (pCache && pCache->m_listEntries.at(i).uKey == m_vectStages.at(i).uKey)
+			{
+				pOuts[i] = pCache->m_listEntries.at(i).out;
+				continue;
+			}
+			vectFresh += i;
+
+			if (pDiskCache)
+			{
+				QElapsedTimer timer;
+				timer.start();
+				vectDiskKeys[i] = QCryptographicHash::hash(baInputHash + m_vectStages.at(i).baRecipe, QCryptographicHash::Md5);
+				if (pDiskCache->Load(vectDiskKeys.at(i), pOuts[i]))
+				{
+					pOuts[i].dScale = input.dScale;
+					pNs[i] = timer.nsecsElapsed();
+					continue;
+				}
+			}
+			vectRun += i;
+		}
+
+		// Run the chains starting here in one go, the steps further down
+		// are then done by the time their level comes
+		for (int k = 0; bFuse && k < vectRun.count(); )
+		{
+			QVector<int> vectChain = FusableChain(vectRun.at(k), vectWanted, pCache);
+			if (vectChain.count() < 2)
+			{
+				++k;
+				continue;
+			}
+			RunFused(vectChain, input, pOuts, pNs, context);
+			for (int c = 1; c < vectChain.count(); ++c)
+				vectDone[vectChain.at(c)] = true;
+			vectRun.removeAt(k);
+		}
+
+		if (1 == vectRun.count())
+			RunStage(vectRun.first(), input, pOuts, pNs, context);
+		else if (vectRun.count() > 1)
+		{
+			// Independent branches. Hand all but the first to the pool and
+			// do that one ourselves, so a busy pool only costs us time.
+			QVector<ExceptionContainer> vectErrors(vectRun.count());
+			ExceptionContainer* pErrors = vectErrors.data();
+			QSemaphore semDone;
+			for (int k = 1; k < vectRun.count(); ++k)
+			{
+				int iStage = vectRun.at(k);
+				QThreadPool::globalInstance()->start([this, iStage, k, &input, pOuts, pNs, pErrors, &semDone, &context]() {
+					try
+					{
+						RunStage(iStage, input, pOuts, pNs, context);
+					}
+					catch (...)
+					{
+						pErrors[k] = ExceptionContainer::CurrentException();
+					}
+					semDone.release();
+				});
+			}
+
+			try
+			{
+				RunStage(vectRun.first(), input, pOuts, pNs, context);
+			}
+			catch (...)
+			{
+				pErrors[0] = ExceptionContainer::CurrentException();
+			}
+
+			// Everyone has to be done with our locals before we go anywhere
+			semDone.acquire(vectRun.count() - 1);
+			for (const ExceptionContainer& exc : vectErrors)
+			{
+				if (exc.GetException())
+					exc.Rethrow();
+			}
+		}
+
+		if (pDiskCache)
+		{
+			for (int i : vectRun)
+				pDiskCache->Store(vectDiskKeys.at(i), pOuts[i]);
+		}
+
+		if (pCache)
+		{
+			for (int i : vectFresh)
+			{
+				// Unwanted outputs aren't kept, they would hold on to
+				// their buffers. Only the time is.
+				PipelineCache::Entry& entry = pCache->m_listEntries[i];
+				entry.uKey = vectWanted.at(i) ? m_vectStages.at(i).uKey : 0;
+				entry.iElapsedNs = pNs[i];
+				entry.out = vectWanted.at(i) ? pOuts[i] : PipelineData();
+			}
+		}
+
+		// Let go of unwanted outputs nothing further down reads. That
+		// frees their buffers for the next run.
+		for (int i = 0; i < iCount; ++i)
+		{
+			const Stage& stage = m_vectStages.at(i);
+			if (!vectWanted.at(i) && stage.iLevel <= iLevel && stage.iLastUseLevel <= iLevel)
+				pOuts[i] = PipelineData();
+		}
+	}
+
+	// Collect all results in an array
+	QList<cv::UMat> listOuts;
+	for (int i = 0; i < iCount; ++i)
+		listOuts += pOuts[i].img;
+	return listOuts;
+}
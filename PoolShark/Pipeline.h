@@ -1,6 +1,12 @@
 #pragma once
 
 #include <SerMig.h>
+#include <Exception.h>
+#include <QMutex>
+#include <QDataStream>
+#include <QDeadlineTimer>
+#include <QMetaType>
+#include <memory>
 #include <opencv2/core/core.hpp>
 
 
@@ -52,42 +58,329 @@ private:
 SERMIG_ARCHIVERS(PipelineStepParam)
 
 
+class PipelineContext;
+
+/**
+@brief Geometry a step found, kept apart from the image
+
+Steps like findContours and HoughLines used to draw what they found into a
+blank full size image on every run. Now they only report it, and whoever
+shows the result draws it on top at the size it is shown, see Draw().
+Coordinates are in pixels of the whole frame at the resolution of the image
+it came with, so shapes found in a ROI line up with the frame (see
+PipelineData::roi).
+*/
+struct PipelineOverlay {
+	std::vector<std::vector<cv::Point>> contours;
+	std::vector<cv::Vec2f> lines;		///< rho, theta, as from HoughLines()
+	std::vector<cv::Vec4i> segments;	///< x1, y1, x2, y2
+	std::vector<cv::Vec3f> circles;		///< x, y, radius
+
+	bool IsEmpty() const;
+	int Count() const;		///< Shapes of all kinds
+
+	/// Move shapes found in an image at pt in the frame to frame coordinates
+	void Offset(const cv::Point& pt, const PipelineContext* pContext = nullptr);
+
+	/// Draw onto an 8UC3 image showing the overlay's image scaled by dScale,
+	/// after cropping ptOrigin off the top left. Tens of thousands of
+	/// contours take a while, with a context it can be given up part way.
+	void Draw(cv::Mat& mat, double dScale = 1.0, const cv::Point2d& ptOrigin = cv::Point2d(), const PipelineContext* pContext = nullptr) const;
+};
+
+/// All the shapes, each kind as a count and then their numbers. Reading
+/// fails the stream on a count there aren't enough bytes left for, so
+/// damaged data can't ask for a huge allocation.
+QDataStream& operator<<(QDataStream& ds, const PipelineOverlay& overlay);
+QDataStream& operator>>(QDataStream& ds, PipelineOverlay& overlay);
+
+/// Hands the pixel bytes of mat to func, row by row as mat may be a view
+/// into a bigger image, or all at once when there are no gaps
+void ForEachPixelRow(const cv::Mat& mat, const std::function<void(const char* pBytes, qint64 iBytes)>& func);
+
 struct PipelineData {
 	cv::UMat img;
+	PipelineOverlay overlay;
 
-	std::vector<std::vector<cv::Point>> contours;
+	/// Resolution of img relative to the full size input. Less than 1 for
+	/// previews, steps use it to scale their pixel size dependent params.
+	double dScale = 1.0;
+
+	/// The part of the frame img is, in pixels at img's resolution. Empty
+	/// for all of it. Set by steps like ROI and carried down from the main
+	/// input, so everything below only processes and allocates that part.
+	cv::Rect roi;
+	cv::Rect FrameRect() const;		///< roi, or all of img if it's empty
+};
+
+// For queued signals, between the workers and the GUI
+Q_DECLARE_METATYPE(cv::UMat)
+Q_DECLARE_METATYPE(PipelineData)
+
+
+/// What PipelineContext::Check() throws, not an error as such
+DECLARE_EXCEPTION_TYPE(PipelineAbandoned)
+
+/**
+@brief Lets a run be given up part way, when cancelled or out of time
+
+Every step gets one along with its input. Check() throws PipelineAbandoned
+once Cancel() has been called or the time budget is spent, and before that
+runs the checkpoint, which can throw on its own terms (the executor's stop
+requests do). The plan checks before every step and every fused strip, and
+loops of our own check every ms_iCheckEvery items, so a run stops soon
+after. A single OpenCV call can't be interrupted, the first check after it
+returns catches it.
+
+Copies share the cancel flag and the deadline, so the caller can keep one
+to Cancel() while a run works with another.
+*/
+class PipelineContext
+{
+public:
+	/// Called on every Check(). Throw from it to abandon the run.
+	using Checkpoint = std::function<void()>;
+
+	PipelineContext();
+	explicit PipelineContext(const Checkpoint& funcCheckpoint);
+
+	/// Give up if still running dMs from now, 0 for no limit
+	void SetBudgetMs(double dMs);
+	bool IsLate() const;
+
+	void Cancel();		///< Safe from any thread
+	bool IsCancelled() const;
+
+	void Check() const;		///< Throws if the run should stop
+	void CheckEvery(qint64 iItem) const;	///< Check() on every ms_iCheckEvery-th item of a loop
+
+	static const int ms_iCheckEvery = 1024;
+
+private:
+	struct Shared {
+		QAtomicInt bCancelled;
+		QDeadlineTimer deadline{ QDeadlineTimer::Forever };
+	};
+	std::shared_ptr<Shared> m_pShared;
+	Checkpoint m_funcCheckpoint;
+};
+
+
+/**
+@brief Rolling run time and output size of a pipeline step
+
+Keeps the time of the last few runs of the step for min/mean/p95, along
+with the size of the last output. Steps from the cache and reduced
+resolution previews don't count, only full size runs that actually
+happened. Safe to record from several workers at once.
+*/
+class PipelineStepStats
+{
+public:
+	struct Summary {
+		int iRuns = 0;				///< Runs in the window
+		double dMinMs = 0.0;
+		double dMeanMs = 0.0;
+		double dP95Ms = 0.0;
+		qint64 iOutBytes = 0;		///< Size of the last output image
+		int iShapes = 0;			///< Overlay shapes in the last output
+	};
+
+	void Record(qint64 iElapsedNs, const PipelineData& out);
+	Summary Summarize() const;
+	void Clear();
+
+private:
+	static const int ms_iWindow = 100;
+
+	mutable QMutex m_mutex;
+	QVector<qint64> m_vectNs;	///< Ring buffer of the last ms_iWindow run times
+	int m_iNext = 0;
+	qint64 m_iOutBytes = 0;
+	int m_iShapes = 0;
+};
+
+/**
+@brief Output buffers of a pipeline step, kept for the next run
+
+Running the same step over same sized frames over and over, the output is
+the same shape and type every time. Instead of letting OpenCV allocate a
+new image each run, the step takes a buffer from here and the OpenCV call
+writes straight into it (create() is a no-op when the shape matches).
+
+Buffers are keyed by the shape and type of the step's input. A buffer is
+only handed out again once nobody else (cache, GUI, next step...) holds a
+reference to it, so outputs already delivered are never overwritten.
+*/
+class PipelineBufferPool
+{
+public:
+	cv::UMat Take(const cv::UMat& input);	///< Empty if there is no free buffer
+	void Keep(const cv::UMat& input, const cv::UMat& output);
+
+	/// Same, for when there is no input image to go by
+	cv::UMat Take(const cv::Size& size, int iInType);
+	void Keep(const cv::Size& size, int iInType, const cv::UMat& output);
+
+	void Clear();
+
+private:
+	static const int ms_iMaxBuffers = 8;
+
+	struct Key {
+		int iRows = 0;
+		int iCols = 0;
+		int iType = 0;
+		Key() = default;
+		Key(const cv::Size& size, int iType) : iRows(size.height), iCols(size.width), iType(iType) {}
+		bool operator==(const Key& other) const { return iRows == other.iRows && iCols == other.iCols && iType == other.iType; }
+	};
+	struct Entry {
+		Key key;
+		cv::UMat img;
+	};
+
+	QMutex m_mutex;
+	QList<Entry> m_listEntries;	///< Most recently kept last
+
+	static bool IsFree(const cv::UMat& img);
+};
+
+
+/**
+@brief An input of a step beyond the main one, a mask for instance
+*/
+struct PipelineStepPort {
+	QString sName;
+	int iDepth = -1;		///< As for PipelineStepTypes::iInDepth
+	int iChannels = 0;
+};
+
+/**
+@brief Image formats a step takes and gives
+
+Checked by Pipeline::Compile() before anything runs, so the operations
+themselves can assume they get what they asked for. The output size and
+type follow the main input.
+*/
+struct PipelineStepTypes {
+	int iInDepth = -1;		///< CV_8U etc. -1 takes any.
+	int iInChannels = 0;	///< 0 takes any
+	int iOutDepth = -1;		///< -1 for the same as the input
+	int iOutChannels = 0;	///< 0 for the same as the input
+	QList<PipelineStepPort> listAuxInputs;	///< Handed to the operation in this order
+	bool bPassImage = false;	///< The output image is the main input, the step only adds to the overlay
+	bool bCrop = false;			///< The output image is the part of the main input the step sets out.roi to
 };
 
+
 /**
 @brief OpenCV image processing step
 
 This class contains info about the parameters for the the operation,
 the name, and the actual operation.
+
+Every step has a main input port named "in", possibly some aux ones, and
+one output. Each input is fed by the step above unless SetSource() points
+it at another step or at the pipeline's input image.
 */
 class PipelineStep : public SerMig
 {
 public:
 	DECLARE_SERMIG;
-	using FuncOp = std::function<PipelineData(const PipelineData& input, const QList<PipelineStepParam>& listParams)>;
+	/// Write the result into out. out.img may already hold a buffer from a
+	/// previous run, so write into it (dst args, create(), copyTo()) rather
+	/// than replacing it. With bPassImage set, out.img is the input image,
+	/// so leave it alone. With bCrop set, only set out.roi, in frame pixels.
+	/// Overlay shapes go in frame pixels, see PipelineOverlay::Offset().
+	/// listAux has the aux inputs in Types() order, cut to the main input's
+	/// ROI.
+	/// pParams is whatever FuncDecode made, see PipelineFactory::Define()
+	/// for the typed version.
+	/// Loops over pixels or shapes of the op's own should call
+	/// context.CheckEvery(), and anything slow after a long OpenCV call
+	/// context.Check().
+	using FuncOp = std::function<void(const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const void* pParams,
+		const PipelineContext& context)>;
+
+	/// Turn the param values into the struct FuncOp gets
+	using FuncDecode = std::function<std::shared_ptr<const void>(const QList<PipelineStepParam>& listParams)>;
+
+	/// For neighbourhood filters: how far from an output pixel the input
+	/// pixels it depends on can be, -1 if it isn't such a filter with these
+	/// params. See Halo().
+	using FuncHalo = std::function<int(const void* pParams, double dScale)>;
 
 	PipelineStep();
-	PipelineStep(const QString& sName, const QList<PipelineStepParam>& listParams, FuncOp funcOp);
+	PipelineStep(const QString& sName, const QList<PipelineStepParam>& listParams, const PipelineStepTypes& types, FuncDecode funcDecode, FuncOp funcOp,
+		FuncHalo funcHalo = nullptr);
 	
-	PipelineData Process(const PipelineData& input);
+	/// Inputs must already be in the format Types() asks for
+	PipelineData Process(const PipelineData& input, const QList<PipelineData>& listAux, int iOutType,
+		const PipelineContext& context = PipelineContext()) const;
 	
 	QString Name() const;
-	QList<PipelineStepParam>& Params();
+	const PipelineStepTypes& Types() const;
+
+	/// Rows and columns of input needed around each output pixel, or -1.
+	/// A step with a halo computes any part of its output exactly from
+	/// that part of its input plus the halo, taking pixels beyond the edge
+	/// of a ROI from the image around it, so it can be run tile by tile.
+	int Halo(double dScale) const;
+
+	/// Where an input port gets its data. Anything else is the Id() of a step.
+	enum {
+		SRC_Previous = 0,	///< The step above, or the input image for the first step
+		SRC_Input = -1,		///< The pipeline's input image
+	};
+	static const char* const ms_szMainPort;	///< "in"
+	QStringList InputPorts() const;			///< The main one first, then the aux ones
+	int Source(const QString& sPort) const;
+	void SetSource(const QString& sPort, int iSource);
+	int Id() const;		///< Unique within the pipeline, see Pipeline::AssignIds()
+	int Device() const;		///< A PipelinePolicy::Device, DEV_Auto unless pinned
+	void SetDevice(int iDevice);
 	const QList<PipelineStepParam>& Params() const;
 	bool ContainsParam(const QString& sName) const;
 	void SetParamVal(const QString& sName, const QVariant& vVal);
+	void SetParamVal(int iParam, const QVariant& vVal);
 	void Dump() const;
 
+	/// Changes every time a parameter changes. Copies of a step share the
+	/// revision, since they will produce the same output for the same input.
+	quint64 Revision() const;
+
+	/// Copies share the stats, so runs on a snapshot of the pipeline
+	/// show up on the original.
+	const PipelineStepStats& Stats() const;
+	void ResetStats();	///< Detach from the stats shared with any copies
+	void ResetBuffers();	///< Same for the buffer pool
+
 private:
+	friend class PipelinePlan;	///< Records the stats, runs tiles
+	friend class Pipeline;		///< Hands out the ids
 	QString m_sName;
 	QList<PipelineStepParam> m_listParams;	///< The actaul params are held in the list
 	QMap<QString, int> m_mapParamPositions; ///< The map is for easy access by name
+	PipelineStepTypes m_types;
+	FuncDecode m_funcDecode;
 	FuncOp m_funcOp;
+	FuncHalo m_funcHalo;
+	/// m_funcOp with OpenCV's errors turned into ours, naming the step
+	void RunOp(const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const PipelineContext& context) const;
+	std::shared_ptr<const void> m_pDecodedParams;	///< Redone on every change, never modified
+	void DecodeParams();
+	quint64 m_uRevision = 0;
+	int m_iId = 0;		///< 0 until the pipeline gives it one
+	QMap<QString, int> m_mapSources;	///< Input port -> source, ports not in here are SRC_Previous
+	int m_iDevice = 0;		///< PipelinePolicy::DEV_Auto
+	std::shared_ptr<PipelineStepStats> m_pStats;
+	std::shared_ptr<PipelineBufferPool> m_pBuffers;	///< Shared by copies too, it's locked
 
+	static quint64 NextRevision();
+
+	void SerializeV4(Archive& ar);
+	void SerializeV3(Archive& ar);
 	void SerializeV2(Archive& ar);
 	void SerializeV1(Archive& ar);
 };
@@ -96,9 +389,54 @@ SERMIG_ARCHIVERS(PipelineStep)
 
 
 
+class Pipeline;
+class PipelinePlan;
+class PipelineDiskCache;
+
 /**
-@brief OpenCV sequence of processing steps
+@brief Step outputs from a previous run of a pipeline over one input
 
+Each entry remembers a key made from the revision of the step that produced
+it and the keys of the steps feeding it. An entry is only reused if the key
+still matches, so parameter edits, rewiring, inserts, removes and reorders
+all invalidate the changed step and everything downstream of it, but not
+other branches. Keep one of these per input image.
+
+With a disk cache set, steps missing here are looked for there before
+running them, and what runs is saved there. Only for full size runs.
+*/
+class PipelineCache
+{
+public:
+	void Clear();
+	int Count() const;
+	qint64 StepNs(int iStep) const;		///< How long the step took when its entry was computed (or loaded)
+	const PipelineData& Output(int iStep) const;
+	QList<PipelineData> Outputs() const;	///< Of every step, in pipeline order
+	void SetDiskCache(PipelineDiskCache* pDiskCache);	///< Not owned, can be shared by many
+
+private:
+	friend class PipelinePlan;
+	PipelineDiskCache* m_pDiskCache = nullptr;
+	const void* m_pHashedInput = nullptr;	///< The input m_baInputHash is for
+	QByteArray m_baInputHash;
+	const QByteArray& InputHash(const PipelineData& input);
+
+	struct Entry {
+		quint64 uKey = 0;	///< 0 never matches
+		qint64 iElapsedNs = 0;
+		PipelineData out;
+	};
+	QList<Entry> m_listEntries;		///< One per step
+};
+
+
+/**
+@brief OpenCV processing steps
+
+The steps are kept in a list, which is also the order they are shown in.
+By default each step feeds the next, but inputs can be wired to any other
+step, which makes the pipeline a graph with branches and merges.
 */
 class Pipeline : public QList<PipelineStep>, public SerMig
 {
@@ -108,8 +446,21 @@ public:
 	QString Name() const;
 	void SetName(const QString& sName);
 
-	QList<cv::UMat> Process(const cv::UMat& inputImg);
-	QList<cv::UMat> Process(const PipelineData& input);
+	/// Give every step a unique Id(). Call after adding steps.
+	void AssignIds();
+	int IndexOf(int iId) const;		///< -1 if no step has the id
+	void RemoveStep(int iStep);		///< Inputs it fed go back to SRC_Previous
+
+	/// Check that every step can take what its inputs give, for pipeline
+	/// inputs of the given type, and work out the conversions in between
+	/// and the order to run in. Throws if there is a step that can't be
+	/// fed, or steps that feed each other in a loop.
+	PipelinePlan Compile(int iInputType) const;
+
+	/// Compile and run in one go. Handy for one offs, anything that runs
+	/// the same pipeline over and over should Compile() once instead.
+	QList<cv::UMat> Process(const cv::UMat& inputImg, PipelineCache* pCache = nullptr, const PipelineContext& context = PipelineContext()) const;
+	QList<cv::UMat> Process(const PipelineData& input, PipelineCache* pCache = nullptr, const PipelineContext& context = PipelineContext()) const;
 
 private:
 	QString m_sName;
@@ -119,3 +470,118 @@ private:
 };
 SERMIG_ARCHIVERS(Pipeline)
 
+
+/**
+@brief Which step outputs a run hands back
+
+Outputs nobody asked for are dropped as soon as the last step reading them
+is done, so their buffers go back to the step's pool for the next run
+instead of living until the end. They aren't kept in the cache either.
+*/
+class PipelineOutputs
+{
+public:
+	static PipelineOutputs All();		///< For the GUI, which shows every step
+	static PipelineOutputs Final();		///< Only the last step, for batch runs
+	static PipelineOutputs Steps(const QList<int>& listSteps);
+
+	bool Wants(int iStep, int iCount) const;
+
+private:
+	enum Mode {
+		MODE_All,
+		MODE_Final,
+		MODE_Steps,
+	};
+	Mode m_mode = MODE_All;
+	QList<int> m_listSteps;
+};
+
+
+/**
+@brief A compiled pipeline, ready to run over inputs of one type
+
+Made by Pipeline::Compile(). Holds a snapshot of the steps along with the
+type each one takes and gives, and the conversions (bit depth, gray/color)
+needed to get from one to the next. Nothing is checked while running.
+
+The steps are grouped into levels, where nothing in a level depends on
+anything else in it. Levels run in order, the steps of a level run side by
+side on the global thread pool. A step feeding several others runs once.
+
+Chains of neighbourhood filters (see PipelineStep::Halo()) where only the
+last output is wanted run fused: the frame is cut into strips that fit in
+L2, each strip runs through the whole chain with enough extra rows for the
+filters below, and the strips are spread over the thread pool. The middle
+outputs never exist full size. The first time a chain runs on a frame size
+it is also run step by step, and if that isn't bit for bit the same the
+chain is never fused for that size again. Fused runs only happen on the
+CPU, without a disk cache, and their time all goes to the last step.
+
+Never changes once built, so any number of workers can run the same plan
+at once. The steps' buffer pools are already thread safe, and each output
+is created at its final size and type before the step runs.
+*/
+class PipelinePlan
+{
+public:
+	PipelinePlan();
+
+	int InputType() const;
+	int OutputType(int iStep) const;
+	int count() const;
+
+	/// Run all steps and return the image from each one, in pipeline
+	/// order, empty for the steps not in outputs. If a cache is given, only
+	/// the steps that changed or are fed by one that changed are run. The
+	/// input must be of InputType().
+	/// The context is checked before every step, see PipelineContext.
+	QList<cv::UMat> Process(const PipelineData& input, PipelineCache* pCache = nullptr, const PipelineContext& context = PipelineContext(),
+		const PipelineOutputs& outputs = PipelineOutputs::All()) const;
+
+private:
+	friend class Pipeline;
+
+	struct Input {
+		int iSource = -1;		///< Step feeding it, -1 for the pipeline input
+		bool bTo8U = false;		///< convertScaleAbs() it first
+		int iColorCode = -1;	///< Then cvtColor() it with this, if not -1
+		int iType = 0;			///< What the step gets after the conversions
+		std::shared_ptr<PipelineBufferPool> pConvBuffers;
+	};
+	/// How fused chains starting at a step compared with running them step
+	/// by step, by rows, cols and chain length
+	struct FuseChecks {
+		QMutex mutex;
+		QMap<QVector<int>, bool> mapIdentical;
+	};
+	struct Stage {
+		QVector<Input> vectInputs;	///< Main input first
+		int iOutType = 0;
+		quint64 uKey = 0;		///< For the cache, see PipelineCache
+		QByteArray baRecipe;	///< Hash of the step and everything upstream by content, for the disk cache
+		int iLevel = 0;
+		int iLastUseLevel = -1;	///< Last level reading the output, -1 if none does
+		int iFuseNext = -1;		///< Filter taking this filter's output and nothing else does, -1 if none
+		std::shared_ptr<FuseChecks> pFuseChecks;		///< With iFuseNext
+	};
+	Pipeline m_pipeline;
+	QVector<Stage> m_vectStages;
+	QVector<QVector<int>> m_vectLevels;		///< Step indexes, in the order to run
+	int m_iInputType = 0;
+
+	static int ColorCode(int iFromChannels, int iToChannels);
+	static Input PlanInput(const QString& sWhat, int iType, int iDepth, int iChannels);
+	static cv::UMat Convert(const Input& in, const cv::UMat& img);
+	static PipelineData AlignRoi(const PipelineData& aux, const PipelineData& main);
+	void RunStage(int iStage, const PipelineData& input, PipelineData* pOuts, qint64* pNs, const PipelineContext& context) const;
+
+	static const int ms_iFuseStripBytes = 256 * 1024;	///< Roughly a core's share of L2
+	static const int ms_iFuseMinRows = 16;
+	QVector<int> FusableChain(int iHead, const QVector<bool>& vectWanted, const PipelineCache* pCache) const;
+	void RunFused(const QVector<int>& vectChain, const PipelineData& input, PipelineData* pOuts, qint64* pNs, const PipelineContext& context) const;
+	void RunStrip(const QVector<int>& vectChain, const QVector<int>& vectHalo, const PipelineData& dataIn, const cv::UMat& imgOut, const cv::Range& rows,
+		const PipelineContext& context) const;
+	void FinishFused(const QVector<int>& vectChain, const PipelineData& out, qint64 iElapsedNs, PipelineData* pOuts, qint64* pNs) const;
+};
+
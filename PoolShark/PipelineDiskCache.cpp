@@ -0,0 +1,230 @@
+#include "stdafx.h"
+#include "PipelineDiskCache.h"
+#include <Util.h>
+#include <QCryptographicHash>
+#include <QDirIterator>
+#include <QSaveFile>
+#include <algorithm>
+
+
+
+DECLARE_LOG_SRC("PipelineDiskCache", LOGCAT_Common);
+
+#define ENTRY_MAGIC			0x50535233	///< 'PSR3', with the whole overlay and the ROI
+#define ENTRY_SUFFIX		"psr"
+#define TRIM_TO_PERCENT		90			///< Leave some room so we don't trim on every store
+
+
+PipelineDiskCache::PipelineDiskCache(const QString& sDir, qint64 iMaxBytes)
+	: m_sDir(sDir), m_iMaxBytes(iMaxBytes)
+{
+}
+
+QString PipelineDiskCache::Dir() const
+{
+	return m_sDir;
+}
+
+QByteArray PipelineDiskCache::HashInput(const cv::UMat& img)
+{
+	QCryptographicHash hash(QCryptographicHash::Md5);
+	qint32 aiHeader[] = { img.rows, img.cols, img.type() };
+	hash.addData((const char*)aiHeader, sizeof(aiHeader));
+
+	ForEachPixelRow(img.getMat(cv::ACCESS_READ), [&hash](const char* pBytes, qint64 iBytes) {
+		hash.addData(pBytes, iBytes);
+	});
+
+	return hash.result();
+}
+
+QString PipelineDiskCache::Filename(const QByteArray& baKey) const
+{
+	// Spread over subdirectories so no one directory gets huge
+	QString sHex = QString::fromLatin1(baKey.toHex());
+	return QDir(m_sDir).absoluteFilePath(QString("%1/%2.%3").arg(sHex.left(2), sHex, ENTRY_SUFFIX));
+}
+
+void PipelineDiskCache::ScanLocked()
+{
+	if (m_bScanned)
+		return;
+	m_bScanned = true;
+
+	// Whatever earlier sessions left behind. File times stand in for the
+	// last use, Load() touches them.
+	QDirIterator iter(m_sDir, QStringList() << QString("*.%1").arg(ENTRY_SUFFIX), QDir::Files, QDirIterator::Subdirectories);
+	while (iter.hasNext())
+	{
+		iter.next();
+		QFileInfo fi = iter.fileInfo();
+		Entry entry;
+		entry.iBytes = fi.size();
+		entry.iLastUsed = fi.lastModified().toMSecsSinceEpoch();
+		m_hashEntries.insert(QByteArray::fromHex(fi.completeBaseName().toLatin1()), entry);
+		m_iTotalBytes += entry.iBytes;
+	}
+
+	LOGINFO("%d entries, %lld MB in '%s'", m_hashEntries.count(), m_iTotalBytes >> 20, qPrintable(m_sDir));
+	TrimLocked();
+}
+
+void PipelineDiskCache::TrimLocked()
+{
+	if (m_iTotalBytes <= m_iMaxBytes)
+		return;
+
+	QList<QByteArray> listKeys = m_hashEntries.keys();
+	std::sort(listKeys.begin(), listKeys.end(), [this](const QByteArray& ba1, const QByteArray& ba2) {
+		return m_hashEntries.value(ba1).iLastUsed < m_hashEntries.value(ba2).iLastUsed;
+	});
+
+	// Oldest first. Another process may have removed it already, that's fine.
+	qint64 iTargetBytes = m_iMaxBytes / 100 * TRIM_TO_PERCENT;
+	for (const QByteArray& baKey : listKeys)
+	{
+		if (m_iTotalBytes <= iTargetBytes)
+			break;
+		QFile::remove(Filename(baKey));
+		ForgetLocked(baKey);
+	}
+}
+
+void PipelineDiskCache::ForgetLocked(const QByteArray& baKey)
+{
+	auto iter = m_hashEntries.find(baKey);
+	if (iter == m_hashEntries.end())
+		return;
+	m_iTotalBytes -= iter.value().iBytes;
+	m_hashEntries.erase(iter);
+}
+
+bool PipelineDiskCache::Load(const QByteArray& baKey, PipelineData& data)
+{
+	QString sFilename = Filename(baKey);
+	bool bKnown = false;
+	{
+		QMutexLocker lock(&m_mutex);
+		ScanLocked();
+		bKnown = m_hashEntries.contains(baKey);
+	}
+
+	// Another process may have made it since the scan
+	if (!bKnown)
+	{
+		QFileInfo fi(sFilename);
+		if (!fi.isFile())
+			return false;
+
+		Entry entry;
+		entry.iBytes = fi.size();
+		entry.iLastUsed = QDateTime::currentMSecsSinceEpoch();
+		QMutexLocker lock(&m_mutex);
+		if (!m_hashEntries.contains(baKey))
+		{
+			m_hashEntries.insert(baKey, entry);
+			m_iTotalBytes += entry.iBytes;
+			TrimLocked();
+		}
+	}
+
+	QFile file(sFilename);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		// Trimmed by someone else
+		QMutexLocker lock(&m_mutex);
+		ForgetLocked(baKey);
+		return false;
+	}
+
+	QDataStream ds(&file);
+	ds.setVersion(QDataStream::Qt_5_15);
+	quint32 uMagic = 0;
+	qint32 iRows = 0, iCols = 0, iType = 0;
+	ds >> uMagic >> iRows >> iCols >> iType;
+	bool bOk = QDataStream::Ok == ds.status() && ENTRY_MAGIC == uMagic
+		&& iRows >= 0 && iCols >= 0 && iType == CV_MAT_TYPE(iType);
+
+	PipelineData loaded;
+	if (bOk)
+	{
+		qint32 x = 0, y = 0, w = 0, h = 0;
+		ds >> x >> y >> w >> h;
+		loaded.roi = cv::Rect(x, y, w, h);
+		bOk = QDataStream::Ok == ds.status();
+	}
+	if (bOk)
+	{
+		loaded.img.create(iRows, iCols, iType);
+		cv::Mat mat = loaded.img.getMat(cv::ACCESS_WRITE);
+		int iRowBytes = iCols * (int)mat.elemSize();
+		for (int r = 0; bOk && r < iRows; ++r)
+			bOk = iRowBytes == ds.readRawData((char*)mat.ptr(r), iRowBytes);
+	}
+
+	if (bOk)
+		ds >> loaded.overlay;
+	bOk = bOk && QDataStream::Ok == ds.status();
+	file.close();
+
+	QMutexLocker lock(&m_mutex);
+	if (!bOk)
+	{
+		LOGWRN("Dropping damaged entry '%s'", qPrintable(sFilename));
+		QFile::remove(sFilename);
+		ForgetLocked(baKey);
+		return false;
+	}
+
+	// Mark it used, for us and for whoever scans next
+	QDateTime dtNow = QDateTime::currentDateTime();
+	m_hashEntries[baKey].iLastUsed = dtNow.toMSecsSinceEpoch();
+	if (file.open(QIODevice::Append))
+		file.setFileTime(dtNow, QFileDevice::FileModificationTime);
+
+	data.img = loaded.img;
+	data.overlay = loaded.overlay;
+	data.roi = loaded.roi;
+	return true;
+}
+
+void PipelineDiskCache::Store(const QByteArray& baKey, const PipelineData& data)
+{
+	QString sFilename = Filename(baKey);
+	Util::ForcePath(sFilename);
+
+	// Written to a temp file and renamed, so nobody ever reads half an entry
+	QSaveFile file(sFilename);
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		LOGWRN("Could not create '%s'", qPrintable(sFilename));
+		return;
+	}
+
+	QDataStream ds(&file);
+	ds.setVersion(QDataStream::Qt_5_15);
+	ds << (quint32)ENTRY_MAGIC << (qint32)data.img.rows << (qint32)data.img.cols << (qint32)data.img.type();
+	ds << (qint32)data.roi.x << (qint32)data.roi.y << (qint32)data.roi.width << (qint32)data.roi.height;
+	ForEachPixelRow(data.img.getMat(cv::ACCESS_READ), [&ds](const char* pBytes, qint64 iBytes) {
+		ds.writeRawData(pBytes, iBytes);
+	});
+
+	ds << data.overlay;
+
+	if (!file.commit())
+	{
+		LOGWRN("Could not write '%s'", qPrintable(sFilename));
+		return;
+	}
+
+	Entry entry;
+	entry.iBytes = QFileInfo(sFilename).size();
+	entry.iLastUsed = QDateTime::currentMSecsSinceEpoch();
+
+	QMutexLocker lock(&m_mutex);
+	ScanLocked();
+	ForgetLocked(baKey);	// Two workers may have made the same one
+	m_hashEntries.insert(baKey, entry);
+	m_iTotalBytes += entry.iBytes;
+	TrimLocked();
+}
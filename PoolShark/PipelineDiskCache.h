@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QMutex>
+#include <QHash>
+#include "Pipeline.h"
+
+
+/**
+@brief Step outputs kept on disk, across sessions and apps
+
+Content addressed: the key for a step's output is a hash of the input
+image bytes and everything that went into the step, its name, param values
+and inputs, all the way up to the pipeline input. See PipelinePlan for how
+the keys are made. Whoever computed an output, the GUI or the batch runner,
+any later run that would compute the same thing picks it up.
+
+Each entry is a file holding the image and the overlay in a plain binary
+layout. When the files add up to more than the budget, the least recently
+used ones go. Safe to use from several workers at once, and from several
+processes sharing the directory.
+*/
+class PipelineDiskCache
+{
+public:
+	PipelineDiskCache(const QString& sDir, qint64 iMaxBytes);
+
+	QString Dir() const;
+
+	/// Identifies an input image, for PipelinePlan to build the keys from
+	static QByteArray HashInput(const cv::UMat& img);
+
+	bool Load(const QByteArray& baKey, PipelineData& data);		///< False on a miss
+	void Store(const QByteArray& baKey, const PipelineData& data);
+
+private:
+	QString m_sDir;
+	qint64 m_iMaxBytes;
+
+	struct Entry {
+		qint64 iBytes = 0;
+		qint64 iLastUsed = 0;	///< ms since epoch
+	};
+	QMutex m_mutex;		///< Protects everything below
+	bool m_bScanned = false;
+	QHash<QByteArray, Entry> m_hashEntries;
+	qint64 m_iTotalBytes = 0;
+
+	QString Filename(const QByteArray& baKey) const;
+	void ScanLocked();
+	void TrimLocked();
+	void ForgetLocked(const QByteArray& baKey);
+};
@@ -0,0 +1,531 @@
+#include "stdafx.h"
+#include "PipelineExecutor.h"
+#include <QStandardPaths>
+#include <opencv2/imgproc/imgproc.hpp>     // cv::pyrDown()
+
+
+
+DECLARE_LOG_SRC("PipelineExecutor", LOGCAT_Common);
+
+#define DISK_CACHE_MAX_BYTES	(2LL << 30)
+#define INPUT_BUDGET_BYTES		(2LL << 30)
+
+
+PipelineExecutor::PipelineExecutor(QObject* parent)
+	: Task("PipelineExecutor", Task::AutoRethrow, parent)
+{
+	qRegisterMetaType<QList<cv::UMat>>("QList<cv::UMat>");
+	qRegisterMetaType<QList<PipelineData>>("QList<PipelineData>");
+
+	// Queued, so we restart from the GUI thread after the worker is done
+	VERIFY(connect(this, &Task::Completed, this, &PipelineExecutor::OnCompleted, Qt::QueuedConnection));
+
+	// Build the worker pool up front, the threads only exist while a run is going
+	int iWorkers = qMax(1, QThread::idealThreadCount());
+	m_vectWorkers.resize(iWorkers);
+	for (int i = 0; i < iWorkers; ++i)
+	{
+		LambdaTask* pTask = new LambdaTask(QString("PipelineWorker%1").arg(i), Task::NoAutoRethrow, this);
+
+		// Errors are caught in the worker lambda and rethrown from RunTask()
+		pTask->DisableExceptionHandlingAssert();
+		m_vectWorkers[i].pTask = pTask;
+	}
+	m_iMaxThreads.storeRelaxed(iWorkers);
+	m_iFrameBudgetMs.storeRelaxed(0);
+	m_iInputBudget.storeRelaxed(INPUT_BUDGET_BYTES);
+
+	QDir dirCache(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+	m_pDiskCache.reset(new PipelineDiskCache(dirCache.absoluteFilePath("results"), DISK_CACHE_MAX_BYTES));
+}
+
+PipelineExecutor::~PipelineExecutor()
+{
+	StopSync();
+}
+
+void PipelineExecutor::SetInputs(const QList<cv::UMat>& listInputs, bool bLive)
+{
+	QMutexLocker lock(&m_mutex);
+	m_pending.bInputs = true;
+	m_pending.listInputs = listInputs;
+	m_pending.bLive = bLive;
+}
+
+void PipelineExecutor::SetInput(int iImage, const cv::UMat& img)
+{
+	{
+		QMutexLocker lock(&m_mutex);
+		m_pending.mapArrived.insert(iImage, img);
+	}
+
+	// Not worth cancelling anything for, OnCompleted() picks it up
+	if (!IsRunning())
+		Start();
+}
+
+void PipelineExecutor::SetStandIn(int iImage, const cv::UMat& img, double dScale)
+{
+	PipelineData standIn;
+	standIn.img = img;
+	standIn.dScale = dScale;
+	{
+		QMutexLocker lock(&m_mutex);
+		m_pending.mapStandIns.insert(iImage, standIn);
+	}
+
+	if (!IsRunning())
+		Start();
+}
+
+void PipelineExecutor::Submit(const Pipeline& pipeline, bool bPreview)
+{
+	{
+		QMutexLocker lock(&m_mutex);
+		m_pending.bPipeline = true;
+		m_pending.pipeline = pipeline;
+		m_pending.bPreview = bPreview;
+	}
+
+	// Latest wins. Cancel the run in progress, OnCompleted() will
+	// start us again with the new snapshot.
+	if (IsRunning())
+		StopAsync();
+	else
+		Start();
+}
+
+void PipelineExecutor::SetMaxThreads(int iThreads)
+{
+	m_iMaxThreads.storeRelaxed(qBound(1, iThreads, m_vectWorkers.count()));
+}
+
+int PipelineExecutor::MaxThreads() const
+{
+	return m_iMaxThreads.loadRelaxed();
+}
+
+void PipelineExecutor::SetFrameBudgetMs(int iMs)
+{
+	m_iFrameBudgetMs.storeRelaxed(qMax(0, iMs));
+}
+
+int PipelineExecutor::FrameBudgetMs() const
+{
+	return m_iFrameBudgetMs.loadRelaxed();
+}
+
+void PipelineExecutor::SetInputBudget(qint64 iBytes)
+{
+	m_iInputBudget.storeRelaxed(qMax(0LL, iBytes));
+}
+
+qint64 PipelineExecutor::InputBudget() const
+{
+	return m_iInputBudget.loadRelaxed();
+}
+
+int PipelineExecutor::PreviewLevels(int iMaxSide)
+{
+	int iLevels = 0;
+	while ((iMaxSide >> iLevels) > ms_iPreviewMaxSide)
+		++iLevels;
+	return iLevels;
+}
+
+bool PipelineExecutor::IsPending() const
+{
+	return m_pending.bPipeline || !m_pending.mapArrived.isEmpty() || !m_pending.mapStandIns.isEmpty();
+}
+
+void PipelineExecutor::OnCompleted()
+{
+	QMutexLocker lock(&m_mutex);
+	bool bPending = IsPending();
+	lock.unlock();
+
+	// Something was submitted or arrived while we were running
+	if (bPending && !IsRunning())
+		Start();
+}
+
+bool PipelineExecutor::TakePending()
+{
+	QMutexLocker lock(&m_mutex);
+	if (!IsPending())
+		return false;
+
+	// New inputs invalidate all the cached step outputs
+	if (m_pending.bInputs)
+	{
+		m_bLive = m_pending.bLive;
+		m_listInputs.clear();
+		m_listCaches.clear();
+		for (const cv::UMat& img : m_pending.listInputs)
+		{
+			PipelineData input;
+			input.img = img;
+			m_listInputs += input;
+
+			PipelineCache cache;
+			cache.SetDiskCache(m_bLive ? nullptr : m_pDiskCache.get());
+			m_listCaches += cache;
+		}
+		m_listStandIns = QList<PipelineData>(m_listInputs.count());
+		m_listPreviewInputs.clear();
+		m_listPreviewCaches.clear();
+		m_vectShown.fill(false, m_listInputs.count());
+		m_vectStandInShown.fill(false, m_listInputs.count());
+		m_vectNeeded.fill(false, m_listInputs.count());
+		m_vectEvicted.fill(false, m_listInputs.count());
+		m_vectLastUse.fill(0, m_listInputs.count());
+		m_iFrameBytes = 0;
+
+		m_pending.listInputs.clear();
+		m_pending.bInputs = false;
+	}
+
+	// Images that came in since only need running themselves. The preview
+	// scale may change with them, so the previews are redone. One that was
+	// let go for the budget is back as it was, what's been shown for it
+	// still stands.
+	QMapIterator<int, cv::UMat> iter(m_pending.mapArrived);
+	while (iter.hasNext())
+	{
+		iter.next();
+		int i = iter.key();
+		if (i >= m_listInputs.count())
+			continue;	// From before the last SetInputs()
+		m_listInputs[i].img = iter.value();
+		m_listStandIns[i] = PipelineData();
+		m_vectNeeded[i] = false;
+		m_vectLastUse[i] = ++m_uUseClock;
+		m_iFrameBytes = qMax(m_iFrameBytes, InputBytes(i));
+		if (m_vectEvicted.at(i))
+		{
+			m_vectEvicted[i] = false;
+			continue;
+		}
+		m_listCaches[i].Clear();
+		m_vectShown[i] = false;
+		m_listPreviewInputs.clear();
+		m_listPreviewCaches.clear();
+	}
+	m_pending.mapArrived.clear();
+
+	// Stand-ins only matter until the input itself is there
+	QMapIterator<int, PipelineData> iterStandIn(m_pending.mapStandIns);
+	while (iterStandIn.hasNext())
+	{
+		iterStandIn.next();
+		int i = iterStandIn.key();
+		if (i >= m_listInputs.count() || !m_listInputs.at(i).img.empty())
+			continue;
+		m_listStandIns[i] = iterStandIn.value();
+		m_vectShown[i] = false;
+		m_listPreviewInputs.clear();
+		m_listPreviewCaches.clear();
+	}
+	m_pending.mapStandIns.clear();
+
+	// A new snapshot has to be shown on every image again
+	if (m_pending.bPipeline)
+	{
+		m_pipeline = m_pending.pipeline;
+		m_bPreview = m_pending.bPreview;
+		m_pending.pipeline = Pipeline();
+		m_pending.bPipeline = false;
+		m_vectShown.fill(false);
+		m_vectStandInShown.fill(false);
+	}
+
+	EvictInputs();
+	return true;
+}
+
+qint64 PipelineExecutor::InputBytes(int iImage) const
+{
+	const cv::UMat& img = m_listInputs.at(iImage).img;
+	if (!img.empty())
+		return qint64(img.total() * img.elemSize());
+
+	// A stand-in is the same image, scaled down
+	const PipelineData& standIn = m_listStandIns.at(iImage);
+	if (!standIn.img.empty())
+		return qint64(standIn.img.total() * standIn.img.elemSize() / (standIn.dScale * standIn.dScale));
+	return m_iFrameBytes;
+}
+
+void PipelineExecutor::EvictInputs()
+{
+	qint64 iBudget = m_iInputBudget.loadRelaxed();
+	if (0 == iBudget)
+		return;
+
+	qint64 iTotal = 0;
+	for (int i = 0; i < m_listInputs.count(); ++i)
+	{
+		if (!m_listInputs.at(i).img.empty())
+			iTotal += InputBytes(i);
+	}
+
+	while (iTotal > iBudget)
+	{
+		// Least recently used first. Full size runs are about to need the
+		// ones they haven't shown yet, those stay.
+		int iOldest = -1;
+		for (int i = 0; i < m_listInputs.count(); ++i)
+		{
+			if (m_listInputs.at(i).img.empty() || (!m_bPreview && !m_vectShown.at(i)))
+				continue;
+			if (iOldest < 0 || m_vectLastUse.at(i) < m_vectLastUse.at(iOldest))
+				iOldest = i;
+		}
+		if (iOldest < 0)
+			break;	// Everything left is needed, go over for now
+
+		// Keep a reduced copy, so previews and full size runs still have
+		// something to show for it until it's back
+		int iMaxSide = qMax(m_listInputs.at(iOldest).img.rows, m_listInputs.at(iOldest).img.cols);
+		m_listStandIns[iOldest] = Reduce(m_listInputs.at(iOldest), 1.0 / (1 << PreviewLevels(iMaxSide)));
+		iTotal -= InputBytes(iOldest);
+		m_listInputs[iOldest].img = cv::UMat();
+		m_vectEvicted[iOldest] = true;
+
+		// Cropped and passed through outputs are views of the input, they
+		// would keep it alive. The disk cache has them for the next run.
+		m_listCaches[iOldest].Clear();
+		LOGINFO("Input %d let go, %lld MB of inputs kept", iOldest, iTotal >> 20);
+	}
+}
+
+void PipelineExecutor::RequestInputs()
+{
+	// Nobody loads live frames, the next one comes when it's there
+	if (m_bLive)
+		return;
+
+	// What the images still to run hold already, and what's on the way
+	qint64 iRoom = m_iInputBudget.loadRelaxed();
+	bool bInFlight = false;
+	for (int i = 0; i < m_listInputs.count(); ++i)
+	{
+		if (m_vectNeeded.at(i))
+		{
+			iRoom -= InputBytes(i);
+			bInFlight = true;
+		}
+		else if (!m_vectShown.at(i) && !m_listInputs.at(i).img.empty())
+			iRoom -= InputBytes(i);
+	}
+
+	// In the order they'll run, as many as fit. Always at least one, or
+	// a budget smaller than a frame would never get anywhere.
+	bool bUnlimited = 0 == m_iInputBudget.loadRelaxed();
+	for (int i = 0; i < m_listInputs.count(); ++i)
+	{
+		if (m_vectShown.at(i) || m_vectNeeded.at(i) || !m_listInputs.at(i).img.empty())
+			continue;
+		qint64 iBytes = InputBytes(i);
+		if (!bUnlimited && bInFlight && iBytes > iRoom)
+			break;
+		m_vectNeeded[i] = true;
+		emit InputNeeded(i);
+		iRoom -= iBytes;
+		bInFlight = true;
+	}
+}
+
+PipelineData PipelineExecutor::Reduce(const PipelineData& source, double dScale)
+{
+	PipelineData reduced;
+	reduced.img = source.img;
+	reduced.dScale = source.dScale;
+	while (!reduced.img.empty() && reduced.dScale > 1.5 * dScale)
+	{
+		cv::UMat imgDown;
+		cv::pyrDown(reduced.img, imgDown);
+		reduced.img = imgDown;
+		reduced.dScale /= 2;
+	}
+	return reduced;
+}
+
+void PipelineExecutor::BuildPreviewInputs()
+{
+	// Each from the input if it's there, else from its stand-in. Inputs
+	// still loading stay empty, cv::pyrDown() won't take them.
+	QList<const PipelineData*> listSources;
+	for (int i = 0; i < m_listInputs.count(); ++i)
+		listSources += m_listInputs.at(i).img.empty() ? &m_listStandIns.at(i) : &m_listInputs.at(i);
+
+	// Use the same level for all the images so they all get the same
+	// scale. The largest image decides, a stand-in knows how large its is.
+	int iMaxSide = 0;
+	for (const PipelineData* pSource : listSources)
+		iMaxSide = qMax(iMaxSide, qRound(qMax(pSource->img.rows, pSource->img.cols) / pSource->dScale));
+	double dScale = 1.0 / (1 << PreviewLevels(iMaxSide));
+
+	// The decoder only goes down to 1/8, stand-ins can need more
+	for (const PipelineData* pSource : listSources)
+	{
+		m_listPreviewInputs += Reduce(*pSource, dScale);
+		m_listPreviewCaches += PipelineCache();
+	}
+}
+
+void PipelineExecutor::RunTask()
+{
+	if (!TakePending())
+		return;
+
+	// Full size runs show what the previews would for images that only
+	// have a stand-in so far
+	bool bStandIns = false;
+	for (int i = 0; i < m_listInputs.count() && !bStandIns; ++i)
+		bStandIns = m_listInputs.at(i).img.empty() && !m_listStandIns.at(i).img.empty();
+	if ((m_bPreview || bStandIns) && m_listPreviewInputs.count() != m_listInputs.count())
+		BuildPreviewInputs();
+
+	// Time to decode the real things, as many ahead as the budget allows
+	if (!m_bPreview)
+		RequestInputs();
+
+	// Only what isn't showing this snapshot yet and has been loaded
+	QVector<Job> vectJobs;
+	for (int i = 0; i < m_listInputs.count(); ++i)
+	{
+		if (m_vectShown.at(i))
+			continue;
+
+		Job job;
+		job.iImage = i;
+		if (m_bPreview || m_listInputs.at(i).img.empty())
+		{
+			if (!m_bPreview)
+			{
+				if (!bStandIns || m_vectStandInShown.at(i))
+					continue;
+				job.bStandIn = true;
+			}
+			job.pInput = &m_listPreviewInputs.at(i);
+			job.pCache = &m_listPreviewCaches[i];
+		}
+		else
+		{
+			job.pInput = &m_listInputs.at(i);
+			job.pCache = &m_listCaches[i];
+		}
+		if (!job.pInput->img.empty())
+			vectJobs += job;
+	}
+
+	// Compile once for each kind of input, so a pipeline that can't work
+	// fails here instead of halfway through an image
+	m_mapPlans.clear();
+	for (const Job& job : vectJobs)
+	{
+		int iType = job.pInput->img.type();
+		if (!m_mapPlans.contains(iType))
+			m_mapPlans.insert(iType, m_pipeline.Compile(iType));
+	}
+
+	int iThreads = qMin(m_iMaxThreads.loadRelaxed(), vectJobs.count());
+	if (iThreads > 1)
+		RunParallel(iThreads, vectJobs);
+	else
+	{
+		for (const Job& job : vectJobs)
+			ProcessImage(job.iImage, *job.pInput, job.pCache);
+	}
+
+	// Stop requests and errors skip this, but those bring a new snapshot
+	for (const Job& job : vectJobs)
+	{
+		if (job.bStandIn)
+			m_vectStandInShown[job.iImage] = true;
+		else
+			m_vectShown[job.iImage] = true;
+		if (!m_bPreview && !job.bStandIn)
+			m_vectLastUse[job.iImage] = ++m_uUseClock;
+	}
+
+	QMutexLocker lock(&m_mutex);
+	bool bIdle = !IsPending();
+	lock.unlock();
+
+	if (bIdle)
+		emit Idle();
+}
+
+void PipelineExecutor::ProcessImage(int iImage, const PipelineData& input, PipelineCache* pCache)
+{
+	// Bail out between steps if a newer submission shows up, or when the
+	// image can't make its budget
+	PipelineContext context([this]() { CheckAbort(); });
+	context.SetBudgetMs(m_iFrameBudgetMs.loadRelaxed());
+	try
+	{
+		// Plans are immutable, all the workers can share them
+		m_mapPlans.constFind(input.img.type()).value().Process(input, pCache, context);
+	}
+	catch (const PipelineAbandoned&)
+	{
+		emit ImageDropped(iImage);
+		return;
+	}
+	emit ImageProcessed(iImage, pCache->Outputs());
+}
+
+void PipelineExecutor::RunParallel(int iThreads, const QVector<Job>& vectJobs)
+{
+	// Each worker grabs the next unprocessed image until there are none left.
+	// The jobs point at the inputs and caches, so nobody touches the lists.
+	int iCount = vectJobs.count();
+	QAtomicInt iNext(0);
+
+	for (int w = 0; w < iThreads; ++w)
+	{
+		Worker& worker = m_vectWorkers[w];
+		worker.bFailed = false;
+		worker.exError = ExceptionContainer();
+
+		worker.pTask->Start([this, &worker, &iNext, &vectJobs, iCount]() {
+			try
+			{
+				int j;
+				while ((j = iNext.fetchAndAddRelaxed(1)) < iCount)
+				{
+					const Job& job = vectJobs.at(j);
+					ProcessImage(job.iImage, *job.pInput, job.pCache);
+				}
+			}
+			catch (const Task::ExceptionStopReq&)
+			{
+				throw;	// Task handles these
+			}
+			catch (...)
+			{
+				// Keep the others from starting anything new
+				iNext.storeRelaxed(iCount);
+				worker.exError = ExceptionContainer::CurrentException();
+				worker.bFailed = true;
+			}
+		});
+	}
+
+	// The workers watch our stop request through the checkpoint, so
+	// this wait ends promptly when a newer submission comes in.
+	for (int w = 0; w < iThreads; ++w)
+		m_vectWorkers[w].pTask->WaitForFinished();
+
+	for (int w = 0; w < iThreads; ++w)
+	{
+		Worker& worker = m_vectWorkers[w];
+		if (worker.bFailed)
+			worker.exError.Rethrow();
+	}
+
+	// Don't report idle if we were cancelled
+	CheckAbort();
+}
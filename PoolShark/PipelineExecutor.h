@@ -0,0 +1,148 @@
+#pragma once
+
+#include <Task.h>
+#include <LambdaTask.h>
+#include <QMutex>
+#include <memory>
+#include "Pipeline.h"
+#include "PipelineDiskCache.h"
+
+/**
+@brief Runs a pipeline over the input images on a background thread
+
+The GUI submits a snapshot of the pipeline every time a parameter changes.
+Only the latest submission matters, so a newer one cancels the run in
+progress (at the next step boundary) and the executor restarts with it.
+Results are delivered one image at a time through ImageProcessed, as soon
+as each image is done. Each step's output comes with its overlay, for the
+panes to draw at the size they show it.
+
+Images are independent, so they are spread over a small pool of worker
+tasks. SetMaxThreads() caps how many run at once. The per-image caches live
+here, so only the steps from the first dirty one onward are recomputed.
+
+Inputs can arrive one at a time while they load, see SetInput(). Each is
+run with the latest submission as it comes in, without restarting the
+images already done. An input can first come as a cheap reduced size
+decode, see SetStandIn(). Previews run on that, and so do full size runs
+until the real input is there, which they ask for through InputNeeded.
+So the full size decode only happens once something needs it.
+
+The full size inputs are kept within a byte budget, see SetInputBudget().
+Past it, the least recently run ones are let go, down to their stand-in,
+along with their step outputs, and asked for again through InputNeeded
+when a run gets to them. Runs ask for missing inputs in the order they
+will process them, only as many ahead as the budget has room for.
+
+With a frame budget set, an image still running when its budget is up is
+given up on (see PipelineContext) and reported through ImageDropped
+instead, so a live source can skip a late frame rather than fall behind.
+What its finished steps made stays in the cache.
+
+A preview submission runs on a reduced resolution copy of the inputs, for
+responsiveness while the user drags a slider. Previews have their own
+caches, so switching back and forth doesn't throw away full size results.
+
+Full size results also go to a disk cache in the user's cache directory,
+so reopening a session doesn't recompute what hasn't changed.
+*/
+class PipelineExecutor : public Task
+{
+	Q_OBJECT
+public:
+	PipelineExecutor(QObject* parent = nullptr);
+	~PipelineExecutor();
+
+	/// Empty images are inputs still loading, hand them over with
+	/// SetInput() when they are. Live inputs, frames that only ever run
+	/// once, come in by themselves: InputNeeded isn't sent for them, and
+	/// their results aren't worth keeping in the disk cache.
+	void SetInputs(const QList<cv::UMat>& listInputs, bool bLive = false);
+	void SetInput(int iImage, const cv::UMat& img);
+	void SetStandIn(int iImage, const cv::UMat& img, double dScale);	///< Reduced size, for an input still loading
+	void Submit(const Pipeline& pipeline, bool bPreview = false);
+
+	static const int ms_iPreviewMaxSide = 1000;		///< Previews are halved until they fit in this
+	static int PreviewLevels(int iMaxSide);			///< How many halvings that takes
+
+	void SetMaxThreads(int iThreads);	///< Takes effect on the next run
+	int MaxThreads() const;
+
+	void SetFrameBudgetMs(int iMs);		///< Per image, 0 for none. Takes effect on the next image.
+	int FrameBudgetMs() const;
+
+	void SetInputBudget(qint64 iBytes);	///< For the full size inputs kept, 0 for no limit. Takes effect on the next run.
+	qint64 InputBudget() const;
+
+signals:
+	void ImageProcessed(int iImage, QList<PipelineData> listOutputs);
+	void ImageDropped(int iImage);	///< Over the frame budget, no outputs this time
+	void InputNeeded(int iImage);	///< A full size run got to an image that only has a stand-in
+	void Idle();	///< The latest submission has been fully processed
+
+protected:
+	virtual void RunTask() override;
+
+private slots:
+	void OnCompleted();
+
+private:
+	QMutex m_mutex;		///< Protects m_pending
+	struct {
+		bool bPipeline = false;
+		Pipeline pipeline;
+		bool bPreview = false;
+		bool bInputs = false;
+		QList<cv::UMat> listInputs;
+		bool bLive = false;
+		QMap<int, cv::UMat> mapArrived;		///< From SetInput()
+		QMap<int, PipelineData> mapStandIns;	///< From SetStandIn()
+	} m_pending;
+	bool IsPending() const;		///< Call with m_mutex held
+
+	// Only touched by the executor thread
+	Pipeline m_pipeline;
+	QMap<int, PipelinePlan> m_mapPlans;	///< Keyed by input type
+	bool m_bPreview = false;
+	bool m_bLive = false;	///< See SetInputs()
+	QList<PipelineData> m_listInputs;
+	QList<PipelineCache> m_listCaches;
+	QVector<bool> m_vectShown;		///< The image's results for m_pipeline have gone out
+	QList<PipelineData> m_listStandIns;		///< Reduced size, for previews while the input isn't there
+	QVector<bool> m_vectStandInShown;	///< Results on the stand-in have gone out instead
+	QVector<bool> m_vectNeeded;			///< InputNeeded has been emitted and the input hasn't come yet
+	QVector<bool> m_vectEvicted;		///< Let go for the budget, along with its cache
+	QVector<quint64> m_vectLastUse;		///< m_uUseClock when the input last arrived or ran
+	quint64 m_uUseClock = 0;
+	qint64 m_iFrameBytes = 0;			///< Largest full size input seen, for guessing the size of the others
+	QAtomicInteger<qint64> m_iInputBudget;
+	qint64 InputBytes(int iImage) const;	///< Or a guess, when it isn't there
+	void EvictInputs();
+	void RequestInputs();
+	static PipelineData Reduce(const PipelineData& source, double dScale);
+	QList<PipelineData> m_listPreviewInputs;	///< Built when first needed after new inputs
+	QList<PipelineCache> m_listPreviewCaches;
+	std::unique_ptr<PipelineDiskCache> m_pDiskCache;
+	bool TakePending();
+	void BuildPreviewInputs();
+
+	/// Everything a worker needs for itself
+	struct Worker {
+		LambdaTask* pTask = nullptr;
+		bool bFailed = false;
+		ExceptionContainer exError;
+	};
+	QVector<Worker> m_vectWorkers;
+	QAtomicInt m_iMaxThreads;
+	QAtomicInt m_iFrameBudgetMs;
+
+	/// An image to run, on its input or on a preview
+	struct Job {
+		int iImage = 0;
+		const PipelineData* pInput = nullptr;
+		PipelineCache* pCache = nullptr;
+		bool bStandIn = false;		///< A preview run for a full size submission
+	};
+	void RunParallel(int iThreads, const QVector<Job>& vectJobs);
+	void ProcessImage(int iImage, const PipelineData& input, PipelineCache* pCache);
+};
@@ -18,17 +18,15 @@ PipelineFactory PipelineFactory::ms_instance;
 DECLARE_LOG_SRC("PipelineFactory", LOGCAT_Common);
 
 
-void PipelineFactory::Define(const QString& sName, QList<PipelineStepParam> listParams, PipelineStep::FuncOp funcOp)
-{
-	PipelineStep step(sName, listParams, funcOp);
-	ms_instance.m_mapTemplates[sName] = step;
-}
-
-
 PipelineStep PipelineFactory::CreateStep(const QString& sName)
 {
 	Q_ASSERT(ms_instance.m_mapTemplates.contains(sName));
-	return ms_instance.m_mapTemplates.value(sName);
+	PipelineStep ps = ms_instance.m_mapTemplates.value(sName);
+
+	// Otherwise every step of this kind would share the template's stats and buffers
+	ps.ResetStats();
+	ps.ResetBuffers();
+	return ps;
 }
 
 
@@ -45,247 +43,296 @@ PipelineFactory::PipelineFactory()
 void PipelineFactory::Init()
 {
 	{
-		QList<PipelineStepParam> listParams;
-		listParams += PipelineStepParam("Kernel", 5, 1, 500);
-		Define("GaussianBlur", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-			PipelineData out;
-			int iKernel = listParams.at(0).Value().toInt();
-
-			// The kernel must be odd or zero
-			if (iKernel > 0 && iKernel % 2 == 0)
-				--iKernel;
-			else if (iKernel < 0)
-				iKernel = 0;
+		struct Params {
+			int iKernel = 5;
 
+			int Kernel(double dScale) const
+			{
+				// The kernel is in pixels, shrink it along with a preview.
+				// Never down to 0, OpenCV wants a sigma then.
+				int iScaled = qRound(iKernel * dScale);
+				if (iKernel >= 1)
+					iScaled = qMax(1, iScaled);
+
+				// The kernel must be odd or zero
+				if (iScaled > 0 && iScaled % 2 == 0)
+					--iScaled;
+				else if (iScaled < 0)
+					iScaled = 0;
+				return iScaled;
+			}
+		};
+		// Anything in, same out
+		PipelineStepTypes types;
+		Define<Params>("GaussianBlur", {
+				Bind("Kernel", &Params::iKernel, 1, 500) },
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
+			int iKernel = params.Kernel(input.dScale);
 			cv::GaussianBlur(input.img, out.img, cv::Size(iKernel, iKernel), 0.0);
-			return out;
+			}, [](const Params& params, double dScale) {
+			return params.Kernel(dScale) / 2;
 			});
 	}
 
 	{
-		QList<PipelineStepParam> listParams;
-		listParams += PipelineStepParam("Thresh1", 100.0, 0.0, 255.0);
-		listParams += PipelineStepParam("Thresh2", 175.0, 0.0, 255.0);
-		listParams += PipelineStepParam("Aperture", 3, 3, 11);
-		Define("Canny", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-			double dThresh1 = listParams.at(0).Value().toDouble();
-			double dThresh2 = listParams.at(1).Value().toDouble();
-			int iApertureSize = listParams.at(2).Value().toInt();
+		struct Params {
+			double dThresh1 = 100.0;
+			double dThresh2 = 175.0;
+			int iApertureSize = 3;
+		};
+		PipelineStepTypes types;
+		types.iInDepth = CV_8U;
+		types.iOutChannels = 1;
+		Define<Params>("Canny", {
+				Bind("Thresh1", &Params::dThresh1, 0.0, 255.0),
+				Bind("Thresh2", &Params::dThresh2, 0.0, 255.0),
+				Bind("Aperture", &Params::iApertureSize, 3, 11) },
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
+			double dThresh1 = params.dThresh1;
+			int iApertureSize = params.iApertureSize;
 			if (0 == iApertureSize % 2)
 			{
 				LOGINFO("Even aperture size for Canny filter must be odd, bumping up one");
 				++iApertureSize;
 			}
-			if (dThresh1 > dThresh2)
+			if (dThresh1 > params.dThresh2)
 			{
 				LOGINFO("Canny dThresh1 > dThresh2, clamping");
-				dThresh1 = dThresh2;
+				dThresh1 = params.dThresh2;
 			}
 
-			PipelineData out;
-			cv::Canny(input.img, out.img, dThresh1, dThresh2, iApertureSize);
-			return out;
-			});
-	}
-
-	{
-		QList<PipelineStepParam> listParams;
-		listParams += PipelineStepParam("ksize", 1, 1, 11);
-		listParams += PipelineStepParam("scale", 1.0, 0.0, 5.0);
-		listParams += PipelineStepParam("delta", 0.0, 0.0, 255.0);
-		listParams += PipelineStepParam("borderType", QStringList() << "BORDER_CONSTANT=0" << "BORDER_REPLICATE=1" << "BORDER_REFLECT=2" << "BORDER_WRAP=3" << "BORDER_REFLECT_101 (Default) = 4" /*"BORDER_TRANSPARENT = 5"*/ <<  "BORDER_ISOLATED=16");
-		Define("Laplacian", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-			// The input image must be an 8 bit grayscale image
-			//if (input.img.elemSize() != 1)
-			//	EXERR("RRT1", "Laplacian requires a grayscale input. Try using Canny() edge detection first.");
-
-			int ksize = listParams.at(0).Value().toInt();
-			double scale = listParams.at(1).Value().toDouble();
-			double delta = listParams.at(2).Value().toDouble();
-			int borderType = listParams.at(3).Value().toInt();
-
-			// The kernel must be positive and odd
-			if (ksize % 2 == 0)
-				--ksize;
-
-			PipelineData out;
-			cv::Laplacian(input.img, out.img, CV_16S, ksize, scale, delta, borderType);
-			return out;
+			cv::Canny(input.img, out.img, dThresh1, params.dThresh2, iApertureSize);
 			});
 	}
 
 	{
-		QList<PipelineStepParam> listParams;
-		listParams += PipelineStepParam("Mode", QStringList() << "RETR_EXTERNAL=1" << "RETR_LIST=1" << "RETR_CCOMP=2" << "RETR_TREE=3" /* << "RETR_FLOODFILL=4" */);
-		listParams += PipelineStepParam("Method", QStringList() << "CHAIN_APPROX_NONE=1" << "CHAIN_APPROX_SIMPLE=2" << "CHAIN_APPROX_TC89_L1=3" << "CHAIN_APPROX_TC89_KCOS=4");
-		Define("findContours", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-			// The input image must be an 8 bit grayscale image
-			if (input.img.elemSize() != 1)
-				EXERR("RRT2", "findContours requires a grayscale input. Try using Canny() edge detection first.");
-
-			int iMode = listParams.at(0).Value().toInt();
-			int iMethod = listParams.at(1).Value().toInt();
-			PipelineData out;
-			cv::findContours(input.img, out.contours, iMode, iMethod);
-
-			// Draw the contours onto a blank image of the same size
-			out.img = cv::UMat::zeros(input.img.rows, input.img.cols, CV_8UC3);
-			cv::Scalar color(0, 0, 255);	// red
-			cv::drawContours(out.img, out.contours, -1, color);			
-			return out;
+		struct Params {
+			int iX = 0;
+			int iY = 0;
+			int iWidth = 0;
+			int iHeight = 0;
+		};
+		// Cuts the frame down to the part that matters, the table say, as a
+		// view without copying. Everything below only works on that part.
+		// In full size frame pixels, a width or height of 0 goes to the edge.
+		PipelineStepTypes types;
+		types.bCrop = true;
+		Define<Params>("ROI", {
+				Bind("X", &Params::iX, 0, 10000),
+				Bind("Y", &Params::iY, 0, 10000),
+				Bind("Width", &Params::iWidth, 0, 10000),
+				Bind("Height", &Params::iHeight, 0, 10000) },
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
+			cv::Rect rcIn = input.FrameRect();
+			cv::Rect rc(qRound(params.iX * input.dScale), qRound(params.iY * input.dScale),
+				qRound(params.iWidth * input.dScale), qRound(params.iHeight * input.dScale));
+			if (0 == params.iWidth)
+				rc.width = rcIn.br().x - rc.x;
+			if (0 == params.iHeight)
+				rc.height = rcIn.br().y - rc.y;
+			out.roi = rc;
 			});
 	}
 
-
 	{
-		QList<PipelineStepParam> listParams;
-
-		listParams += PipelineStepParam("rho", 1.0, 1.0, 95.0);
-		listParams += PipelineStepParam("theta", CV_PI / 180, 0.001, 2 * CV_PI);
-		listParams += PipelineStepParam("threshold", 150, 0, 255);
-		listParams += PipelineStepParam("srn", 0.0, 0.0, 500.0);
-		listParams += PipelineStepParam("stn", 0.0, 0.0, 500.0);
-		//listParams += PipelineStepParam("min_theta", 0.0, 0.0, 500.0);
-		//listParams += PipelineStepParam("max_theta", CV_PI, 0.01, CV_PI);
-		Define("HoughLines", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-			// The input image must be an 8 bit grayscale image
-			if (input.img.elemSize() != 1)
-				EXERR("RRT3", "HoughLines requires a grayscale input. Try using Canny() edge detection first.");
-
-			int i = 0;	// Param index
-			double 	rho = listParams.at(i++).Value().toDouble();
-			double 	theta = listParams.at(i++).Value().toDouble();
-			int 	threshold = listParams.at(i++).Value().toInt();
-			double 	srn = listParams.at(i++).Value().toDouble();
-			double 	stn = listParams.at(i++).Value().toDouble();
-			//double 	min_theta = listParams.at(i++).Value().toDouble();
-			//double 	max_theta = listParams.at(i++).Value().toDouble();			
-			//if (min_theta > max_theta)
-			//	min_theta = max_theta - 0.01;
+		struct Params {
+			int ksize = 1;
+			double scale = 1.0;
+			double delta = 0.0;
+			int borderType = cv::BORDER_CONSTANT;
 
-			PipelineData out;
-			vector<cv::Vec2f> vectLines;
-			cv::HoughLines(input.img, vectLines, rho, theta, threshold, srn, stn /*, min_theta, max_theta*/);
-
-			// Draw the lines onto a blank image of the same size
-			out.img = cv::UMat::zeros(input.img.rows, input.img.cols, CV_8UC3);
-			cv::Scalar color(0, 0, 255);	// red
-			int iExtent = qMax(input.img.rows, input.img.cols) * qSqrt(2.0f);
-			for (size_t i = 0; i < vectLines.size(); i++)
+			int Ksize() const
 			{
-				float rho = vectLines[i][0];
-				float theta = vectLines[i][1];
-				cv::Point pt1, pt2;
-				double a = cos(theta), b = sin(theta);
-				double x0 = a * rho, y0 = b * rho;
-				pt1.x = cvRound(x0 + iExtent * (-b));
-				pt1.y = cvRound(y0 + iExtent * (a));
-				pt2.x = cvRound(x0 - iExtent * (-b));
-				pt2.y = cvRound(y0 - iExtent * (a));
-				line(out.img, pt1, pt2, color, 3, cv::LINE_AA);
+				// The kernel must be positive and odd
+				return ksize % 2 == 0 ? ksize - 1 : ksize;
 			}
+		};
+		PipelineStepTypes types;
+		types.iOutDepth = CV_16S;
+		Define<Params>("Laplacian", {
+				Bind("ksize", &Params::ksize, 1, 11),
+				Bind("scale", &Params::scale, 0.0, 5.0),
+				Bind("delta", &Params::delta, 0.0, 255.0),
+				BindEnum("borderType", &Params::borderType, QStringList() << "BORDER_CONSTANT=0" << "BORDER_REPLICATE=1" << "BORDER_REFLECT=2" << "BORDER_WRAP=3" << "BORDER_REFLECT_101 (Default) = 4" /*"BORDER_TRANSPARENT = 5"*/ <<  "BORDER_ISOLATED=16") },
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
+			cv::Laplacian(input.img, out.img, CV_16S, params.Ksize(), params.scale, params.delta, params.borderType);
+			}, [](const Params& params, double dScale) {
+			// A wrapped or isolated border needs the whole frame
+			if (cv::BORDER_WRAP == params.borderType || (params.borderType & cv::BORDER_ISOLATED))
+				return -1;
+
+			// ksize 1 is a 3x3 aperture
+			return qMax(1, params.Ksize() / 2);
+			});
+	}
 
-			return out;
+	{
+		struct Params {
+			int iMode = 1;
+			int iMethod = cv::CHAIN_APPROX_NONE;
+		};
+		PipelineStepTypes types;
+		types.iInDepth = CV_8U;
+		types.iInChannels = 1;
+		types.bPassImage = true;
+		Define<Params>("findContours", {
+				BindEnum("Mode", &Params::iMode, QStringList() << "RETR_EXTERNAL=1" << "RETR_LIST=1" << "RETR_CCOMP=2" << "RETR_TREE=3" /* << "RETR_FLOODFILL=4" */),
+				BindEnum("Method", &Params::iMethod, QStringList() << "CHAIN_APPROX_NONE=1" << "CHAIN_APPROX_SIMPLE=2" << "CHAIN_APPROX_TC89_L1=3" << "CHAIN_APPROX_TC89_KCOS=4") },
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
+			cv::findContours(input.img, out.overlay.contours, params.iMode, params.iMethod);
+			context.Check();
+			out.overlay.Offset(input.FrameRect().tl(), &context);
 			});
 	}
 
 
 	{
-		QList<PipelineStepParam> listParams;
-
-		listParams += PipelineStepParam("rho", 1.0, 1.0, 95.0);
-		listParams += PipelineStepParam("theta", CV_PI / 180, 0.001, 2 * CV_PI);
-		listParams += PipelineStepParam("threshold", 80, 0, 255);
-		listParams += PipelineStepParam("srn", 30.0, 0.0, 500.0);
-		listParams += PipelineStepParam("stn", 10.0, 0.0, 500.0);
-		//listParams += PipelineStepParam("min_theta", 0.0, 0.0, 500.0);
-		//listParams += PipelineStepParam("max_theta", CV_PI, 0.01, CV_PI);
-		Define("HoughLinesP", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-			// The input image must be an 8 bit grayscale image
-			if (input.img.elemSize() != 1)
-				EXERR("RRT3", "HoughLinesP requires a grayscale input. Try using Canny() edge detection first.");
-
-			int i = 0;	// Param index
-			double 	rho = listParams.at(i++).Value().toDouble();
-			double 	theta = listParams.at(i++).Value().toDouble();
-			int 	threshold = listParams.at(i++).Value().toInt();
-			double 	srn = listParams.at(i++).Value().toDouble();
-			double 	stn = listParams.at(i++).Value().toDouble();
-			//double 	min_theta = listParams.at(i++).Value().toDouble();
-			//double 	max_theta = listParams.at(i++).Value().toDouble();			
+		struct Params {
+			double rho = 1.0;
+			double theta = CV_PI / 180;
+			int threshold = 150;
+			double srn = 0.0;
+			double stn = 0.0;
+		};
+		PipelineStepTypes types;
+		types.iInDepth = CV_8U;
+		types.iInChannels = 1;
+		types.bPassImage = true;
+		Define<Params>("HoughLines", {
+				Bind("rho", &Params::rho, 1.0, 95.0),
+				Bind("theta", &Params::theta, 0.001, 2 * CV_PI),
+				Bind("threshold", &Params::threshold, 0, 255),
+				Bind("srn", &Params::srn, 0.0, 500.0),
+				Bind("stn", &Params::stn, 0.0, 500.0) },
+				//Bind("min_theta", &Params::min_theta, 0.0, 500.0),
+				//Bind("max_theta", &Params::max_theta, 0.01, CV_PI),
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
 			//if (min_theta > max_theta)
 			//	min_theta = max_theta - 0.01;
 
-			PipelineData out;
-			vector<cv::Vec4i> vectLines;
-			cv::HoughLinesP(input.img, vectLines, rho, theta, threshold, srn, stn /*, min_theta, max_theta*/);
+			// Distance resolution and votes are both in pixels
+			double rho = params.rho * input.dScale;
+			int threshold = qRound(params.threshold * input.dScale);
 
-			// Draw the lines onto a blank image of the same size
-			out.img = cv::UMat::zeros(input.img.rows, input.img.cols, CV_8UC3);
-			cv::Scalar color(0, 0, 255);	// red
-			for (size_t i = 0; i < vectLines.size(); i++)
-			{
-				float rho = vectLines[i][0];
-				float theta = vectLines[i][1];
-				cv::Point pt1, pt2;
-				double a = cos(theta), b = sin(theta);
-				double x0 = a * rho, y0 = b * rho;
-				pt1.x = cvRound(x0 + 1000 * (-b));
-				pt1.y = cvRound(y0 + 1000 * (a));
-				pt2.x = cvRound(x0 - 1000 * (-b));
-				pt2.y = cvRound(y0 - 1000 * (a));
-				line(out.img, pt1, pt2, color, 3, cv::LINE_AA);
-			}
+			cv::HoughLines(input.img, out.overlay.lines, rho, params.theta, threshold, params.srn, params.stn /*, min_theta, max_theta*/);
+			context.Check();
+			out.overlay.Offset(input.FrameRect().tl(), &context);
+			});
+	}
 
-			return out;
+
+	{
+		struct Params {
+			double rho = 1.0;
+			double theta = CV_PI / 180;
+			int threshold = 80;
+			double minLineLength = 30.0;
+			double maxLineGap = 10.0;
+		};
+		PipelineStepTypes types;
+		types.iInDepth = CV_8U;
+		types.iInChannels = 1;
+		types.bPassImage = true;
+
+		// The last two are saved as srn/stn, which is what they were first called
+		Define<Params>("HoughLinesP", {
+				Bind("rho", &Params::rho, 1.0, 95.0),
+				Bind("theta", &Params::theta, 0.001, 2 * CV_PI),
+				Bind("threshold", &Params::threshold, 0, 255),
+				Bind("srn", &Params::minLineLength, 0.0, 500.0),
+				Bind("stn", &Params::maxLineGap, 0.0, 500.0) },
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
+			// Distance resolution, votes, min line length and max gap are all in pixels
+			double rho = params.rho * input.dScale;
+			int threshold = qRound(params.threshold * input.dScale);
+			double minLineLength = params.minLineLength * input.dScale;
+			double maxLineGap = params.maxLineGap * input.dScale;
+
+			cv::HoughLinesP(input.img, out.overlay.segments, rho, params.theta, threshold, minLineLength, maxLineGap);
+			context.Check();
+			out.overlay.Offset(input.FrameRect().tl(), &context);
 			});
 	}
 
 
 	 {
-		QList<PipelineStepParam> listParams;
-
-		listParams += PipelineStepParam("seed_x", 0.5, 0.0, 1.0);
-		listParams += PipelineStepParam("seed_y", 0.5, 0.0, 1.0);
-		listParams += PipelineStepParam("tolerance", 30, 0, 255);
-		listParams += PipelineStepParam("connectivity", QStringList() << "4=4" << "8=8");
-		listParams += PipelineStepParam("flags", QStringList() << QString("Fixed Range=%1").arg(cv::FLOODFILL_FIXED_RANGE) << QString("Mask Only=%1").arg(cv::FLOODFILL_MASK_ONLY));
-		listParams += PipelineStepParam("mask", 1, 0, 255);
-		Define("floodFill", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-
-			int i = 0;	// Param index
-			double 	seed_x = listParams.at(i++).Value().toDouble();
-			double 	seed_y = listParams.at(i++).Value().toDouble();
-			int iTol = listParams.at(i++).Value().toInt();
-			int iConnectivity = listParams.at(i++).Value().toInt();
-			int iFloodFillFlags = listParams.at(i++).Value().toInt();
-			int iMask = listParams.at(i++).Value().toInt();
-
-			PipelineData out = input;
-			out.img = input.img.clone();
+		struct Params {
+			double seed_x = 0.5;
+			double seed_y = 0.5;
+			int iTol = 30;
+			int iConnectivity = 4;
+			int iFloodFillFlags = cv::FLOODFILL_FIXED_RANGE;
+			int iMask = 1;
+		};
+		PipelineStepTypes types;
+		types.iInDepth = CV_8U;
+		types.iInChannels = 3;	// Filled in red
+		Define<Params>("floodFill", {
+				Bind("seed_x", &Params::seed_x, 0.0, 1.0),
+				Bind("seed_y", &Params::seed_y, 0.0, 1.0),
+				Bind("tolerance", &Params::iTol, 0, 255),
+				BindEnum("connectivity", &Params::iConnectivity, QStringList() << "4=4" << "8=8"),
+				BindEnum("flags", &Params::iFloodFillFlags, QStringList() << QString("Fixed Range=%1").arg(cv::FLOODFILL_FIXED_RANGE) << QString("Mask Only=%1").arg(cv::FLOODFILL_MASK_ONLY)),
+				Bind("mask", &Params::iMask, 0, 255) },
+			types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
+			// With a floating range every pixel is compared to its neighbor. A
+			// reduced resolution preview packs the same gradient into fewer
+			// pixels, so open the tolerance up to match. A fixed range compares
+			// against the seed and doesn't care about resolution.
+			int iTol = params.iTol;
+			if (0 == (params.iFloodFillFlags & cv::FLOODFILL_FIXED_RANGE))
+				iTol = qMin(255, qRound(iTol / input.dScale));
+
+			out.overlay = input.overlay;
+			input.img.copyTo(out.img);
 			
 			cv::Rect rcBounds;
 			cv::Scalar diff(iTol, iTol, iTol);
-			int iFlags = iConnectivity | iFloodFillFlags | iMask << 8;
+			int iFlags = params.iConnectivity | params.iFloodFillFlags | params.iMask << 8;
 			int iRet = cv::floodFill(out.img,
-				cv::Point(out.img.cols * seed_x, out.img.rows * seed_y),
+				cv::Point(out.img.cols * params.seed_x, out.img.rows * params.seed_y),
 				cv::Scalar(0, 0, 255),
 				&rcBounds,
 				diff, diff,
 				iFlags);
+			});
+	}
 
-			return out;
+	{
+		struct Params {
+			int iBackground = 0;
+		};
+
+		// Keeps the input where the mask is set. Wire "in" to the color
+		// frame and "mask" to an edge or threshold result.
+		PipelineStepTypes types;
+		PipelineStepPort portMask;
+		portMask.sName = "mask";
+		portMask.iDepth = CV_8U;
+		portMask.iChannels = 1;
+		types.listAuxInputs += portMask;
+		DefineWithAux<Params>("Mask", {
+				Bind("background", &Params::iBackground, 0, 255) },
+			types, [](const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const Params& params, const PipelineContext& context) {
+			const cv::UMat& mask = listAux.first().img;
+			if (mask.size() != input.img.size())
+				EXERR("MSK1", "Mask is %dx%d, image is %dx%d", mask.cols, mask.rows, input.img.cols, input.img.rows);
+
+			out.overlay = input.overlay;
+			out.img.setTo(cv::Scalar::all(params.iBackground));
+			input.img.copyTo(out.img, mask);
 			});
 	}
 
 	/*
 	{
-		QList<PipelineStepParam> listParams;
-		Define("LineSegmentDetector", listParams, [](const PipelineData& input, const QList<PipelineStepParam>& listParams) {
-			// The input image must be an 8 bit grayscale image
-			if (input.img.elemSize() != 1)
-				EXERR("RRT3", "LineSegmentDetector requires a grayscale input. Try using Canny() edge detection first.");
-
+		struct Params {
+		};
+		PipelineStepTypes types;
+		types.iInDepth = CV_8U;
+		types.iInChannels = 1;
+		types.iOutChannels = 3;
+		Define<Params>("LineSegmentDetector", {}, types, [](const PipelineData& input, PipelineData& out, const Params& params, const PipelineContext& context) {
 			cv::Ptr<cv::LineSegmentDetector> det = cv::createLineSegmentDetector();
 
 
@@ -294,12 +341,10 @@ void PipelineFactory::Init()
 			det->detect(input.img, lines);
 
 			// Draw the lines onto a blank image of the same size
-			PipelineData out;
-			out.img = cv::UMat::zeros(input.img.rows, input.img.cols, CV_8UC3);
+			out.img.create(input.img.rows, input.img.cols, CV_8UC3);
+			out.img.setTo(cv::Scalar::all(0));
 
 			det->drawSegments(out.img, lines);
-
-			return out;
 			});
 	}*/
 }
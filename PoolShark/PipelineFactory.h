@@ -1,6 +1,49 @@
 #pragma once
 #include "Pipeline.h"
 #include <functional>
+#include <memory>
+#include <type_traits>
+
+
+/**
+@brief Ties a step parameter to a member of the step's parameter struct
+
+Made with Bind() or BindEnum(). The member pointer fixes both which field
+the value lands in and its type, so there are no indexes to get wrong.
+*/
+template <class TParams>
+struct PipelineParamBinding {
+	PipelineStepParam param;
+	std::function<void(TParams& params, const QVariant& vValue)> funcSet;
+};
+
+/// A number param. The default is whatever the struct initializes the member to.
+template <class TParams, class TValue>
+PipelineParamBinding<TParams> Bind(const QString& sName, TValue TParams::* pMember,
+	typename std::common_type<TValue>::type min,
+	typename std::common_type<TValue>::type max)
+{
+	PipelineParamBinding<TParams> binding;
+	binding.param = PipelineStepParam(sName, TParams().*pMember, min, max);
+	binding.funcSet = [pMember](TParams& params, const QVariant& vValue) {
+		params.*pMember = vValue.value<TValue>();
+	};
+	return binding;
+}
+
+/// An enum param, slEnums as for PipelineStepParam
+template <class TParams>
+PipelineParamBinding<TParams> BindEnum(const QString& sName, int TParams::* pMember, const QStringList& slEnums)
+{
+	PipelineParamBinding<TParams> binding;
+	binding.param = PipelineStepParam(sName, slEnums);
+	binding.param.SetValue(TParams().*pMember);
+	binding.funcSet = [pMember](TParams& params, const QVariant& vValue) {
+		params.*pMember = vValue.toInt();
+	};
+	return binding;
+}
+
 
 /**
 @brief Generate a step object by name
@@ -15,9 +58,86 @@ public:
 
 private:
 	PipelineFactory();
-	static void Define(const QString& sName, QList<PipelineStepParam> listParams, PipelineStep::FuncOp funcOp);
-	
+
+	/// Define a step whose operation gets its params as a TParams struct.
+	/// The struct is decoded from the PipelineStepParam values only when
+	/// one of them changes, not for every frame. Neighbourhood filters give
+	/// funcHalo too, see PipelineStep::Halo(). The context is for giving up
+	/// part way, see PipelineStep::FuncOp.
+	template <class TParams>
+	static void Define(const QString& sName,
+		const QList<PipelineParamBinding<TParams>>& listBindings,
+		const PipelineStepTypes& types,
+		std::function<void(const PipelineData& input, PipelineData& out, const TParams& params,
+			const PipelineContext& context)> funcOp,
+		std::function<int(const TParams& params, double dScale)> funcHalo = nullptr);
+
+	/// Same for a step with types.listAuxInputs, they come in listAux in that order
+	template <class TParams>
+	static void DefineWithAux(const QString& sName,
+		const QList<PipelineParamBinding<TParams>>& listBindings,
+		const PipelineStepTypes& types,
+		std::function<void(const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const TParams& params,
+			const PipelineContext& context)> funcOp,
+		std::function<int(const TParams& params, double dScale)> funcHalo = nullptr);
+
 	QMap<QString, PipelineStep> m_mapTemplates;
 	static PipelineFactory ms_instance;
 };
 
+
+template <class TParams>
+void PipelineFactory::Define(const QString& sName,
+	const QList<PipelineParamBinding<TParams>>& listBindings,
+	const PipelineStepTypes& types,
+	std::function<void(const PipelineData& input, PipelineData& out, const TParams& params,
+		const PipelineContext& context)> funcOp,
+	std::function<int(const TParams& params, double dScale)> funcHalo)
+{
+	Q_ASSERT(types.listAuxInputs.isEmpty());
+	DefineWithAux<TParams>(sName, listBindings, types, [funcOp](const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const TParams& params,
+		const PipelineContext& context) {
+		funcOp(input, out, params, context);
+	}, funcHalo);
+}
+
+template <class TParams>
+void PipelineFactory::DefineWithAux(const QString& sName,
+	const QList<PipelineParamBinding<TParams>>& listBindings,
+	const PipelineStepTypes& types,
+	std::function<void(const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const TParams& params,
+		const PipelineContext& context)> funcOp,
+	std::function<int(const TParams& params, double dScale)> funcHalo)
+{
+	QList<PipelineStepParam> listParams;
+	QList<std::function<void(TParams&, const QVariant&)>> listSetters;
+	for (const PipelineParamBinding<TParams>& binding : listBindings)
+	{
+		listParams += binding.param;
+		listSetters += binding.funcSet;
+	}
+
+	// Params are in the same order as the bindings
+	PipelineStep::FuncDecode funcDecode = [listSetters](const QList<PipelineStepParam>& listParams) {
+		std::shared_ptr<TParams> pParams = std::make_shared<TParams>();
+		for (int i = 0; i < listSetters.count(); ++i)
+			listSetters.at(i)(*pParams, listParams.at(i).Value());
+		return std::shared_ptr<const void>(pParams);
+	};
+
+	PipelineStep::FuncOp funcOpUntyped = [funcOp](const PipelineData& input, const QList<PipelineData>& listAux, PipelineData& out, const void* pParams,
+		const PipelineContext& context) {
+		funcOp(input, listAux, out, *static_cast<const TParams*>(pParams), context);
+	};
+
+	PipelineStep::FuncHalo funcHaloUntyped;
+	if (funcHalo)
+	{
+		funcHaloUntyped = [funcHalo](const void* pParams, double dScale) {
+			return funcHalo(*static_cast<const TParams*>(pParams), dScale);
+		};
+	}
+
+	PipelineStep step(sName, listParams, types, funcDecode, funcOpUntyped, funcHaloUntyped);
+	ms_instance.m_mapTemplates[sName] = step;
+}
@@ -0,0 +1,285 @@
+#include "stdafx.h"
+#include "PipelineGolden.h"
+#include <opencv2/imgproc/imgproc.hpp>
+
+
+
+DECLARE_LOG_SRC("PipelineGolden", LOGCAT_Common);
+
+
+BEGIN_SERMIG_MAP(PipelineGolden, 2, "PipelineGolden")
+	SERMIG_MAP_ENTRY(2)
+	SERMIG_MAP_ENTRY(1)
+END_SERMIG_MAP
+
+void PipelineGolden::SerializeV1(Archive& ar)
+{
+	// Same as V2, but the overlays only had contours. Bring them up to
+	// date, so everything else only knows the current layout.
+	Q_ASSERT(ar.isLoading());
+	SerializeV2(ar);
+
+	for (Image& image : m_listImages)
+	{
+		for (Output& output : image.listOutputs)
+			output.baOverlay = PackOverlay(UnpackContoursV1(output.baOverlay));
+	}
+}
+
+void PipelineGolden::SerializeV2(Archive& ar)
+{
+	if (ar.isStoring())
+	{
+		// Write
+		ar.label("PipelineName") << m_sPipelineName;
+		ar.label("BudgetMs") << m_dBudgetMs;
+		ar.label("ImageCount") << (int)m_listImages.count();
+		for (const Image& image : m_listImages)
+		{
+			ar.label("Image") << image.sImage;
+			ar.label("OutputCount") << (int)image.listOutputs.count();
+			for (const Output& output : image.listOutputs)
+			{
+				ar.label("Step") << output.sStep;
+				ar.label("Rows") << output.iRows;
+				ar.label("Cols") << output.iCols;
+				ar.label("Type") << output.iType;
+				ar.label("Pixels") << output.baPixels;
+				ar.label("Overlay") << output.baOverlay;
+			}
+		}
+		return;
+	}
+
+	// Read
+	m_listImages.clear();
+	m_hashImages.clear();
+	ar.label("PipelineName") >> m_sPipelineName;
+	ar.label("BudgetMs") >> m_dBudgetMs;
+	int iImages;
+	ar.label("ImageCount") >> iImages;
+	while (iImages--)
+	{
+		Image image;
+		ar.label("Image") >> image.sImage;
+		int iOutputs;
+		ar.label("OutputCount") >> iOutputs;
+		while (iOutputs--)
+		{
+			Output output;
+			ar.label("Step") >> output.sStep;
+			ar.label("Rows") >> output.iRows;
+			ar.label("Cols") >> output.iCols;
+			ar.label("Type") >> output.iType;
+			ar.label("Pixels") >> output.baPixels;
+			ar.label("Overlay") >> output.baOverlay;
+			image.listOutputs += output;
+		}
+		Add(image);
+	}
+}
+
+PipelineOverlay PipelineGolden::UnpackContoursV1(const QByteArray& ba)
+{
+	QByteArray baRaw = qUncompress(ba);
+	QDataStream ds(baRaw);
+	ds.setVersion(QDataStream::Qt_5_15);
+	PipelineOverlay overlay;
+	quint32 uCount = 0;
+	ds >> uCount;
+	for (quint32 c = 0; c < uCount && QDataStream::Ok == ds.status(); ++c)
+	{
+		quint32 uPoints = 0;
+		ds >> uPoints;
+		std::vector<cv::Point> contour;
+		for (quint32 p = 0; p < uPoints && QDataStream::Ok == ds.status(); ++p)
+		{
+			qint32 x, y;
+			ds >> x >> y;
+			contour.push_back(cv::Point(x, y));
+		}
+		overlay.contours.push_back(contour);
+	}
+	return overlay;
+}
+
+
+PipelineGolden::PipelineGolden()
+{
+}
+
+QString PipelineGolden::PipelineName() const
+{
+	return m_sPipelineName;
+}
+
+void PipelineGolden::SetPipelineName(const QString& sName)
+{
+	m_sPipelineName = sName;
+}
+
+double PipelineGolden::BudgetMs() const
+{
+	return m_dBudgetMs;
+}
+
+void PipelineGolden::SetBudgetMs(double dBudgetMs)
+{
+	m_dBudgetMs = dBudgetMs;
+}
+
+PipelineGolden::Image PipelineGolden::MakeImage(const QString& sImage, const Pipeline& pipeline, const PipelineCache& cache)
+{
+	Image image;
+	image.sImage = sImage;
+	for (int i = 0; i < cache.Count(); ++i)
+	{
+		const PipelineData& data = cache.Output(i);
+		Output output;
+		output.sStep = pipeline.at(i).Name();
+		output.iRows = data.img.rows;
+		output.iCols = data.img.cols;
+		output.iType = data.img.type();
+
+		QByteArray baPixels;
+		ForEachPixelRow(data.img.getMat(cv::ACCESS_READ), [&baPixels](const char* pBytes, qint64 iBytes) {
+			baPixels.append(pBytes, iBytes);
+		});
+		output.baPixels = qCompress(baPixels);
+		output.baOverlay = PackOverlay(data.overlay);
+		image.listOutputs += output;
+	}
+	return image;
+}
+
+void PipelineGolden::Add(const Image& image)
+{
+	if (m_hashImages.contains(image.sImage))
+	{
+		m_listImages[m_hashImages.value(image.sImage)] = image;
+		return;
+	}
+	m_hashImages.insert(image.sImage, m_listImages.count());
+	m_listImages += image;
+}
+
+const PipelineGolden::Image* PipelineGolden::Find(const QString& sImage) const
+{
+	if (!m_hashImages.contains(sImage))
+		return nullptr;
+	return &m_listImages.at(m_hashImages.value(sImage));
+}
+
+int PipelineGolden::ImageCount() const
+{
+	return m_listImages.count();
+}
+
+QStringList PipelineGolden::Compare(const Image& golden, const Image& actual, const Tolerance& tol)
+{
+	QStringList slDiffs;
+	if (golden.listOutputs.count() != actual.listOutputs.count())
+	{
+		slDiffs += QString("%1 steps, expected %2").arg(actual.listOutputs.count()).arg(golden.listOutputs.count());
+		return slDiffs;
+	}
+
+	for (int i = 0; i < golden.listOutputs.count(); ++i)
+	{
+		const Output& outGolden = golden.listOutputs.at(i);
+		const Output& outActual = actual.listOutputs.at(i);
+		QString sWhere = QString("Step %1 %2").arg(i).arg(outActual.sStep);
+		if (outGolden.sStep != outActual.sStep)
+		{
+			slDiffs += QString("%1: expected %2").arg(sWhere, outGolden.sStep);
+			continue;
+		}
+		if (outGolden.iRows != outActual.iRows || outGolden.iCols != outActual.iCols || outGolden.iType != outActual.iType)
+		{
+			slDiffs += QString("%1: %2x%3 type %4, expected %5x%6 type %7").arg(sWhere)
+				.arg(outActual.iCols).arg(outActual.iRows).arg(outActual.iType)
+				.arg(outGolden.iCols).arg(outGolden.iRows).arg(outGolden.iType);
+			continue;
+		}
+
+		// All channels alike, a pixel is off if any of its channels is
+		cv::Mat matDiff;
+		cv::absdiff(Pixels(outGolden), Pixels(outActual), matDiff);
+		cv::Mat matOff = matDiff.reshape(1) > tol.iLevels;
+		if (!matOff.empty())
+		{
+			double dOffPercent = 100.0 * cv::countNonZero(matOff) / matOff.total();
+			if (dOffPercent > tol.dPixelPercent)
+				slDiffs += QString("%1: %2% of pixels off by more than %3").arg(sWhere).arg(dOffPercent, 0, 'f', 3).arg(tol.iLevels);
+		}
+
+		PipelineOverlay overlayGolden = UnpackOverlay(outGolden.baOverlay);
+		PipelineOverlay overlayActual = UnpackOverlay(outActual.baOverlay);
+		if (overlayGolden.contours.size() != overlayActual.contours.size()
+			|| overlayGolden.lines.size() != overlayActual.lines.size()
+			|| overlayGolden.segments.size() != overlayActual.segments.size()
+			|| overlayGolden.circles.size() != overlayActual.circles.size())
+		{
+			slDiffs += QString("%1: %2 contours, %3 lines, %4 segments, %5 circles, expected %6, %7, %8, %9").arg(sWhere)
+				.arg(overlayActual.contours.size()).arg(overlayActual.lines.size()).arg(overlayActual.segments.size()).arg(overlayActual.circles.size())
+				.arg(overlayGolden.contours.size()).arg(overlayGolden.lines.size()).arg(overlayGolden.segments.size()).arg(overlayGolden.circles.size());
+			continue;
+		}
+
+		auto funcMoved = [&tol](const cv::Rect& rect1, const cv::Rect& rect2) {
+			return qAbs(rect1.x - rect2.x) > tol.iShapePixels || qAbs(rect1.y - rect2.y) > tol.iShapePixels
+				|| qAbs(rect1.br().x - rect2.br().x) > tol.iShapePixels || qAbs(rect1.br().y - rect2.br().y) > tol.iShapePixels;
+		};
+		for (size_t c = 0; c < overlayGolden.contours.size(); ++c)
+		{
+			if (funcMoved(cv::boundingRect(overlayGolden.contours.at(c)), cv::boundingRect(overlayActual.contours.at(c))))
+			{
+				slDiffs += QString("%1: contour %2 moved").arg(sWhere).arg(c);
+				break;
+			}
+		}
+		for (size_t s = 0; s < overlayGolden.segments.size(); ++s)
+		{
+			const cv::Vec4i& segGolden = overlayGolden.segments.at(s);
+			const cv::Vec4i& segActual = overlayActual.segments.at(s);
+			if (funcMoved(cv::Rect(cv::Point(segGolden[0], segGolden[1]), cv::Point(segGolden[2], segGolden[3])),
+				cv::Rect(cv::Point(segActual[0], segActual[1]), cv::Point(segActual[2], segActual[3]))))
+			{
+				slDiffs += QString("%1: segment %2 moved").arg(sWhere).arg(s);
+				break;
+			}
+		}
+	}
+	return slDiffs;
+}
+
+QByteArray PipelineGolden::PackOverlay(const PipelineOverlay& overlay)
+{
+	QByteArray ba;
+	QDataStream ds(&ba, QIODevice::WriteOnly);
+	ds.setVersion(QDataStream::Qt_5_15);
+	ds << overlay;
+	return qCompress(ba);
+}
+
+PipelineOverlay PipelineGolden::UnpackOverlay(const QByteArray& ba)
+{
+	QByteArray baRaw = qUncompress(ba);
+	QDataStream ds(baRaw);
+	ds.setVersion(QDataStream::Qt_5_15);
+	PipelineOverlay overlay;
+	ds >> overlay;
+	if (QDataStream::Ok != ds.status())
+		EXERR("GLD2", "Damaged golden overlay");
+	return overlay;
+}
+
+cv::Mat PipelineGolden::Pixels(const Output& output)
+{
+	QByteArray baPixels = qUncompress(output.baPixels);
+	cv::Mat mat(output.iRows, output.iCols, output.iType);
+	if ((size_t)baPixels.size() != mat.total() * mat.elemSize())
+		EXERR("GLD1", "Damaged golden output for %s", qPrintable(output.sStep));
+	memcpy(mat.data, baPixels.constData(), baPixels.size());
+	return mat;
+}
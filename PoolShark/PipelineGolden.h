@@ -0,0 +1,76 @@
+#pragma once
+
+#include <SerMig.h>
+#include <QHash>
+#include "Pipeline.h"
+
+
+/**
+@brief Known good outputs of a pipeline, to check changes against
+
+Holds the output of every step for every image it was recorded on, and a
+time budget for the pipeline. Stored as a binary archive, pixels and
+overlays as compressed blobs, so even large sets load quickly.
+
+Outputs are compared with a tolerance: a pixel may be off by a few levels
+and a small share of pixels may be off by more, overlay shapes must match
+in number and contours and segments roughly in place. Optimizations that change rounding pass,
+anything that changes what a step finds does not.
+*/
+class PipelineGolden : public SerMig
+{
+public:
+	DECLARE_SERMIG;
+
+	struct Tolerance {
+		int iLevels = 2;				///< How far off a pixel may be
+		double dPixelPercent = 0.1;		///< Share of pixels that may be further off
+		int iShapePixels = 2;			///< How far contours and segments may move
+	};
+
+	struct Output {
+		QString sStep;
+		qint32 iRows = 0;
+		qint32 iCols = 0;
+		qint32 iType = 0;
+		QByteArray baPixels;	///< qCompress()ed, rows packed
+		QByteArray baOverlay;	///< qCompress()ed, see PackOverlay()
+	};
+	struct Image {
+		QString sImage;
+		QList<Output> listOutputs;	///< One per step
+	};
+
+	PipelineGolden();
+
+	QString PipelineName() const;
+	void SetPipelineName(const QString& sName);
+	double BudgetMs() const;			///< Mean pipeline time per image, 0 for none
+	void SetBudgetMs(double dBudgetMs);
+
+	/// What the steps gave, ready to Add() or Compare(). Safe to call from
+	/// any number of workers.
+	static Image MakeImage(const QString& sImage, const Pipeline& pipeline, const PipelineCache& cache);
+
+	void Add(const Image& image);
+	const Image* Find(const QString& sImage) const;		///< Null if it was not recorded
+	int ImageCount() const;
+
+	/// What differs, empty if nothing does
+	static QStringList Compare(const Image& golden, const Image& actual, const Tolerance& tol);
+
+private:
+	QString m_sPipelineName;
+	double m_dBudgetMs = 0.0;
+	QList<Image> m_listImages;
+	QHash<QString, int> m_hashImages;	///< Image name to index
+
+	static QByteArray PackOverlay(const PipelineOverlay& overlay);
+	static PipelineOverlay UnpackOverlay(const QByteArray& ba);
+	static PipelineOverlay UnpackContoursV1(const QByteArray& ba);	///< What V1 files hold
+	static cv::Mat Pixels(const Output& output);
+
+	void SerializeV2(Archive& ar);
+	void SerializeV1(Archive& ar);
+};
+SERMIG_ARCHIVERS(PipelineGolden)
@@ -0,0 +1,221 @@
+#include "stdafx.h"
+#include "PipelinePolicy.h"
+#include <Exception.h>
+#include <opencv2/core/ocl.hpp>
+#include <algorithm>
+
+
+
+DECLARE_LOG_SRC("PipelinePolicy", LOGCAT_Common);
+
+
+BEGIN_SERMIG_MAP(PipelinePolicy, 2, "PipelinePolicy")
+	SERMIG_MAP_ENTRY(2)
+	SERMIG_MAP_ENTRY(1)
+END_SERMIG_MAP
+
+void PipelinePolicy::SerializeV1(Archive& ar)
+{
+	// Same as V2, but the keys didn't have the params. What was learned
+	// for one step could be wrong for the next of the same kind, so it's
+	// all calibrated again.
+	Q_ASSERT(ar.isLoading());
+	SerializeV2(ar);
+
+	QMutexLocker lock(&m_mutex);
+	if (!m_mapChoices.isEmpty())
+		LOGINFO("Dropping %d choices calibrated without the step params", m_mapChoices.count());
+	m_mapChoices.clear();
+}
+
+void PipelinePolicy::SerializeV2(Archive& ar)
+{
+	// Only what calibration learned, the switches are for the session
+	QMutexLocker lock(&m_mutex);
+	if (ar.isStoring())
+	{
+		// Write
+		ar.label("ChoiceCount") << (int)m_mapChoices.count();
+		QMapIterator<QString, Device> iter(m_mapChoices);
+		while (iter.hasNext())
+		{
+			iter.next();
+			ar.label("Key") << iter.key();
+			ar.label("Device") << (int)iter.value();
+		}
+		return;
+	}
+
+	// Read
+	m_mapChoices.clear();
+	m_mapTimings.clear();
+	int iCount;
+	ar.label("ChoiceCount") >> iCount;
+	while (iCount--)
+	{
+		QString sKey;
+		int iDevice;
+		ar.label("Key") >> sKey;
+		ar.label("Device") >> iDevice;
+		if (DEV_CPU == iDevice || DEV_OpenCL == iDevice)
+			m_mapChoices.insert(sKey, (Device)iDevice);
+	}
+}
+
+
+QString PipelinePolicy::DeviceName(int iDevice)
+{
+	switch (iDevice)
+	{
+	case DEV_CPU:
+		return "cpu";
+	case DEV_OpenCL:
+		return "opencl";
+	default:
+		return "auto";
+	}
+}
+
+PipelinePolicy::Device PipelinePolicy::ParseDevice(const QString& sDevice)
+{
+	for (Device device : { DEV_Auto, DEV_CPU, DEV_OpenCL })
+	{
+		if (0 == sDevice.compare(DeviceName(device), Qt::CaseInsensitive))
+			return device;
+	}
+	EXERR("POL1", "Bad device '%s', expected auto, cpu or opencl", qPrintable(sDevice));
+	return DEV_Auto;
+}
+
+PipelinePolicy& PipelinePolicy::Instance()
+{
+	static PipelinePolicy s_policy;
+	return s_policy;
+}
+
+PipelinePolicy::PipelinePolicy()
+{
+	// Start out the way OpenCV would have it
+	m_bOpenCL.storeRelaxed(cv::ocl::useOpenCL());
+	m_bCalibrating.storeRelaxed(false);
+}
+
+void PipelinePolicy::SetOpenCL(bool bOn)
+{
+	m_bOpenCL.storeRelaxed(bOn);
+	cv::ocl::setUseOpenCL(bOn);
+}
+
+bool PipelinePolicy::OpenCL() const
+{
+	return m_bOpenCL.loadRelaxed() && cv::ocl::haveOpenCL();
+}
+
+void PipelinePolicy::SetCalibrating(bool bCalibrating)
+{
+	m_bCalibrating.storeRelaxed(bCalibrating);
+}
+
+bool PipelinePolicy::Calibrating() const
+{
+	return m_bCalibrating.loadRelaxed();
+}
+
+QString PipelinePolicy::Key(const PipelineStep& ps, const cv::Size& size, int iType)
+{
+	// A blur with a kernel of 3 and one of 31 are hardly the same step
+	QStringList slParams;
+	for (const PipelineStepParam& psp : ps.Params())
+		slParams += QString("%1=%2").arg(psp.Name(), psp.Value().toString());
+	return QString("%1(%2) %3x%4 type %5").arg(ps.Name(), slParams.join(';')).arg(size.width).arg(size.height).arg(iType);
+}
+
+qint64 PipelinePolicy::Median(QVector<qint64> vectNs)
+{
+	if (vectNs.isEmpty())
+		return 0;
+	std::sort(vectNs.begin(), vectNs.end());
+	return vectNs.at(vectNs.count() / 2);
+}
+
+PipelinePolicy::Device PipelinePolicy::Pick(const PipelineStep& ps, const cv::Size& size, int iType) const
+{
+	if (!OpenCL())
+		return DEV_CPU;
+	if (DEV_Auto != ps.Device())
+		return (Device)ps.Device();
+
+	QString sKey = Key(ps, size, iType);
+	QMutexLocker lock(&m_mutex);
+	QMap<QString, Device>::const_iterator iter = m_mapChoices.constFind(sKey);
+	if (iter != m_mapChoices.constEnd())
+		return iter.value();
+
+	// Take turns, whichever is behind goes next
+	if (Calibrating())
+	{
+		const Timing& timing = m_mapTimings.value(sKey);
+		return timing.vectCpuNs.count() <= timing.vectOpenCLNs.count() ? DEV_CPU : DEV_OpenCL;
+	}
+	return DEV_OpenCL;
+}
+
+void PipelinePolicy::Record(const PipelineStep& ps, const cv::Size& size, int iType, Device device, qint64 iElapsedNs)
+{
+	if (!Calibrating() || !OpenCL() || DEV_Auto != ps.Device())
+		return;
+
+	QString sKey = Key(ps, size, iType);
+	QMutexLocker lock(&m_mutex);
+	if (m_mapChoices.contains(sKey))
+		return;
+
+	Timing& timing = m_mapTimings[sKey];
+	(DEV_CPU == device ? timing.vectCpuNs : timing.vectOpenCLNs) += iElapsedNs;
+	if (timing.vectCpuNs.count() <= ms_iCalibrationRuns || timing.vectOpenCLNs.count() <= ms_iCalibrationRuns)
+		return;
+
+	// The first run on each pays for setup (kernel builds, first upload)
+	qint64 iCpuNs = Median(timing.vectCpuNs.mid(1));
+	qint64 iOpenCLNs = Median(timing.vectOpenCLNs.mid(1));
+	Device best = iCpuNs <= iOpenCLNs ? DEV_CPU : DEV_OpenCL;
+	m_mapChoices.insert(sKey, best);
+	m_mapTimings.remove(sKey);
+	LOGINFO("%s: cpu %.2f ms, opencl %.2f ms, using %s", qPrintable(sKey), iCpuNs / 1e6, iOpenCLNs / 1e6, qPrintable(DeviceName(best)));
+}
+
+QStringList PipelinePolicy::Choices() const
+{
+	QMutexLocker lock(&m_mutex);
+	QStringList sl;
+	QMapIterator<QString, Device> iter(m_mapChoices);
+	while (iter.hasNext())
+	{
+		iter.next();
+		sl += QString("%1: %2").arg(iter.key(), DeviceName(iter.value()));
+	}
+	return sl;
+}
+
+void PipelinePolicy::Clear()
+{
+	QMutexLocker lock(&m_mutex);
+	m_mapChoices.clear();
+	m_mapTimings.clear();
+}
+
+
+/*************************************************************/
+
+ScopedOpenCL::ScopedOpenCL(bool bOn)
+{
+	m_bWasOn = cv::ocl::useOpenCL();
+	if (bOn != m_bWasOn)
+		cv::ocl::setUseOpenCL(bOn);
+}
+
+ScopedOpenCL::~ScopedOpenCL()
+{
+	if (cv::ocl::useOpenCL() != m_bWasOn)
+		cv::ocl::setUseOpenCL(m_bWasOn);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <SerMig.h>
+#include <QMap>
+#include <QMutex>
+#include "Pipeline.h"
+
+
+/**
+@brief Where steps run, on the CPU or through OpenCL
+
+Everything is a cv::UMat, so OpenCV's transparent API runs a step through
+OpenCL whenever OpenCL is on for the thread running it. That only pays
+when the device saves more than the upload and download cost, which on a
+CPU only server it never does.
+
+OpenCL can be switched off for everything with SetOpenCL(). Otherwise
+each step goes where PipelineStep::Device() pins it. Steps left on
+DEV_Auto go wherever calibration found them faster for their params and
+frame size, and through OpenCL until it has. While calibrating, auto steps
+take turns on the two until each has ms_iCalibrationRuns timed runs on
+both, then the faster one sticks. What was learned can be saved and loaded.
+
+OpenCV keeps the OpenCL switch per thread, so the plan switches it around
+every step it runs, see ScopedOpenCL.
+*/
+class PipelinePolicy : public SerMig
+{
+public:
+	DECLARE_SERMIG;
+
+	enum Device {
+		DEV_Auto = 0,
+		DEV_CPU = 1,
+		DEV_OpenCL = 2,
+	};
+	static QString DeviceName(int iDevice);
+	static Device ParseDevice(const QString& sDevice);	///< "auto", "cpu" or "opencl", throws for anything else
+
+	static PipelinePolicy& Instance();
+
+	PipelinePolicy();
+
+	void SetOpenCL(bool bOn);
+	bool OpenCL() const;		///< Switched on and there is a device
+
+	void SetCalibrating(bool bCalibrating);
+	bool Calibrating() const;
+
+	/// DEV_CPU or DEV_OpenCL, for running the step on a main input of this
+	/// size and type. Safe to call from any number of workers.
+	Device Pick(const PipelineStep& ps, const cv::Size& size, int iType) const;
+
+	/// A run of the step on the device Pick() gave, for calibration
+	void Record(const PipelineStep& ps, const cv::Size& size, int iType, Device device, qint64 iElapsedNs);
+
+	QStringList Choices() const;	///< One line per step, params and size calibrated
+	void Clear();
+
+private:
+	static const int ms_iCalibrationRuns = 5;	///< Per device, after a warm up run
+
+	struct Timing {
+		QVector<qint64> vectCpuNs;
+		QVector<qint64> vectOpenCLNs;
+	};
+
+	QAtomicInt m_bOpenCL;
+	QAtomicInt m_bCalibrating;
+	mutable QMutex m_mutex;
+	QMap<QString, Device> m_mapChoices;		///< By Key(), what calibration found faster
+	QMap<QString, Timing> m_mapTimings;		///< By Key(), calibrations under way
+
+	static QString Key(const PipelineStep& ps, const cv::Size& size, int iType);
+	static qint64 Median(QVector<qint64> vectNs);
+
+	void SerializeV2(Archive& ar);
+	void SerializeV1(Archive& ar);
+};
+SERMIG_ARCHIVERS(PipelinePolicy)
+
+
+/**
+@brief Switches OpenCL on or off for the current thread, and back when it goes
+*/
+class ScopedOpenCL
+{
+public:
+	explicit ScopedOpenCL(bool bOn);
+	~ScopedOpenCL();
+
+private:
+	bool m_bWasOn;
+};
@@ -0,0 +1,176 @@
+#include "stdafx.h"
+#include "PipelineSession.h"
+#include "Pipeline.h"
+#include <Exception.h>
+#include <QDataStream>
+
+
+
+DECLARE_LOG_SRC("PipelineSession", LOGCAT_Common);
+
+#define SESSION_MAGIC		0x50535331	///< 'PSS1'
+#define FRAME_ALIGN			64			///< Frames start on a cache line, and so does the first one
+
+/// At the start of the file, the rest of the first FRAME_ALIGN bytes is zeros
+struct SessionHeader {
+	quint32 uMagic;
+	quint32 uFrames;
+	qint64 iIndexOffset;
+};
+
+
+PipelineSession::PipelineSession()
+{
+}
+
+PipelineSession::~PipelineSession()
+{
+	Close();
+}
+
+void PipelineSession::Open(const QString& sFilename)
+{
+	Close();
+
+	m_file.setFileName(sFilename);
+	if (!m_file.open(QIODevice::ReadOnly))
+		EXERR("PSS1", "Could not open session '%s'", qPrintable(sFilename));
+	m_iSize = m_file.size();
+	if (m_iSize >= FRAME_ALIGN)
+		m_pData = m_file.map(0, m_iSize);
+	if (!m_pData)
+	{
+		Close();
+		EXERR("PSS1", "Could not map session '%s'", qPrintable(sFilename));
+	}
+
+	SessionHeader header;
+	memcpy(&header, m_pData, sizeof(header));
+	bool bOk = SESSION_MAGIC == header.uMagic
+		&& header.iIndexOffset >= FRAME_ALIGN && header.iIndexOffset <= m_iSize;
+
+	// The index is small, read it once. The frames stay where they are.
+	if (bOk)
+	{
+		QByteArray baIndex = QByteArray::fromRawData((const char*)m_pData + header.iIndexOffset, int(m_iSize - header.iIndexOffset));
+		QDataStream ds(baIndex);
+		ds.setVersion(QDataStream::Qt_5_15);
+		quint32 uFrames = 0;
+		ds >> uFrames;
+		bOk = QDataStream::Ok == ds.status() && uFrames == header.uFrames;
+		for (quint32 f = 0; bOk && f < uFrames; ++f)
+		{
+			Entry entry;
+			ds >> entry.iOffset >> entry.iTimestampMs >> entry.iRows >> entry.iCols >> entry.iType >> entry.sName;
+
+			// Nothing may point outside the frame data
+			bOk = QDataStream::Ok == ds.status() && entry.iRows >= 0 && entry.iCols >= 0
+				&& entry.iType == CV_MAT_TYPE(entry.iType) && entry.iOffset >= FRAME_ALIGN
+				&& entry.iOffset + qint64(entry.iRows) * entry.iCols * CV_ELEM_SIZE(entry.iType) <= header.iIndexOffset;
+			m_vectEntries += entry;
+		}
+	}
+	if (!bOk)
+	{
+		Close();
+		EXERR("PSS2", "'%s' is not a session or is damaged", qPrintable(sFilename));
+	}
+
+	LOGINFO("%d frames, %lld MB in '%s'", m_vectEntries.count(), m_iSize >> 20, qPrintable(sFilename));
+}
+
+void PipelineSession::Close()
+{
+	if (m_pData)
+		m_file.unmap(m_pData);
+	m_pData = nullptr;
+	m_iSize = 0;
+	m_file.close();
+	m_vectEntries.clear();
+}
+
+bool PipelineSession::IsOpen() const
+{
+	return nullptr != m_pData;
+}
+
+QString PipelineSession::Filename() const
+{
+	return m_file.fileName();
+}
+
+int PipelineSession::FrameCount() const
+{
+	return m_vectEntries.count();
+}
+
+cv::Mat PipelineSession::Frame(int iFrame) const
+{
+	const Entry& entry = m_vectEntries.at(iFrame);
+	return cv::Mat(entry.iRows, entry.iCols, entry.iType, m_pData + entry.iOffset);
+}
+
+QString PipelineSession::FrameName(int iFrame) const
+{
+	return m_vectEntries.at(iFrame).sName;
+}
+
+qint64 PipelineSession::FrameTimestampMs(int iFrame) const
+{
+	return m_vectEntries.at(iFrame).iTimestampMs;
+}
+
+PipelineSession::Writer::Writer(const QString& sFilename)
+	: m_file(sFilename)
+{
+	if (!m_file.open(QIODevice::WriteOnly))
+		EXERR("PSS3", "Could not write session '%s'", qPrintable(sFilename));
+
+	// The header goes in for real once the index is written
+	QByteArray baHeader(FRAME_ALIGN, 0);
+	WriteOrThrow(baHeader.constData(), baHeader.size());
+}
+
+void PipelineSession::Writer::WriteOrThrow(const char* pData, qint64 iBytes)
+{
+	if (iBytes != m_file.write(pData, iBytes))
+		EXERR("PSS3", "Could not write session '%s': %s", qPrintable(m_file.fileName()), qPrintable(m_file.errorString()));
+}
+
+void PipelineSession::Writer::Append(const QString& sName, const cv::Mat& img, qint64 iTimestampMs)
+{
+	qint64 iPad = (FRAME_ALIGN - m_file.pos() % FRAME_ALIGN) % FRAME_ALIGN;
+	QByteArray baPad(int(iPad), 0);
+	WriteOrThrow(baPad.constData(), baPad.size());
+
+	Entry entry;
+	entry.iOffset = m_file.pos();
+	entry.iTimestampMs = iTimestampMs;
+	entry.iRows = img.rows;
+	entry.iCols = img.cols;
+	entry.iType = img.type();
+	entry.sName = sName;
+	m_vectEntries += entry;
+
+	ForEachPixelRow(img, [this](const char* pBytes, qint64 iBytes) { WriteOrThrow(pBytes, iBytes); });
+}
+
+void PipelineSession::Writer::Commit()
+{
+	SessionHeader header;
+	header.uMagic = SESSION_MAGIC;
+	header.uFrames = m_vectEntries.count();
+	header.iIndexOffset = m_file.pos();
+
+	QDataStream ds(&m_file);
+	ds.setVersion(QDataStream::Qt_5_15);
+	ds << header.uFrames;
+	for (const Entry& entry : m_vectEntries)
+		ds << entry.iOffset << entry.iTimestampMs << entry.iRows << entry.iCols << entry.iType << entry.sName;
+	if (QDataStream::Ok != ds.status() || !m_file.seek(0))
+		EXERR("PSS3", "Could not write session '%s': %s", qPrintable(m_file.fileName()), qPrintable(m_file.errorString()));
+	WriteOrThrow((const char*)&header, sizeof(header));
+
+	if (!m_file.commit())
+		EXERR("PSS3", "Could not write session '%s': %s", qPrintable(m_file.fileName()), qPrintable(m_file.errorString()));
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QFile>
+#include <QSaveFile>
+#include <QVector>
+#include <opencv2/core/core.hpp>
+
+
+/**
+@brief Recorded frames in one file, ready to run without decoding
+
+A session is a sequence of frames, say everything a camera took of one
+table, converted once from their image files. Each frame is stored raw,
+rows packed, 64 byte aligned, so reading one is just a matter of mapping
+the file: Frame() is a cv::Mat looking straight into the mapping, no copy
+and no decode. Reprocessing a session then costs what the pipeline does
+plus reading the pages the OS hasn't kept around.
+
+The frames are followed by an index with their size and type, the name
+they were converted from and when they were taken. Everything is in the
+byte order of the machine that wrote it, x86 so far.
+
+The views are read only and only good while the session is open. Clone
+one to keep it past that or to write into it.
+*/
+class PipelineSession
+{
+	Q_DISABLE_COPY(PipelineSession)
+public:
+	PipelineSession();
+	~PipelineSession();
+
+	void Open(const QString& sFilename);	///< Throws if it isn't a readable session
+	void Close();
+	bool IsOpen() const;
+	QString Filename() const;
+
+	int FrameCount() const;
+	cv::Mat Frame(int iFrame) const;		///< A view into the file, see above
+	QString FrameName(int iFrame) const;	///< What it was converted from, without extension
+	qint64 FrameTimestampMs(int iFrame) const;	///< ms since epoch
+
+private:
+	/// A frame in the index
+	struct Entry {
+		qint64 iOffset = 0;		///< From the start of the file
+		qint64 iTimestampMs = 0;
+		qint32 iRows = 0;
+		qint32 iCols = 0;
+		qint32 iType = 0;
+		QString sName;
+	};
+
+public:
+	/// Builds a session file frame by frame. Nothing shows up under the
+	/// filename until Commit().
+	class Writer
+	{
+		Q_DISABLE_COPY(Writer)
+	public:
+		Writer(const QString& sFilename);
+
+		void Append(const QString& sName, const cv::Mat& img, qint64 iTimestampMs);
+		void Commit();
+
+	private:
+		QSaveFile m_file;
+		QVector<Entry> m_vectEntries;
+		void WriteOrThrow(const char* pData, qint64 iBytes);
+	};
+
+private:
+	QFile m_file;
+	uchar* m_pData = nullptr;	///< The whole file, mapped
+	qint64 m_iSize = 0;
+	QVector<Entry> m_vectEntries;
+};
@@ -0,0 +1,277 @@
+#include "stdafx.h"
+#include "PipelineSweep.h"
+#include "WorkerPool.h"
+#include <QRandomGenerator>
+#include <algorithm>
+
+
+
+DECLARE_LOG_SRC("PipelineSweep", LOGCAT_Common);
+
+
+PipelineSweep::PipelineSweep(const Pipeline& pipeline, const Objective& objective)
+	: m_pipeline(pipeline), m_objective(objective)
+{
+}
+
+PipelineSweep::Objective PipelineSweep::ParseObjective(const QString& sSpec)
+{
+	QStringList sl = sSpec.split(':');
+	bool bOk = false;
+	double dTarget = 2 == sl.count() ? sl.last().toDouble(&bOk) : 0.0;
+
+	if (bOk && "count" == sl.first())
+	{
+		return [dTarget](const PipelineData& out) {
+			return -qAbs((double)out.overlay.Count() - dTarget);
+		};
+	}
+
+	if (bOk && "nonzero" == sl.first())
+	{
+		return [dTarget](const PipelineData& out) {
+			// All channels together, good enough for edge and mask images
+			cv::Mat mat = out.img.getMat(cv::ACCESS_READ).reshape(1);
+			double dFraction = mat.total() > 0 ? cv::countNonZero(mat) / (double)mat.total() : 0.0;
+			return -qAbs(dFraction - dTarget);
+		};
+	}
+
+	EXERR("SWP1", "Bad objective '%s', expected count:N or nonzero:F", qPrintable(sSpec));
+	return Objective();
+}
+
+void PipelineSweep::AddParam(const QString& sStepParam)
+{
+	QStringList sl = sStepParam.split(':');
+	if (2 != sl.count())
+		EXERR("SWP2", "Bad param '%s', expected Step:Param", qPrintable(sStepParam));
+
+	// A step index, or the name of the first step by that name
+	bool bIndex = false;
+	int iStep = sl.first().toInt(&bIndex);
+	if (!bIndex)
+	{
+		iStep = -1;
+		for (int i = 0; i < m_pipeline.count() && iStep < 0; ++i)
+		{
+			if (m_pipeline.at(i).Name() == sl.first())
+				iStep = i;
+		}
+	}
+	if (iStep < 0 || iStep >= m_pipeline.count())
+		EXERR("SWP2", "No step '%s' in the pipeline", qPrintable(sl.first()));
+
+	const QList<PipelineStepParam>& listParams = m_pipeline.at(iStep).Params();
+	int iParam = -1;
+	for (int i = 0; i < listParams.count() && iParam < 0; ++i)
+	{
+		if (listParams.at(i).Name() == sl.last())
+			iParam = i;
+	}
+	if (iParam < 0)
+		EXERR("SWP2", "%s has no param '%s'", qPrintable(m_pipeline.at(iStep).Name()), qPrintable(sl.last()));
+
+	Axis axis;
+	axis.iStep = iStep;
+	axis.iParam = iParam;
+	axis.sName = sStepParam;
+	m_vectAxes += axis;
+}
+
+QStringList PipelineSweep::ParamNames() const
+{
+	QStringList sl;
+	for (const Axis& axis : m_vectAxes)
+		sl += axis.sName;
+	return sl;
+}
+
+int PipelineSweep::TrialCount() const
+{
+	return m_vectTrials.count();
+}
+
+QList<QVariant> PipelineSweep::GridValues(const Axis& axis, int iSteps) const
+{
+	const PipelineStepParam& psp = m_pipeline.at(axis.iStep).Params().at(axis.iParam);
+	QList<QVariant> listValues;
+
+	switch (psp.Type())
+	{
+	case QVariant::StringList:
+		// Enums get all their values, there is nothing in between
+		for (int iVal : psp.EnumValues())
+			listValues += iVal;
+		break;
+
+	case QVariant::Int:
+	{
+		int iMin = psp.MinValue().toInt();
+		int iMax = psp.MaxValue().toInt();
+		for (int i = 0; i < iSteps; ++i)
+		{
+			int iVal = iSteps > 1 ? qRound(iMin + (iMax - iMin) * i / (double)(iSteps - 1)) : psp.Value().toInt();
+
+			// A narrow range has fewer distinct values than steps
+			if (!listValues.contains(iVal))
+				listValues += iVal;
+		}
+		break;
+	}
+
+	case QVariant::Double:
+	{
+		double dMin = psp.MinValue().toDouble();
+		double dMax = psp.MaxValue().toDouble();
+		for (int i = 0; i < iSteps; ++i)
+			listValues += iSteps > 1 ? dMin + (dMax - dMin) * i / (iSteps - 1) : psp.Value().toDouble();
+		break;
+	}
+
+	default:
+		EXERR("SWP3", "Don't know how to sweep %s", qPrintable(axis.sName));
+	}
+
+	return listValues;
+}
+
+void PipelineSweep::BuildGrid(int iSteps)
+{
+	if (m_vectAxes.isEmpty())
+		EXERR("SWP4", "Nothing to sweep");
+
+	// Every combination, the last param changing fastest
+	m_vectTrials.clear();
+	m_vectTrials += Trial();
+	for (const Axis& axis : m_vectAxes)
+	{
+		QList<QVariant> listValues = GridValues(axis, iSteps);
+		QVector<Trial> vectNext;
+		for (const Trial& trial : m_vectTrials)
+		{
+			for (const QVariant& vValue : listValues)
+			{
+				Trial trialNext = trial;
+				trialNext.listValues += vValue;
+				vectNext += trialNext;
+			}
+		}
+		m_vectTrials = vectNext;
+	}
+}
+
+void PipelineSweep::BuildRandom(int iCount, quint32 uSeed)
+{
+	if (m_vectAxes.isEmpty())
+		EXERR("SWP4", "Nothing to sweep");
+
+	// Seeded, so a sweep can be repeated
+	QRandomGenerator rng(uSeed);
+	m_vectTrials.clear();
+	for (int t = 0; t < iCount; ++t)
+	{
+		Trial trial;
+		for (const Axis& axis : m_vectAxes)
+		{
+			const PipelineStepParam& psp = m_pipeline.at(axis.iStep).Params().at(axis.iParam);
+			switch (psp.Type())
+			{
+			case QVariant::StringList:
+			{
+				QList<int> listEnumValues = psp.EnumValues();
+				trial.listValues += listEnumValues.at(rng.bounded(listEnumValues.count()));
+				break;
+			}
+
+			case QVariant::Int:
+				trial.listValues += rng.bounded(psp.MinValue().toInt(), psp.MaxValue().toInt() + 1);
+				break;
+
+			case QVariant::Double:
+			{
+				double dMin = psp.MinValue().toDouble();
+				double dMax = psp.MaxValue().toDouble();
+				trial.listValues += dMin + rng.generateDouble() * (dMax - dMin);
+				break;
+			}
+
+			default:
+				EXERR("SWP3", "Don't know how to sweep %s", qPrintable(axis.sName));
+			}
+		}
+		m_vectTrials += trial;
+	}
+}
+
+Pipeline PipelineSweep::Apply(const Trial& trial) const
+{
+	Pipeline pipeline = m_pipeline;
+	for (int a = 0; a < m_vectAxes.count(); ++a)
+		pipeline[m_vectAxes.at(a).iStep].SetParamVal(m_vectAxes.at(a).iParam, trial.listValues.at(a));
+	return pipeline;
+}
+
+QVector<PipelineSweep::Trial> PipelineSweep::Run(const QList<PipelineData>& listInputs, int iThreads)
+{
+	if (m_pipeline.isEmpty() || listInputs.isEmpty())
+		EXERR("SWP5", "A sweep needs steps and inputs");
+
+	// Run the pipeline once as is. The trials only change the swept
+	// params, so everything above the first swept step is already in
+	// these caches when a trial starts from a copy of one.
+	QList<PipelineCache> listBaseCaches;
+	for (int i = 0; i < listInputs.count(); ++i)
+		listBaseCaches += PipelineCache();
+	PipelineCache* pBaseCaches = listBaseCaches.data();
+	WorkerPool::Run("SweepWorker", iThreads, listInputs.count(), [this, &listInputs, pBaseCaches](int i) {
+		const PipelineData& input = listInputs.at(i);
+		m_pipeline.Compile(input.img.type()).Process(input, &pBaseCaches[i]);
+	});
+
+	LOGINFO("Running %d trials over %d inputs", m_vectTrials.count(), listInputs.count());
+	Trial* pTrials = m_vectTrials.data();
+	WorkerPool::Run("SweepWorker", iThreads, m_vectTrials.count(), [this, pTrials, &listInputs, &listBaseCaches](int t) {
+		RunTrial(pTrials[t], listInputs, listBaseCaches);
+	});
+
+	// Failures last
+	QVector<Trial> vectRanked = m_vectTrials;
+	std::stable_sort(vectRanked.begin(), vectRanked.end(), [](const Trial& t1, const Trial& t2) {
+		if (t1.bOk != t2.bOk)
+			return t1.bOk;
+		return t1.dScore > t2.dScore;
+	});
+	return vectRanked;
+}
+
+void PipelineSweep::RunTrial(Trial& trial, const QList<PipelineData>& listInputs, const QList<PipelineCache>& listBaseCaches) const
+{
+	try
+	{
+		Pipeline pipeline = Apply(trial);
+		QMap<int, PipelinePlan> mapPlans;
+		double dTotal = 0.0;
+		for (int i = 0; i < listInputs.count(); ++i)
+		{
+			const PipelineData& input = listInputs.at(i);
+			int iType = input.img.type();
+			if (!mapPlans.contains(iType))
+				mapPlans.insert(iType, pipeline.Compile(iType));
+
+			// Our own copy, so only the swept steps and what they feed rerun.
+			// Only the last output gets scored.
+			PipelineCache cache = listBaseCaches.at(i);
+			mapPlans[iType].Process(input, &cache, PipelineContext(), PipelineOutputs::Final());
+			dTotal += m_objective(cache.Output(cache.Count() - 1));
+		}
+
+		trial.dScore = dTotal / listInputs.count();
+		trial.bOk = true;
+	}
+	catch (const std::exception& e)
+	{
+		// Some combinations just don't work, that's what we're finding out
+		trial.sError = e.what();
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <functional>
+#include <QVector>
+#include "Pipeline.h"
+
+
+/**
+@brief Tries many combinations of step params and ranks them
+
+Pick the params to sweep with AddParam(), then BuildGrid() or BuildRandom()
+to make the combinations from each param's MinValue()/MaxValue() (or enum
+values). Run() tries every combination on every input, spread over worker
+tasks, and scores the output of the last step with the objective. The
+score of a trial is the mean over the inputs, higher is better.
+
+The steps above the first swept one are the same for every trial, so they
+are run once per input up front and every trial starts from a copy of that
+cache.
+*/
+class PipelineSweep
+{
+public:
+	/// Scores the output of the last step, higher is better
+	using Objective = std::function<double(const PipelineData& out)>;
+
+	/// "count:N" for N overlay shapes (contours, lines...), "nonzero:F" for a fraction F of
+	/// set pixels. Throws for anything else.
+	static Objective ParseObjective(const QString& sSpec);
+
+	struct Trial {
+		QList<QVariant> listValues;	///< One per swept param, in AddParam() order
+		double dScore = 0.0;
+		bool bOk = false;
+		QString sError;
+	};
+
+	PipelineSweep(const Pipeline& pipeline, const Objective& objective);
+
+	/// "Canny:Thresh1" takes the first Canny step, "2:Thresh1" the third step
+	void AddParam(const QString& sStepParam);
+	QStringList ParamNames() const;
+
+	void BuildGrid(int iSteps);		///< iSteps values per param, all combinations
+	void BuildRandom(int iCount, quint32 uSeed);
+	int TrialCount() const;
+
+	/// Best first
+	QVector<Trial> Run(const QList<PipelineData>& listInputs, int iThreads);
+
+	Pipeline Apply(const Trial& trial) const;	///< The pipeline with the trial's values set
+
+private:
+	Pipeline m_pipeline;
+	Objective m_objective;
+
+	struct Axis {
+		int iStep = 0;
+		int iParam = 0;
+		QString sName;		///< As given to AddParam()
+	};
+	QVector<Axis> m_vectAxes;
+	QVector<Trial> m_vectTrials;
+
+	QList<QVariant> GridValues(const Axis& axis, int iSteps) const;
+	void RunTrial(Trial& trial, const QList<PipelineData>& listInputs, const QList<PipelineCache>& listBaseCaches) const;
+};
@@ -19,6 +19,14 @@ void PipelineTableModel::SetPipeline(Pipeline* pPipeline)
 	endResetModel();
 }
 
+void PipelineTableModel::RefreshStats()
+{
+	if (nullptr == m_pPipeline || m_pPipeline->isEmpty())
+		return;
+
+	emit dataChanged(index(0, COL_MinMs), index(rowCount() - 1, COL_Count - 1));
+}
+
 // Read access to the model
 int PipelineTableModel::rowCount(const QModelIndex& parent) const
 {
@@ -32,7 +40,7 @@ int PipelineTableModel::columnCount(const QModelIndex& parent) const
 {
 	if (nullptr == m_pPipeline)
 		return 0;
-	return 1;
+	return COL_Count;
 }
 
 
@@ -43,13 +51,34 @@ QVariant PipelineTableModel::data(const QModelIndex& index, int role) const
 	case Qt::DisplayRole:
 	{
 		const PipelineStep& ps = m_pPipeline->at(index.row());
+		if (COL_Name == index.column())
+			return ps.Name();
+
+		// Blank until the step has run at least once
+		PipelineStepStats::Summary stats = ps.Stats().Summarize();
+		if (0 == stats.iRuns)
+			return QVariant();
+
 		switch (index.column())
 		{
-		case 0:
-			return ps.Name();
-		
+		case COL_MinMs:
+			return QString::number(stats.dMinMs, 'f', 2);
+		case COL_MeanMs:
+			return QString::number(stats.dMeanMs, 'f', 2);
+		case COL_P95Ms:
+			return QString::number(stats.dP95Ms, 'f', 2);
+		case COL_OutBytes:
+			return QLocale().formattedDataSize(stats.iOutBytes, 1);
+		case COL_Shapes:
+			return stats.iShapes;
 		}
+		break;
 	}
+
+	case Qt::TextAlignmentRole:
+		if (COL_Name != index.column())
+			return QVariant(Qt::AlignRight | Qt::AlignVCenter);
+		break;
 	}
 
 	return QVariant();
@@ -57,14 +86,27 @@ QVariant PipelineTableModel::data(const QModelIndex& index, int role) const
 
 QVariant PipelineTableModel::headerData(int section, Qt::Orientation orientation, int role) const
 {
+	if (role != Qt::DisplayRole)
+		return QVariant();
+
 	if (orientation == Qt::Orientation::Vertical)
 		return section;
 	else
 	{
 		switch (section)
 		{
-		case 0:
+		case COL_Name:
 			return "Name";
+		case COL_MinMs:
+			return "Min ms";
+		case COL_MeanMs:
+			return "Mean ms";
+		case COL_P95Ms:
+			return "p95 ms";
+		case COL_OutBytes:
+			return "Output";
+		case COL_Shapes:
+			return "Shapes";
 		default:
 			return "error";
 		}
@@ -11,6 +11,17 @@ public:
 	PipelineTableModel(QObject* parent);
 	~PipelineTableModel();
 	void SetPipeline(Pipeline* pPipeline);
+	void RefreshStats();	///< Call after a run to update the timing columns
+
+	enum Column {
+		COL_Name,
+		COL_MinMs,
+		COL_MeanMs,
+		COL_P95Ms,
+		COL_OutBytes,
+		COL_Shapes,
+		COL_Count
+	};
 
 	// Read access to the model
 	virtual int rowCount(const QModelIndex& parent = QModelIndex()) const;
@@ -0,0 +1,49 @@
+#include "stdafx.h"
+#include "WorkerPool.h"
+#include <LambdaTask.h>
+
+
+
+void WorkerPool::Run(const QString& sName, int iThreads, int iCount, const std::function<void(int iJob)>& funcJob)
+{
+	iThreads = qBound(1, iThreads, qMax(1, iCount));
+	QAtomicInt iNext(0);
+	QVector<ExceptionContainer> vectErrors(iThreads);
+	ExceptionContainer* pErrors = vectErrors.data();
+	QVector<LambdaTask*> vectWorkers;
+	for (int w = 0; w < iThreads; ++w)
+	{
+		LambdaTask* pTask = new LambdaTask(QString("%1%2").arg(sName).arg(w), Task::NoAutoRethrow);
+
+		// Errors are rethrown below
+		pTask->DisableExceptionHandlingAssert();
+		vectWorkers += pTask;
+
+		pTask->Start([&iNext, iCount, &funcJob, pErrors, w]() {
+			try
+			{
+				int i;
+				while ((i = iNext.fetchAndAddRelaxed(1)) < iCount)
+					funcJob(i);
+			}
+			catch (...)
+			{
+				// Keep the others from starting anything new
+				iNext.storeRelaxed(iCount);
+				pErrors[w] = ExceptionContainer::CurrentException();
+			}
+		});
+	}
+
+	for (LambdaTask* pTask : vectWorkers)
+	{
+		pTask->WaitForFinished();
+		delete pTask;
+	}
+
+	for (const ExceptionContainer& exc : vectErrors)
+	{
+		if (exc.GetException())
+			exc.Rethrow();
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <functional>
+#include <QString>
+
+
+/**
+@brief Runs independent jobs on a few LambdaTasks at once
+
+Each worker pulls the next job until there are none left, so jobs of
+uneven length even out. A job that throws keeps the workers from starting
+anything new, and its error is rethrown once all of them have stopped.
+Jobs already running finish first.
+*/
+class WorkerPool
+{
+public:
+	/// funcJob gets called with every index below iCount, from up to
+	/// iThreads workers named sName and a number
+	static void Run(const QString& sName, int iThreads, int iCount, const std::function<void(int iJob)>& funcJob);
+};
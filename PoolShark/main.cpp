@@ -21,6 +21,10 @@ DECLARE_LOG_SRC("main", LOGCAT_Common);
 int main(int argc, char *argv[])
 {
     Application a(argc, argv);
+
+    // Must be running before any Task gets started
+    Logging::LoggingSystem::Start(nullptr);
+
     MainWindow w;
     VERIFY(a.connect(&a, &Application::UnhandledException, &w, &MainWindow::OnUnhandledException));
     w.show();
@@ -0,0 +1,589 @@
+#include "stdafx.h"
+#include "BatchRunner.h"
+#include <PipelinePolicy.h>
+#include <WorkerPool.h>
+#include <Util.h>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <opencv2/imgcodecs/imgcodecs.hpp>     // cv::imread()
+#include <opencv2/imgproc/imgproc.hpp>         // cv::cvtColor()
+
+
+
+DECLARE_LOG_SRC("BatchRunner", LOGCAT_Common);
+
+#define SWEEP_SHOW_TOP		10		///< Trials listed on the console, the CSV has all
+#define SESSION_SUFFIX		"pss"
+
+
+BatchRunner::BatchRunner(const Options& opts)
+	: m_opts(opts)
+{
+}
+
+int BatchRunner::Run()
+{
+	QTextStream out(stdout);
+
+	if (!m_opts.sPack.isEmpty())
+	{
+		FindInputs();
+		return Pack();
+	}
+
+	m_pipeline.fromFile(m_opts.sPipelineFile);
+	out << QString("Pipeline '%1', %2 steps\n").arg(m_pipeline.Name()).arg(m_pipeline.count());
+	SetUpDevices();
+
+	// Golden runs have to run every step, not pick up stored outputs, and
+	// every image, or there's nothing to record or check
+	bool bGolden = !m_opts.sGoldenRecord.isEmpty() || !m_opts.sGoldenCheck.isEmpty();
+	if (bGolden && m_opts.dFrameBudgetMs > 0.0)
+	{
+		out << "Ignoring the frame budget for the golden run\n";
+		m_opts.dFrameBudgetMs = 0.0;
+	}
+	if (!m_opts.sGoldenCheck.isEmpty())
+	{
+		m_golden.fromFile(m_opts.sGoldenCheck);
+		out << QString("Checking against %1 golden images\n").arg(m_golden.ImageCount());
+	}
+
+	// Shared with the GUI if pointed at the same directory
+	if (!m_opts.sCacheDir.isEmpty() && !bGolden)
+		m_pDiskCache.reset(new PipelineDiskCache(m_opts.sCacheDir, m_opts.iCacheMaxBytes));
+
+	FindInputs();
+	if (m_vectInputs.isEmpty())
+	{
+		out << "No input images found\n";
+		return 1;
+	}
+
+	if (!m_opts.slSweepParams.isEmpty())
+		return RunSweep();
+
+	m_vectResults.resize(m_vectInputs.count());
+
+	int iThreads = qBound(1, m_opts.iThreads, m_vectInputs.count());
+	out << QString("Processing %1 images on %2 threads\n").arg(m_vectInputs.count()).arg(iThreads);
+	out.flush();
+
+	QElapsedTimer timerWall;
+	timerWall.start();
+
+	// Errors are recorded per image in ProcessInput(), nothing comes back
+	WorkerPool::Run("BatchWorker", iThreads, m_vectInputs.count(), [this](int i) { ProcessInput(i); });
+
+	qint64 iWallNs = timerWall.nsecsElapsed();
+
+	if (!m_opts.sTimingCsv.isEmpty())
+		WriteTimingCsv();
+	PrintSummary(iWallNs);
+
+	if (m_opts.bCalibrate)
+	{
+		PipelinePolicy& policy = PipelinePolicy::Instance();
+		for (const QString& sChoice : policy.Choices())
+			out << sChoice << "\n";
+		if (!m_opts.sPolicyFile.isEmpty())
+			policy.toFileAtomic(m_opts.sPolicyFile, SerMig::OPT_Binary);
+	}
+
+	if (bGolden)
+		return FinishGolden();
+
+	// Frames dropped to keep up aren't failures
+	for (const Result& result : m_vectResults)
+	{
+		if (!result.bOk && !result.bDropped)
+			return 1;
+	}
+	return 0;
+}
+
+void BatchRunner::FindInputs()
+{
+	QStringList slFilters;
+	slFilters << "*.jpg" << "*.jpeg" << "*.png" << "*.bmp";
+
+	for (const QString& sInput : m_opts.slInputs)
+	{
+		QFileInfo fi(sInput);
+
+		// Packed already, the frames keep the names they were packed with
+		if (!fi.isDir() && 0 == fi.suffix().compare(SESSION_SUFFIX, Qt::CaseInsensitive))
+		{
+			std::unique_ptr<PipelineSession> pSession(new PipelineSession());
+			pSession->Open(fi.absoluteFilePath());
+			for (int f = 0; f < pSession->FrameCount(); ++f)
+			{
+				Input input;
+				input.sPath = QString("%1:%2").arg(fi.absoluteFilePath(), pSession->FrameName(f));
+				input.sRelBase = pSession->FrameName(f);
+				input.iSession = int(m_vectSessions.size());
+				input.iFrame = f;
+				m_vectInputs += input;
+			}
+			m_vectSessions.push_back(std::move(pSession));
+			continue;
+		}
+
+		if (!fi.isDir())
+		{
+			Input input;
+			input.sPath = fi.absoluteFilePath();
+			input.sRelBase = fi.completeBaseName();
+			m_vectInputs += input;
+			continue;
+		}
+
+		// Mirror the directory structure under the output dir. The top
+		// directory name is kept so Session1/table1 and Session2/table1
+		// don't collide.
+		QDir dir(fi.absoluteFilePath());
+		QFileInfoList listFiles;
+		if (m_opts.bRecursive)
+			listFiles = Util::RecursiveDirSearch(dir.absolutePath(), slFilters, QDir::NoFilter, QDir::Name);
+		else
+			listFiles = dir.entryInfoList(slFilters, QDir::Files, QDir::Name);
+
+		for (const QFileInfo& fiFile : listFiles)
+		{
+			QString sRel = dir.relativeFilePath(fiFile.absoluteFilePath());
+			QFileInfo fiRel(sRel);
+
+			Input input;
+			input.sPath = fiFile.absoluteFilePath();
+			input.sRelBase = dir.dirName() + "/" + fiRel.path() + "/" + fiRel.completeBaseName();
+			input.sRelBase = QDir::cleanPath(input.sRelBase);
+			m_vectInputs += input;
+		}
+	}
+}
+
+cv::Mat BatchRunner::ReadInput(const Input& input) const
+{
+	if (input.iSession >= 0)
+		return m_vectSessions.at(input.iSession)->Frame(input.iFrame);
+
+	cv::Mat img = cv::imread(qPrintable(input.sPath));
+	if (img.empty())
+		EXERR("B7KQ", "Could not read image '%s'", qPrintable(input.sPath));
+	return img;
+}
+
+int BatchRunner::Pack()
+{
+	QTextStream out(stdout);
+	if (m_vectInputs.isEmpty())
+	{
+		out << "No input images found\n";
+		return 1;
+	}
+	out << QString("Packing %1 images into '%2'\n").arg(m_vectInputs.count()).arg(m_opts.sPack);
+	out.flush();
+
+	QElapsedTimer timer;
+	timer.start();
+
+	// Named after where they'd be written, so a packed session gives the
+	// same outputs and golden names as the files did
+	PipelineSession::Writer writer(m_opts.sPack);
+	for (const Input& input : m_vectInputs)
+	{
+		qint64 iTimestampMs = input.iSession >= 0
+			? m_vectSessions.at(input.iSession)->FrameTimestampMs(input.iFrame)
+			: QFileInfo(input.sPath).lastModified().toMSecsSinceEpoch();
+		writer.Append(input.sRelBase, ReadInput(input), iTimestampMs);
+	}
+	writer.Commit();
+
+	out << QString("%1 images in %2 s, %3 MB\n")
+		.arg(m_vectInputs.count())
+		.arg(timer.nsecsElapsed() / 1.0e9, 0, 'f', 2)
+		.arg(QFileInfo(m_opts.sPack).size() >> 20);
+	return 0;
+}
+
+void BatchRunner::SetUpDevices()
+{
+	QTextStream out(stdout);
+	PipelinePolicy& policy = PipelinePolicy::Instance();
+	if (!m_opts.sOpenCL.isEmpty())
+		policy.SetOpenCL("on" == m_opts.sOpenCL);
+	if (!m_opts.sPolicyFile.isEmpty() && QFile::exists(m_opts.sPolicyFile))
+		policy.fromFile(m_opts.sPolicyFile);
+	policy.SetCalibrating(m_opts.bCalibrate);
+
+	// "Step:device", the step by index or every step by that name
+	for (const QString& sPin : m_opts.slDevices)
+	{
+		QStringList sl = sPin.split(':');
+		if (2 != sl.count())
+			EXERR("B7KU", "Bad device '%s', expected Step:Device", qPrintable(sPin));
+		PipelinePolicy::Device device = PipelinePolicy::ParseDevice(sl.last());
+
+		bool bIndex = false;
+		int iStep = sl.first().toInt(&bIndex);
+		int iPinned = 0;
+		for (int i = 0; i < m_pipeline.count(); ++i)
+		{
+			if (bIndex ? i == iStep : m_pipeline.at(i).Name() == sl.first())
+			{
+				m_pipeline[i].SetDevice(device);
+				++iPinned;
+			}
+		}
+		if (0 == iPinned)
+			EXERR("B7KU", "No step '%s' in the pipeline", qPrintable(sl.first()));
+	}
+
+	out << QString("OpenCL %1%2\n").arg(policy.OpenCL() ? "on" : "off").arg(m_opts.bCalibrate ? ", calibrating" : "");
+}
+
+PipelinePlan BatchRunner::PlanFor(int iType)
+{
+	QMutexLocker lock(&m_mutexPlans);
+	if (!m_mapPlans.contains(iType))
+		m_mapPlans.insert(iType, m_pipeline.Compile(iType));
+	return m_mapPlans.value(iType);
+}
+
+void BatchRunner::ProcessInput(int iInput)
+{
+	const Input& input = m_vectInputs.at(iInput);
+	Result& result = m_vectResults[iInput];
+
+	try
+	{
+		QElapsedTimer timer;
+		timer.start();
+		cv::Mat img = ReadInput(input);
+		result.iDecodeNs = timer.nsecsElapsed();
+
+		// The budget covers running the pipeline and drawing the outputs,
+		// like a live frame would
+		PipelineContext context;
+		context.SetBudgetMs(m_opts.dFrameBudgetMs);
+
+		// A fresh cache per image, we only want it for the step timings
+		// and to get at the disk cache
+		PipelineCache cache;
+		cache.SetDiskCache(m_pDiskCache.get());
+		PipelineData data;
+		data.img = img.getUMat(cv::ACCESS_READ);
+
+		// Intermediate outputs only when they get written or compared,
+		// otherwise their buffers are recycled while the image is running
+		bool bAll = m_opts.bIntermediate || !m_opts.sGoldenRecord.isEmpty() || !m_opts.sGoldenCheck.isEmpty();
+		PlanFor(img.type()).Process(data, &cache, context, bAll ? PipelineOutputs::All() : PipelineOutputs::Final());
+		QList<PipelineData> listOuts = cache.Outputs();
+		for (int i = 0; i < cache.Count(); ++i)
+			result.listStepNs += cache.StepNs(i);
+
+		if (!m_opts.sGoldenRecord.isEmpty())
+			result.golden = PipelineGolden::MakeImage(input.sRelBase, m_pipeline, cache);
+		if (!m_opts.sGoldenCheck.isEmpty())
+		{
+			const PipelineGolden::Image* pGolden = m_golden.Find(input.sRelBase);
+			if (pGolden)
+				result.slGoldenDiffs = PipelineGolden::Compare(*pGolden, PipelineGolden::MakeImage(input.sRelBase, m_pipeline, cache), m_opts.tolGolden);
+			else
+				result.slGoldenDiffs += "Not in the golden set";
+		}
+
+		timer.restart();
+		if (!m_opts.sOutDir.isEmpty() && !listOuts.isEmpty())
+		{
+			WriteImage(input.sRelBase, listOuts.last(), context);
+
+			if (m_opts.bIntermediate)
+			{
+				for (int i = 0; i < listOuts.count() - 1; ++i)
+				{
+					QString sRelBase = QString("%1_%2_%3").arg(input.sRelBase).arg(i, 2, 10, QChar('0')).arg(m_pipeline.at(i).Name());
+					WriteImage(sRelBase, listOuts.at(i), context);
+				}
+			}
+		}
+		result.iWriteNs = timer.nsecsElapsed();
+		result.bOk = true;
+	}
+	catch (const PipelineAbandoned& e)
+	{
+		result.bDropped = true;
+		result.sError = e.what();
+	}
+	catch (const std::exception& e)
+	{
+		result.sError = e.what();
+		LOGERR("%s: %s", qPrintable(input.sPath), qPrintable(result.sError));
+	}
+}
+
+void BatchRunner::WriteImage(const QString& sRelBase, const PipelineData& data, const PipelineContext& context) const
+{
+	QString sFilename = QDir(m_opts.sOutDir).absoluteFilePath(sRelBase + "." + m_opts.sFormat);
+	Util::ForcePath(sFilename);
+
+	// The image writers only take 8 bit (and some 16 bit unsigned) data.
+	// Steps like Laplacian produce signed output, so scale those down.
+	cv::Mat mat = data.img.getMat(cv::ACCESS_READ);
+	if (mat.depth() != CV_8U)
+	{
+		cv::Mat mat8;
+		cv::convertScaleAbs(mat, mat8);
+		mat = mat8;
+	}
+
+	// Steps that find things leave them in the overlay, draw it in
+	if (!data.overlay.IsEmpty())
+	{
+		cv::Mat matColor;
+		if (1 == mat.channels())
+			cv::cvtColor(mat, matColor, cv::COLOR_GRAY2BGR);
+		else
+			mat.copyTo(matColor);
+		data.overlay.Draw(matColor, 1.0, data.FrameRect().tl(), &context);
+		mat = matColor;
+	}
+
+	if (!cv::imwrite(qPrintable(sFilename), mat))
+		EXERR("B7KR", "Could not write image '%s'", qPrintable(sFilename));
+}
+
+void BatchRunner::WriteTimingCsv() const
+{
+	QFile file(m_opts.sTimingCsv);
+	Util::ForcePath(m_opts.sTimingCsv);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+		EXERR("B7KS", "Could not create '%s'", qPrintable(m_opts.sTimingCsv));
+
+	QTextStream ts(&file);
+
+	// One row per image, one column per step. All times in milliseconds.
+	ts << "image,ok,decode_ms";
+	for (int i = 0; i < m_pipeline.count(); ++i)
+		ts << QString(",%1_%2_ms").arg(i).arg(m_pipeline.at(i).Name());
+	ts << ",pipeline_ms,write_ms\n";
+
+	for (int iInput = 0; iInput < m_vectInputs.count(); ++iInput)
+	{
+		const Result& result = m_vectResults.at(iInput);
+		ts << m_vectInputs.at(iInput).sPath << "," << (result.bOk ? 1 : 0);
+		ts << "," << result.iDecodeNs / 1.0e6;
+
+		qint64 iPipelineNs = 0;
+		for (int i = 0; i < m_pipeline.count(); ++i)
+		{
+			ts << ",";
+			if (i < result.listStepNs.count())
+			{
+				ts << result.listStepNs.at(i) / 1.0e6;
+				iPipelineNs += result.listStepNs.at(i);
+			}
+		}
+		ts << "," << iPipelineNs / 1.0e6 << "," << result.iWriteNs / 1.0e6 << "\n";
+	}
+}
+
+void BatchRunner::PrintSummary(qint64 iWallNs) const
+{
+	QTextStream out(stdout);
+
+	int iOk = 0;
+	int iDropped = 0;
+	QVector<qint64> vectStepTotalNs(m_pipeline.count(), 0);
+	for (int iInput = 0; iInput < m_vectResults.count(); ++iInput)
+	{
+		const Result& result = m_vectResults.at(iInput);
+		if (result.bDropped)
+		{
+			++iDropped;
+			continue;
+		}
+		if (!result.bOk)
+		{
+			out << QString("FAILED %1: %2\n").arg(m_vectInputs.at(iInput).sPath, result.sError);
+			continue;
+		}
+
+		++iOk;
+		for (int i = 0; i < result.listStepNs.count(); ++i)
+			vectStepTotalNs[i] += result.listStepNs.at(i);
+	}
+
+	double dWallSec = iWallNs / 1.0e9;
+	out << QString("%1 of %2 images in %3 s, %4 fps\n")
+		.arg(iOk).arg(m_vectResults.count())
+		.arg(dWallSec, 0, 'f', 2)
+		.arg(dWallSec > 0.0 ? m_vectResults.count() / dWallSec : 0.0, 0, 'f', 2);
+	if (iDropped > 0)
+		out << QString("%1 dropped over the %2 ms frame budget\n").arg(iDropped).arg(m_opts.dFrameBudgetMs);
+
+	if (iOk > 0)
+	{
+		out << "Mean time per step:\n";
+		for (int i = 0; i < m_pipeline.count(); ++i)
+			out << QString("  %1 %2: %3 ms\n").arg(i, 2).arg(m_pipeline.at(i).Name(), -16).arg(vectStepTotalNs.at(i) / 1.0e6 / iOk, 0, 'f', 2);
+	}
+}
+
+double BatchRunner::MeanPipelineMs() const
+{
+	int iOk = 0;
+	qint64 iTotalNs = 0;
+	for (const Result& result : m_vectResults)
+	{
+		if (!result.bOk)
+			continue;
+		++iOk;
+		for (qint64 iNs : result.listStepNs)
+			iTotalNs += iNs;
+	}
+	return iOk > 0 ? iTotalNs / 1.0e6 / iOk : 0.0;
+}
+
+int BatchRunner::FinishGolden()
+{
+	QTextStream out(stdout);
+
+	for (const Result& result : m_vectResults)
+	{
+		if (!result.bOk)
+		{
+			out << "Not recording or checking golden outputs, some images failed\n";
+			return 1;
+		}
+	}
+
+	double dMeanMs = MeanPipelineMs();
+	if (!m_opts.sGoldenRecord.isEmpty())
+	{
+		PipelineGolden golden;
+		golden.SetPipelineName(m_pipeline.Name());
+		golden.SetBudgetMs(m_opts.dBudgetMs);
+		for (const Result& result : m_vectResults)
+			golden.Add(result.golden);
+		golden.toFileAtomic(m_opts.sGoldenRecord, SerMig::OPT_Binary);
+		out << QString("Recorded %1 golden images to '%2'\n").arg(golden.ImageCount()).arg(m_opts.sGoldenRecord);
+		return 0;
+	}
+
+	int iFailed = 0;
+	for (int iInput = 0; iInput < m_vectResults.count(); ++iInput)
+	{
+		const Result& result = m_vectResults.at(iInput);
+		if (result.slGoldenDiffs.isEmpty())
+			continue;
+		++iFailed;
+		out << QString("DIFFERS %1\n").arg(m_vectInputs.at(iInput).sRelBase);
+		for (const QString& sDiff : result.slGoldenDiffs)
+			out << "  " << sDiff << "\n";
+	}
+	out << QString("%1 of %2 images match the golden outputs\n").arg(m_vectResults.count() - iFailed).arg(m_vectResults.count());
+
+	// Timings are only comparable on the same kind of machine, so the
+	// budget is generous and per pipeline rather than per step
+	double dBudgetMs = m_opts.dBudgetMs > 0.0 ? m_opts.dBudgetMs : m_golden.BudgetMs();
+	bool bOverBudget = dBudgetMs > 0.0 && dMeanMs > dBudgetMs;
+	if (dBudgetMs > 0.0)
+		out << QString("%1 %2 ms per image, budget %3 ms\n").arg(bOverBudget ? "OVER BUDGET" : "Within budget").arg(dMeanMs, 0, 'f', 2).arg(dBudgetMs, 0, 'f', 2);
+
+	return iFailed > 0 || bOverBudget ? 1 : 0;
+}
+
+int BatchRunner::RunSweep()
+{
+	QTextStream out(stdout);
+
+	if (m_opts.sObjective.isEmpty())
+		EXERR("B7KT", "A sweep needs an objective");
+	PipelineSweep sweep(m_pipeline, PipelineSweep::ParseObjective(m_opts.sObjective));
+	for (const QString& sParam : m_opts.slSweepParams)
+		sweep.AddParam(sParam);
+	if (m_opts.iSweepRandom > 0)
+		sweep.BuildRandom(m_opts.iSweepRandom, m_opts.uSweepSeed);
+	else
+		sweep.BuildGrid(m_opts.iSweepSteps);
+
+	// Every trial needs every image, so decode them all once. Session
+	// frames are only looked at.
+	QList<PipelineData> listInputs;
+	for (const Input& input : m_vectInputs)
+	{
+		cv::Mat img = ReadInput(input);
+		PipelineData data;
+		data.img = img.getUMat(cv::ACCESS_READ);
+		listInputs += data;
+	}
+
+	out << QString("Sweeping %1 trials over %2 images on %3 threads\n").arg(sweep.TrialCount()).arg(listInputs.count()).arg(m_opts.iThreads);
+	out.flush();
+
+	QElapsedTimer timerWall;
+	timerWall.start();
+	QVector<PipelineSweep::Trial> vectTrials = sweep.Run(listInputs, m_opts.iThreads);
+	double dWallSec = timerWall.nsecsElapsed() / 1.0e9;
+
+	QStringList slParams = sweep.ParamNames();
+	if (!m_opts.sSweepCsv.isEmpty())
+		WriteSweepCsv(slParams, vectTrials);
+
+	out << QString("%1 trials in %2 s\n").arg(vectTrials.count()).arg(dWallSec, 0, 'f', 2);
+	out << QString("%1 %2").arg("rank", 4).arg("score", 10);
+	for (const QString& sParam : slParams)
+		out << "  " << sParam;
+	out << "\n";
+	for (int t = 0; t < qMin(vectTrials.count(), SWEEP_SHOW_TOP); ++t)
+	{
+		const PipelineSweep::Trial& trial = vectTrials.at(t);
+		out << QString("%1 %2").arg(t + 1, 4).arg(trial.dScore, 10, 'f', 4);
+		for (int a = 0; a < slParams.count(); ++a)
+			out << "  " << QString("%1").arg(trial.listValues.at(a).toString(), -slParams.at(a).length());
+		if (!trial.bOk)
+			out << "  FAILED " << trial.sError;
+		out << "\n";
+	}
+
+	// Failed ones sort last, so this means all failed
+	if (vectTrials.isEmpty() || !vectTrials.first().bOk)
+	{
+		out << "No trial succeeded\n";
+		return 1;
+	}
+
+	if (!m_opts.sSweepSave.isEmpty())
+	{
+		Pipeline pipelineBest = sweep.Apply(vectTrials.first());
+		pipelineBest.toFile(m_opts.sSweepSave);
+		out << QString("Best pipeline saved to '%1'\n").arg(m_opts.sSweepSave);
+	}
+	return 0;
+}
+
+void BatchRunner::WriteSweepCsv(const QStringList& slParams, const QVector<PipelineSweep::Trial>& vectTrials) const
+{
+	QFile file(m_opts.sSweepCsv);
+	Util::ForcePath(m_opts.sSweepCsv);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+		EXERR("B7KS", "Could not create '%s'", qPrintable(m_opts.sSweepCsv));
+
+	QTextStream ts(&file);
+
+	// One row per trial, best first
+	ts << "rank,ok,score";
+	for (const QString& sParam : slParams)
+		ts << "," << sParam;
+	ts << ",error\n";
+
+	for (int t = 0; t < vectTrials.count(); ++t)
+	{
+		const PipelineSweep::Trial& trial = vectTrials.at(t);
+		ts << t + 1 << "," << (trial.bOk ? 1 : 0) << "," << trial.dScore;
+		for (const QVariant& vValue : trial.listValues)
+			ts << "," << vValue.toString();
+		ts << "," << QString(trial.sError).replace(',', ';') << "\n";
+	}
+}
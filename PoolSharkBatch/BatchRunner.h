@@ -0,0 +1,126 @@
+#pragma once
+
+#include <Pipeline.h>
+#include <PipelineDiskCache.h>
+#include <PipelineSweep.h>
+#include <PipelineGolden.h>
+#include <PipelineSession.h>
+#include <QStringList>
+#include <QMutex>
+#include <QMap>
+#include <QVector>
+#include <memory>
+#include <vector>
+
+/**
+@brief Runs a saved pipeline over a set of image files without a GUI
+
+Inputs can be files or directories. Every image goes through the pipeline
+on a pool of worker tasks, the final (and optionally every intermediate)
+output is written to the output directory, and the time spent in each step
+is collected for a CSV report.
+
+With sweep params given it instead tries combinations of those params on
+all the inputs and reports which scored best, see PipelineSweep.
+
+It can also record the output of every step as a golden set, or check the
+outputs and the time taken against one, see PipelineGolden.
+
+Steps run on the CPU or through OpenCL as PipelinePolicy decides, which
+can be calibrated on the inputs and saved for later runs.
+
+With a frame budget, images that take longer are dropped part way, the
+way a live stream would skip a late frame, and counted in the summary.
+
+Inputs can also be session files, see PipelineSession, each frame of
+which goes in as if it were an image file, without being decoded. Given
+a session file to pack, it converts the inputs into one instead.
+*/
+class BatchRunner
+{
+public:
+	struct Options {
+		QString sPipelineFile;
+		QStringList slInputs;		///< Image files and/or directories
+		QString sOutDir;
+		QString sFormat = "png";	///< Extension for the written images
+		QString sTimingCsv;			///< Empty for no CSV
+		bool bRecursive = false;
+		bool bIntermediate = false;
+		int iThreads = 1;
+		QString sCacheDir;			///< Empty for no disk cache
+		qint64 iCacheMaxBytes = 2LL << 30;
+
+		QStringList slSweepParams;	///< "Step:Param", a sweep if not empty
+		int iSweepSteps = 5;		///< Values per param for a grid
+		int iSweepRandom = 0;		///< Random trials instead of a grid if > 0
+		quint32 uSweepSeed = 1;
+		QString sObjective;			///< See PipelineSweep::ParseObjective()
+		QString sSweepCsv;			///< Empty for no CSV
+		QString sSweepSave;			///< Where to save the best pipeline, empty for nowhere
+
+		QString sGoldenRecord;		///< Golden file to write
+		QString sGoldenCheck;		///< Golden file to check against
+		double dBudgetMs = 0.0;		///< Mean pipeline time per image, 0 for the golden file's
+		PipelineGolden::Tolerance tolGolden;
+
+		QString sOpenCL;			///< "on" or "off", empty for OpenCV's default
+		QStringList slDevices;		///< "Step:Device" pins, see PipelinePolicy::ParseDevice()
+		QString sPolicyFile;		///< Calibration to start from, and to save to when calibrating
+		bool bCalibrate = false;
+
+		double dFrameBudgetMs = 0.0;	///< Drop images that take longer, 0 for no limit. Not for golden runs.
+
+		QString sPack;				///< Session file to convert the inputs to, instead of running
+	};
+
+	BatchRunner(const Options& opts);
+
+	int Run();	///< Returns the process exit code
+
+private:
+	Options m_opts;
+	Pipeline m_pipeline;
+	std::unique_ptr<PipelineDiskCache> m_pDiskCache;
+	void SetUpDevices();
+
+	struct Input {
+		QString sPath;
+		QString sRelBase;	///< Output path relative to the output dir, without extension
+		int iSession = -1;	///< Index into m_vectSessions, or -1 for an image file
+		int iFrame = 0;		///< In that session
+	};
+	QVector<Input> m_vectInputs;
+	std::vector<std::unique_ptr<PipelineSession>> m_vectSessions;	///< Open for the whole run, the inputs look into them
+	void FindInputs();
+	cv::Mat ReadInput(const Input& input) const;
+	int Pack();
+
+	struct Result {
+		bool bOk = false;
+		bool bDropped = false;		///< Over the frame budget, not an error
+		QString sError;
+		qint64 iDecodeNs = 0;
+		qint64 iWriteNs = 0;
+		QList<qint64> listStepNs;
+		PipelineGolden::Image golden;	///< When recording
+		QStringList slGoldenDiffs;		///< When checking
+	};
+	QVector<Result> m_vectResults;
+
+	QMutex m_mutexPlans;
+	QMap<int, PipelinePlan> m_mapPlans;	///< Compiled on demand for each input type
+	PipelinePlan PlanFor(int iType);
+
+	void ProcessInput(int iInput);
+	void WriteImage(const QString& sRelBase, const PipelineData& data, const PipelineContext& context) const;
+	void WriteTimingCsv() const;
+	void PrintSummary(qint64 iWallNs) const;
+
+	PipelineGolden m_golden;
+	int FinishGolden();
+	double MeanPipelineMs() const;
+
+	int RunSweep();
+	void WriteSweepCsv(const QStringList& slParams, const QVector<PipelineSweep::Trial>& vectTrials) const;
+};
@@ -0,0 +1,130 @@
+#include "stdafx.h"
+#include "BatchRunner.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <iostream>                        // std::cerr
+#include <Logging.h>
+
+
+
+DECLARE_LOG_SRC("main", LOGCAT_Common);
+
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication a(argc, argv);
+	QCoreApplication::setApplicationName("PoolSharkBatch");
+
+	// Must be running before any Task gets started
+	Logging::LoggingSystem::Start(nullptr);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Run a Pool Shark pipeline (.ipl) over a set of images");
+	parser.addHelpOption();
+	parser.addPositionalArgument("pipeline", "Pipeline file (.ipl)");
+	parser.addPositionalArgument("inputs", "Image files, session files (.pss) and/or directories", "inputs...");
+
+	QCommandLineOption optOut(QStringList() << "o" << "out", "Write the outputs to <dir>.", "dir");
+	QCommandLineOption optThreads(QStringList() << "j" << "threads", "Process <n> images at once.", "n", QString::number(QThread::idealThreadCount()));
+	QCommandLineOption optFormat("format", "Image format of the outputs (png, jpg, ...).", "ext", "png");
+	QCommandLineOption optCsv("csv", "Write per step timings to <file>.", "file");
+	QCommandLineOption optRecursive(QStringList() << "r" << "recursive", "Search input directories recursively.");
+	QCommandLineOption optIntermediate("intermediate", "Also write the output of every step.");
+	QCommandLineOption optCache("cache", "Keep step outputs in <dir> and reuse them on later runs.", "dir");
+	QCommandLineOption optCacheSize("cache-size", "Size budget of the cache in MB.", "MB", "2048");
+	QCommandLineOption optSweep("sweep", "Sweep <step:param> instead of writing outputs, step by name or index. Repeat for more params.", "step:param");
+	QCommandLineOption optSteps("steps", "Try <n> values of each swept param.", "n", "5");
+	QCommandLineOption optRandom("random", "Try <n> random combinations instead of all of them.", "n", "0");
+	QCommandLineOption optSeed("seed", "Seed for --random.", "n", "1");
+	QCommandLineOption optObjective("objective", "What a sweep aims for in the last step's output: count:<n> contours, lines or circles, nonzero:<fraction> of pixels set.", "spec");
+	QCommandLineOption optSweepCsv("sweep-csv", "Write all sweep trials to <file>.", "file");
+	QCommandLineOption optSweepSave("save-best", "Save the pipeline with the best sweep params to <file>.", "file");
+	QCommandLineOption optGoldenRecord("golden-record", "Record the output of every step as golden data to <file>.", "file");
+	QCommandLineOption optGoldenCheck("golden-check", "Check the output of every step against the golden data in <file>.", "file");
+	QCommandLineOption optBudget("budget", "Mean pipeline time per image allowed, stored with --golden-record, overrides the stored one with --golden-check.", "ms", "0");
+	QCommandLineOption optLevels("golden-levels", "How far off a golden pixel may be.", "n", "2");
+	QCommandLineOption optPixels("golden-pixels", "Share of golden pixels that may be off by more.", "percent", "0.1");
+	QCommandLineOption optOpenCL("opencl", "Switch OpenCL <on> or <off> for every step.", "on|off");
+	QCommandLineOption optDevice("device", "Pin <step> to auto, cpu or opencl, step by name or index. Repeat for more steps.", "step:device");
+	QCommandLineOption optPolicy("policy", "Load which of cpu and opencl was faster for each step from <file>, and save it there with --calibrate.", "file");
+	QCommandLineOption optCalibrate("calibrate", "Time auto steps on both cpu and opencl and keep the faster.");
+	QCommandLineOption optFrameBudget("frame-budget", "Drop images whose pipeline and drawing take longer than <ms>. Ignored by golden runs.", "ms", "0");
+	QCommandLineOption optPack("pack", "Convert the inputs into the session <file> (.pss), which later runs read without decoding. Takes no pipeline.", "file");
+	parser.addOption(optOut);
+	parser.addOption(optThreads);
+	parser.addOption(optFormat);
+	parser.addOption(optCsv);
+	parser.addOption(optRecursive);
+	parser.addOption(optIntermediate);
+	parser.addOption(optCache);
+	parser.addOption(optCacheSize);
+	parser.addOption(optSweep);
+	parser.addOption(optSteps);
+	parser.addOption(optRandom);
+	parser.addOption(optSeed);
+	parser.addOption(optObjective);
+	parser.addOption(optSweepCsv);
+	parser.addOption(optSweepSave);
+	parser.addOption(optGoldenRecord);
+	parser.addOption(optGoldenCheck);
+	parser.addOption(optBudget);
+	parser.addOption(optLevels);
+	parser.addOption(optPixels);
+	parser.addOption(optOpenCL);
+	parser.addOption(optDevice);
+	parser.addOption(optPolicy);
+	parser.addOption(optCalibrate);
+	parser.addOption(optFrameBudget);
+	parser.addOption(optPack);
+	parser.process(a);
+
+	// Packing takes no pipeline, only inputs
+	QStringList slArgs = parser.positionalArguments();
+	if (slArgs.count() < (parser.isSet(optPack) ? 1 : 2))
+		parser.showHelp(1);
+
+	BatchRunner::Options opts;
+	if (!parser.isSet(optPack))
+		opts.sPipelineFile = slArgs.takeFirst();
+	opts.slInputs = slArgs;
+	opts.sOutDir = parser.value(optOut);
+	opts.sFormat = parser.value(optFormat);
+	opts.sTimingCsv = parser.value(optCsv);
+	opts.bRecursive = parser.isSet(optRecursive);
+	opts.bIntermediate = parser.isSet(optIntermediate);
+	opts.iThreads = qMax(1, parser.value(optThreads).toInt());
+	opts.sCacheDir = parser.value(optCache);
+	opts.iCacheMaxBytes = qMax(1LL, parser.value(optCacheSize).toLongLong()) << 20;
+	opts.slSweepParams = parser.values(optSweep);
+	opts.iSweepSteps = qMax(1, parser.value(optSteps).toInt());
+	opts.iSweepRandom = qMax(0, parser.value(optRandom).toInt());
+	opts.uSweepSeed = parser.value(optSeed).toUInt();
+	opts.sObjective = parser.value(optObjective);
+	opts.sSweepCsv = parser.value(optSweepCsv);
+	opts.sSweepSave = parser.value(optSweepSave);
+	opts.sGoldenRecord = parser.value(optGoldenRecord);
+	opts.sGoldenCheck = parser.value(optGoldenCheck);
+	opts.dBudgetMs = qMax(0.0, parser.value(optBudget).toDouble());
+	opts.tolGolden.iLevels = qMax(0, parser.value(optLevels).toInt());
+	opts.tolGolden.dPixelPercent = qMax(0.0, parser.value(optPixels).toDouble());
+	opts.sOpenCL = parser.value(optOpenCL).toLower();
+	opts.slDevices = parser.values(optDevice);
+	opts.sPolicyFile = parser.value(optPolicy);
+	opts.bCalibrate = parser.isSet(optCalibrate);
+	opts.dFrameBudgetMs = qMax(0.0, parser.value(optFrameBudget).toDouble());
+	opts.sPack = parser.value(optPack);
+	if (!opts.sOpenCL.isEmpty() && "on" != opts.sOpenCL && "off" != opts.sOpenCL)
+		parser.showHelp(1);
+
+	int iRet = 1;
+	try
+	{
+		BatchRunner runner(opts);
+		iRet = runner.Run();
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+	}
+	return iRet;
+}
@@ -0,0 +1,299 @@
+#include "stdafx.h"
+#include "BenchRunner.h"
+#include <PipelineFactory.h>
+#include <PipelinePolicy.h>
+#include <Util.h>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <algorithm>
+#include <cmath>
+#include <opencv2/imgcodecs/imgcodecs.hpp>     // cv::imread()
+#include <opencv2/imgproc/imgproc.hpp>         // cv::resize()
+
+
+
+DECLARE_LOG_SRC("BenchRunner", LOGCAT_Common);
+
+#define RESULTS_VERSION		1		///< Bump when the JSON layout changes
+
+
+/// Nearest rank, vectNs sorted
+static double PercentileMs(const QVector<qint64>& vectNs, int iPercent)
+{
+	int iRank = qBound(0, (int)std::ceil(iPercent / 100.0 * vectNs.count()) - 1, vectNs.count() - 1);
+	return vectNs.at(iRank) / 1.0e6;
+}
+
+
+QString BenchRunner::Result::Key() const
+{
+	return QString("%1|%2|%3").arg(sStep, sInput).arg(dScale);
+}
+
+BenchRunner::BenchRunner(const Options& opts)
+	: m_opts(opts)
+{
+}
+
+int BenchRunner::Run()
+{
+	QTextStream out(stdout);
+
+	// Off by default, the numbers should not depend on the driver of the day.
+	// Through the policy, the plan switches it per step.
+	PipelinePolicy::Instance().SetOpenCL(m_opts.bOpenCL);
+	m_allocator.Install();
+
+	FindInputs();
+	if (m_vectInputs.isEmpty())
+	{
+		out << QString("No benchmark images found in '%1'\n").arg(m_opts.sImageDir);
+		return 1;
+	}
+
+	QStringList slSteps = m_opts.slSteps.isEmpty() ? PipelineFactory::StepNames() : m_opts.slSteps;
+	out << QString("%1 steps x %2 images x %3 scales, %4 runs each\n")
+		.arg(slSteps.count()).arg(m_vectInputs.count()).arg(m_opts.listScales.count()).arg(m_opts.iIterations);
+	out << QString("%1 %2 %3 %4 %5 %6 %7\n")
+		.arg("step", -16).arg("image", -32).arg("scale", 6)
+		.arg("p50 ms", 9).arg("p90 ms", 9).arg("Mpix/s", 9).arg("allocs", 7);
+	out.flush();
+
+	for (const QString& sStep : slSteps)
+	{
+		for (const Input& input : m_vectInputs)
+		{
+			for (double dScale : m_opts.listScales)
+			{
+				Result result = Measure(sStep, input, dScale);
+				m_vectResults += result;
+
+				if (result.bOk)
+				{
+					out << QString("%1 %2 %3 %4 %5 %6 %7\n")
+						.arg(result.sStep, -16).arg(result.sInput, -32).arg(result.dScale, 6, 'f', 2)
+						.arg(result.dP50Ms, 9, 'f', 2).arg(result.dP90Ms, 9, 'f', 2)
+						.arg(result.dMpixPerSec, 9, 'f', 1).arg(result.dAllocsPerRun, 7, 'f', 1);
+				}
+				else
+					out << QString("%1 %2 %3 FAILED %4\n").arg(result.sStep, -16).arg(result.sInput, -32).arg(result.dScale, 6, 'f', 2).arg(result.sError);
+				out.flush();
+			}
+		}
+	}
+
+	if (!m_opts.sOutFile.isEmpty())
+		WriteJson();
+
+	int iRet = 0;
+	for (const Result& result : m_vectResults)
+	{
+		if (!result.bOk)
+			iRet = 1;
+	}
+	if (!m_opts.sBaseline.isEmpty() && CompareBaseline() > 0)
+		iRet = 1;
+	return iRet;
+}
+
+void BenchRunner::FindInputs()
+{
+	// A fixed set, so runs on different builds measure the same thing:
+	// the phone shots, the long table shot and the first frame of each
+	// camera session
+	QDir dir(m_opts.sImageDir);
+	QStringList slFiles;
+	for (const QString& sFile : dir.entryList(QStringList() << "IMG_443?.jpg", QDir::Files, QDir::Name))
+		slFiles += sFile;
+	if (dir.exists("long_all/long_all.jpg"))
+		slFiles += "long_all/long_all.jpg";
+	QDir dirCamera(dir.absoluteFilePath("AmcrestCamera"));
+	for (const QString& sSession : dirCamera.entryList(QStringList() << "Session*", QDir::Dirs, QDir::Name))
+	{
+		QStringList slFrames = QDir(dirCamera.absoluteFilePath(sSession)).entryList(QStringList() << "*.jpg", QDir::Files, QDir::Name);
+		if (!slFrames.isEmpty())
+			slFiles += QString("AmcrestCamera/%1/%2").arg(sSession, slFrames.first());
+	}
+
+	for (const QString& sFile : slFiles)
+	{
+		Input input;
+		input.sName = sFile;
+		input.img = cv::imread(qPrintable(dir.absoluteFilePath(sFile)));
+		if (input.img.empty())
+			EXERR("BNC1", "Could not read image '%s'", qPrintable(dir.absoluteFilePath(sFile)));
+		m_vectInputs += input;
+	}
+}
+
+BenchRunner::Result BenchRunner::Measure(const QString& sStep, const Input& input, double dScale)
+{
+	Result result;
+	result.sStep = sStep;
+	result.sInput = input.sName;
+	result.dScale = dScale;
+
+	try
+	{
+		// Scaled like the GUI preview, params that are in pixels scale along
+		PipelineData data;
+		data.dScale = dScale;
+		if (1.0 == dScale)
+			input.img.copyTo(data.img);
+		else
+			cv::resize(input.img, data.img, cv::Size(), dScale, dScale, cv::INTER_AREA);
+		result.iWidth = data.img.cols;
+		result.iHeight = data.img.rows;
+
+		Pipeline pipeline;
+		pipeline += PipelineFactory::CreateStep(sStep);
+		PipelinePlan plan = pipeline.Compile(data.img.type());
+
+		// Warm up the buffer pools and OpenCV's own lazy setup
+		for (int i = 0; i < m_opts.iWarmup; ++i)
+			plan.Process(data);
+
+		QVector<qint64> vectNs;
+		m_allocator.Reset();
+		QElapsedTimer timer;
+		for (int i = 0; i < m_opts.iIterations; ++i)
+		{
+			timer.start();
+			plan.Process(data);
+			vectNs += timer.nsecsElapsed();
+		}
+		qint64 iAllocs = m_allocator.Count();
+		qint64 iAllocBytes = m_allocator.Bytes();
+
+		std::sort(vectNs.begin(), vectNs.end());
+		qint64 iTotalNs = 0;
+		for (qint64 iNs : vectNs)
+			iTotalNs += iNs;
+
+		result.iRuns = vectNs.count();
+		result.dMeanMs = iTotalNs / 1.0e6 / qMax(1, result.iRuns);
+		if (!vectNs.isEmpty())
+		{
+			result.dP50Ms = PercentileMs(vectNs, 50);
+			result.dP90Ms = PercentileMs(vectNs, 90);
+			result.dP99Ms = PercentileMs(vectNs, 99);
+			result.dMaxMs = vectNs.last() / 1.0e6;
+		}
+		if (result.dMeanMs > 0.0)
+			result.dMpixPerSec = (double)result.iWidth * result.iHeight / (result.dMeanMs * 1.0e3);
+		result.dAllocsPerRun = (double)iAllocs / qMax(1, result.iRuns);
+		result.dAllocBytesPerRun = (double)iAllocBytes / qMax(1, result.iRuns);
+		result.bOk = true;
+	}
+	catch (const std::exception& e)
+	{
+		result.sError = e.what();
+		LOGERR("%s on %s: %s", qPrintable(sStep), qPrintable(input.sName), qPrintable(result.sError));
+	}
+	return result;
+}
+
+void BenchRunner::WriteJson() const
+{
+	QJsonObject jo;
+	jo["version"] = RESULTS_VERSION;
+#ifdef _DEBUG
+	jo["build"] = "debug";
+#else
+	jo["build"] = "release";
+#endif
+	jo["opencv"] = CV_VERSION;
+	jo["qt"] = qVersion();
+	jo["opencl"] = PipelinePolicy::Instance().OpenCL();
+	jo["cv_threads"] = cv::getNumThreads();
+	jo["warmup"] = m_opts.iWarmup;
+	jo["iterations"] = m_opts.iIterations;
+
+	// In run order, which is the same for every build
+	QJsonArray jaResults;
+	for (const Result& result : m_vectResults)
+	{
+		QJsonObject joResult;
+		joResult["step"] = result.sStep;
+		joResult["image"] = result.sInput;
+		joResult["scale"] = result.dScale;
+		joResult["width"] = result.iWidth;
+		joResult["height"] = result.iHeight;
+		joResult["ok"] = result.bOk;
+		if (!result.bOk)
+			joResult["error"] = result.sError;
+		joResult["runs"] = result.iRuns;
+		joResult["mean_ms"] = result.dMeanMs;
+		joResult["p50_ms"] = result.dP50Ms;
+		joResult["p90_ms"] = result.dP90Ms;
+		joResult["p99_ms"] = result.dP99Ms;
+		joResult["max_ms"] = result.dMaxMs;
+		joResult["mpix_per_s"] = result.dMpixPerSec;
+		joResult["allocs_per_run"] = result.dAllocsPerRun;
+		joResult["alloc_bytes_per_run"] = result.dAllocBytesPerRun;
+		jaResults += joResult;
+	}
+	jo["results"] = jaResults;
+
+	Util::ForcePath(m_opts.sOutFile);
+	QFile file(m_opts.sOutFile);
+	if (!file.open(QIODevice::WriteOnly))
+		EXERR("BNC2", "Could not create '%s'", qPrintable(m_opts.sOutFile));
+	file.write(QJsonDocument(jo).toJson(QJsonDocument::Indented));
+}
+
+int BenchRunner::CompareBaseline() const
+{
+	QTextStream out(stdout);
+
+	QFile file(m_opts.sBaseline);
+	if (!file.open(QIODevice::ReadOnly))
+		EXERR("BNC3", "Could not open '%s'", qPrintable(m_opts.sBaseline));
+	QJsonParseError err;
+	QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &err);
+	if (QJsonParseError::NoError != err.error)
+		EXERR("BNC4", "'%s' is not valid JSON: %s", qPrintable(m_opts.sBaseline), qPrintable(err.errorString()));
+	if (doc.object().value("version").toInt() != RESULTS_VERSION)
+		EXERR("BNC5", "'%s' is from an incompatible version", qPrintable(m_opts.sBaseline));
+
+	QHash<QString, QJsonObject> hashBase;
+	for (const QJsonValue& jv : doc.object().value("results").toArray())
+	{
+		QJsonObject joResult = jv.toObject();
+		Result key;
+		key.sStep = joResult.value("step").toString();
+		key.sInput = joResult.value("image").toString();
+		key.dScale = joResult.value("scale").toDouble();
+		hashBase.insert(key.Key(), joResult);
+	}
+
+	// The median is the least noisy of the times. Allocations should not
+	// change at all without a reason.
+	out << QString("Compared with '%1', %2% tolerance\n").arg(m_opts.sBaseline).arg(m_opts.dTolerancePercent);
+	int iRegressions = 0;
+	double dLimit = 1.0 + m_opts.dTolerancePercent / 100.0;
+	for (const Result& result : m_vectResults)
+	{
+		if (!result.bOk || !hashBase.contains(result.Key()))
+			continue;
+
+		const QJsonObject& joBase = hashBase[result.Key()];
+		double dBaseP50Ms = joBase.value("p50_ms").toDouble();
+		double dBaseAllocs = joBase.value("allocs_per_run").toDouble();
+		bool bSlower = dBaseP50Ms > 0.0 && result.dP50Ms > dBaseP50Ms * dLimit;
+		bool bMoreAllocs = result.dAllocsPerRun > dBaseAllocs;
+		if (!bSlower && !bMoreAllocs)
+			continue;
+
+		++iRegressions;
+		out << QString("REGRESSION %1 %2 %3: p50 %4 -> %5 ms, allocs %6 -> %7\n")
+			.arg(result.sStep, -16).arg(result.sInput, -32).arg(result.dScale, 6, 'f', 2)
+			.arg(dBaseP50Ms, 0, 'f', 2).arg(result.dP50Ms, 0, 'f', 2)
+			.arg(dBaseAllocs, 0, 'f', 1).arg(result.dAllocsPerRun, 0, 'f', 1);
+	}
+	out << QString("%1 regressions\n").arg(iRegressions);
+	return iRegressions;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <Pipeline.h>
+#include "CountingAllocator.h"
+#include <QStringList>
+#include <QVector>
+
+/**
+@brief Times every factory step on a fixed set of images
+
+Each step is built with PipelineFactory::CreateStep() and compiled on its
+own, so its inputs come straight from the image with whatever conversions
+the step needs. Every step runs on every image at every scale, a few
+times to warm up and then for the measured runs, all on this thread so
+the allocation counts belong to the step.
+
+The results go to a JSON file that can be diffed between builds, or
+checked against one from an earlier build with a tolerance.
+*/
+class BenchRunner
+{
+public:
+	struct Options {
+		QString sImageDir = "test/images";
+		QStringList slSteps;		///< Empty for all steps
+		QList<double> listScales = { 0.25, 0.5, 1.0 };
+		int iWarmup = 2;
+		int iIterations = 20;
+		bool bOpenCL = false;
+		QString sOutFile;			///< JSON results, empty for none
+		QString sBaseline;			///< JSON from an earlier run to compare with
+		double dTolerancePercent = 10.0;
+	};
+
+	BenchRunner(const Options& opts);
+
+	int Run();	///< Returns the process exit code
+
+private:
+	Options m_opts;
+	CountingAllocator m_allocator;
+
+	struct Input {
+		QString sName;		///< Relative to the image dir
+		cv::Mat img;
+	};
+	QVector<Input> m_vectInputs;
+	void FindInputs();
+
+	struct Result {
+		QString sStep;
+		QString sInput;
+		double dScale = 1.0;
+		int iWidth = 0;
+		int iHeight = 0;
+		bool bOk = false;
+		QString sError;
+		int iRuns = 0;
+		double dMeanMs = 0.0;
+		double dP50Ms = 0.0;
+		double dP90Ms = 0.0;
+		double dP99Ms = 0.0;
+		double dMaxMs = 0.0;
+		double dMpixPerSec = 0.0;
+		double dAllocsPerRun = 0.0;
+		double dAllocBytesPerRun = 0.0;
+
+		QString Key() const;	///< Matches the same measurement across builds
+	};
+	QVector<Result> m_vectResults;
+
+	Result Measure(const QString& sStep, const Input& input, double dScale);
+	void WriteJson() const;
+	int CompareBaseline() const;	///< Number of regressions
+};
@@ -0,0 +1,75 @@
+#include "stdafx.h"
+#include "CountingAllocator.h"
+
+
+
+CountingAllocator::CountingAllocator()
+	: m_pStd(cv::Mat::getStdAllocator()), m_iCount(0), m_iBytes(0)
+{
+}
+
+CountingAllocator::~CountingAllocator()
+{
+	Uninstall();
+}
+
+void CountingAllocator::Install()
+{
+	if (m_pPrevious)
+		return;
+	m_pPrevious = cv::Mat::getDefaultAllocator();
+	cv::Mat::setDefaultAllocator(this);
+}
+
+void CountingAllocator::Uninstall()
+{
+	// What was allocated through us belongs to the standard allocator, so
+	// nothing out there still points here
+	if (!m_pPrevious)
+		return;
+	cv::Mat::setDefaultAllocator(m_pPrevious);
+	m_pPrevious = nullptr;
+}
+
+void CountingAllocator::Reset()
+{
+	m_iCount.storeRelaxed(0);
+	m_iBytes.storeRelaxed(0);
+}
+
+qint64 CountingAllocator::Count() const
+{
+	return m_iCount.loadRelaxed();
+}
+
+qint64 CountingAllocator::Bytes() const
+{
+	return m_iBytes.loadRelaxed();
+}
+
+cv::UMatData* CountingAllocator::allocate(int dims, const int* sizes, int type, void* data, size_t* step, int flags, cv::UMatUsageFlags usageFlags) const
+{
+	// Wrapping user memory costs nothing worth counting
+	if (!data)
+	{
+		qint64 iBytes = CV_ELEM_SIZE(type);
+		for (int d = 0; d < dims; ++d)
+			iBytes *= sizes[d];
+		m_iCount.fetchAndAddRelaxed(1);
+		m_iBytes.fetchAndAddRelaxed(iBytes);
+	}
+
+	// The buffer belongs to the standard allocator from here on, so it
+	// is also the one that frees it
+	return m_pStd->allocate(dims, sizes, type, data, step, flags, usageFlags);
+}
+
+bool CountingAllocator::allocate(cv::UMatData* u, int accessFlags, cv::UMatUsageFlags usageFlags) const
+{
+	return m_pStd->allocate(u, accessFlags, usageFlags);
+}
+
+void CountingAllocator::deallocate(cv::UMatData* u) const
+{
+	m_pStd->deallocate(u);
+}
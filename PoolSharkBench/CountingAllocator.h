@@ -0,0 +1,36 @@
+#pragma once
+
+#include <QAtomicInteger>
+#include <opencv2/core/core.hpp>
+
+
+/**
+@brief Counts the Mat and UMat buffers OpenCV allocates
+
+Install() puts it in front of the standard allocator, which still does the
+actual work. Uninstall() puts back whatever was the default before, and so
+does the destructor. Only host memory is seen, OpenCL buffers have their own
+allocator.
+*/
+class CountingAllocator : public cv::MatAllocator
+{
+public:
+	CountingAllocator();
+	~CountingAllocator();
+
+	void Install();		///< Make it the default for every new Mat and UMat
+	void Uninstall();
+	void Reset();
+	qint64 Count() const;
+	qint64 Bytes() const;
+
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, int flags, cv::UMatUsageFlags usageFlags) const override;
+	bool allocate(cv::UMatData* u, int accessFlags, cv::UMatUsageFlags usageFlags) const override;
+	void deallocate(cv::UMatData* u) const override;
+
+private:
+	cv::MatAllocator* m_pStd;
+	cv::MatAllocator* m_pPrevious = nullptr;	///< The default before Install(), null when not installed
+	mutable QAtomicInteger<qint64> m_iCount;
+	mutable QAtomicInteger<qint64> m_iBytes;
+};
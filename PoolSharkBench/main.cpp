@@ -0,0 +1,75 @@
+#include "stdafx.h"
+#include "BenchRunner.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <iostream>                        // std::cerr
+#include <Logging.h>
+
+
+
+DECLARE_LOG_SRC("main", LOGCAT_Common);
+
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication a(argc, argv);
+	QCoreApplication::setApplicationName("PoolSharkBench");
+
+	// Must be running before any Task gets started
+	Logging::LoggingSystem::Start(nullptr);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Time every Pool Shark pipeline step on the test images");
+	parser.addHelpOption();
+
+	QCommandLineOption optImages("images", "Take the test images from <dir>.", "dir", "test/images");
+	QCommandLineOption optSteps("step", "Only time <name>. Repeat for more steps.", "name");
+	QCommandLineOption optScales("scales", "Comma separated image scales.", "list", "0.25,0.5,1");
+	QCommandLineOption optWarmup("warmup", "Untimed runs before measuring.", "n", "2");
+	QCommandLineOption optIterations(QStringList() << "n" << "iterations", "Timed runs per step, image and scale.", "n", "20");
+	QCommandLineOption optOpenCL("opencl", "Let OpenCV use OpenCL.");
+	QCommandLineOption optOut(QStringList() << "o" << "out", "Write the results as JSON to <file>.", "file");
+	QCommandLineOption optBaseline("baseline", "Compare with the JSON results of an earlier build and fail on regressions.", "file");
+	QCommandLineOption optTolerance("tolerance", "How much slower than the baseline is still fine.", "percent", "10");
+	parser.addOption(optImages);
+	parser.addOption(optSteps);
+	parser.addOption(optScales);
+	parser.addOption(optWarmup);
+	parser.addOption(optIterations);
+	parser.addOption(optOpenCL);
+	parser.addOption(optOut);
+	parser.addOption(optBaseline);
+	parser.addOption(optTolerance);
+	parser.process(a);
+
+	BenchRunner::Options opts;
+	opts.sImageDir = parser.value(optImages);
+	opts.slSteps = parser.values(optSteps);
+	opts.listScales.clear();
+	for (const QString& sScale : parser.value(optScales).split(',', Qt::SkipEmptyParts))
+	{
+		double dScale = sScale.toDouble();
+		if (dScale > 0.0)
+			opts.listScales += dScale;
+	}
+	if (opts.listScales.isEmpty())
+		parser.showHelp(1);
+	opts.iWarmup = qMax(0, parser.value(optWarmup).toInt());
+	opts.iIterations = qMax(1, parser.value(optIterations).toInt());
+	opts.bOpenCL = parser.isSet(optOpenCL);
+	opts.sOutFile = parser.value(optOut);
+	opts.sBaseline = parser.value(optBaseline);
+	opts.dTolerancePercent = qMax(0.0, parser.value(optTolerance).toDouble());
+
+	int iRet = 1;
+	try
+	{
+		BenchRunner runner(opts);
+		iRet = runner.Run();
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+	}
+	return iRet;
+}
@@ -0,0 +1,2 @@
+#include <QtCore>
+#include <Logging.h>